@@ -0,0 +1,81 @@
+#include "BlockReader.h"
+
+
+void BlockReader::begin() {
+    if(mutex!=nullptr) return;
+    blockSize = MemoryPool::budget().jobBlock;
+    blocks[0] = (uint8_t*)MemoryPool::alloc(2*blockSize);
+    blocks[1] = blocks[0] + blockSize;
+    state[0] = EMPTY;
+    state[1] = EMPTY;
+    len = pos = 0;
+    mutex = xSemaphoreCreateMutex();
+    fillRequest = SDScheduler::Request{ fillFunc, this, nullptr };
+}
+
+void BlockReader::open(File f) {
+    assert(mutex!=nullptr);
+    close();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    file = f;
+    cur = 0; pos = 0; len = 0;
+    fillIdx = 0;
+    state[0] = REQUESTED;
+    state[1] = REQUESTED;
+    xSemaphoreGive(mutex);
+    requestFill();
+}
+
+void BlockReader::close() {
+    if(mutex==nullptr) return;
+    xSemaphoreTake(mutex, portMAX_DELAY); // wait for a block read in progress
+    if(file) file.close();
+    state[0] = EMPTY;
+    state[1] = EMPTY;
+    len = pos = 0;
+    xSemaphoreGive(mutex);
+}
+
+int BlockReader::nextBlock() {
+    if(state[cur] != FILLED) return isOpen() ? WAIT : END;
+
+    if(pos < blockLen[cur]) { // block has just been loaded
+        len = blockLen[cur];
+        return blocks[cur][pos++];
+    }
+
+    // current block is exhausted. A short block is the last one in a file
+    if(blockLen[cur] < blockSize) return END;
+
+    state[cur] = REQUESTED;
+    requestFill();
+    BR_DEBUGF("BlockReader: requested block %d\n", cur);
+
+    cur ^= 1; pos = 0; len = 0;
+    if(state[cur] != FILLED) return WAIT;
+    len = blockLen[cur];
+    if(len==0) return END;
+    return blocks[cur][pos++];
+}
+
+void BlockReader::requestFill() {
+    bool expected = false;
+    if(fillQueued.compare_exchange_strong(expected, true)) SDScheduler::submit(SDScheduler::JOB, &fillRequest);
+}
+
+void BlockReader::fillBlocks() {
+    fillQueued = false; // a block requested from now on needs another run
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    // blocks are requested strictly one after another, so fill them in the same order
+    while(file && state[fillIdx] == REQUESTED) {
+        blockLen[fillIdx] = file.read(blocks[fillIdx], blockSize);
+        BR_DEBUGF("BlockReader: filled block %d, %d bytes\n", fillIdx, blockLen[fillIdx]);
+        state[fillIdx] = FILLED;
+        fillIdx ^= 1;
+    }
+    xSemaphoreGive(mutex);
+}
+
+void BlockReader::fillFunc(void* arg) {
+    static_cast<BlockReader*>(arg)->fillBlocks();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+#include <atomic>
+
+#include "SDScheduler.h"
+#include "MemoryPool.h"
+
+#define BR_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+#define BR_DEBUGS(s)   // { Serial.println(s); }
+
+
+/**
+ * Double-buffered reader for a file on SD card.
+ *
+ * File is read in blocks of MemoryBudget::jobBlock bytes in SD task at job priority while the consumer
+ * is splitting lines from the other block.
+ * Consumer never blocks: `read()` returns WAIT if the next block is not loaded yet.
+ *
+ * Only one consumer task is allowed; `open()`, `close()` and `read()` must be called from it.
+ * For Job that's the task running Job::loop(), other tasks go through Job::requestFile() and friends.
+ */
+class BlockReader {
+public:
+
+    static const int END = -1;  ///< end of file reached
+    static const int WAIT = -2; ///< next block is not loaded yet
+
+    BlockReader(): mutex(nullptr), fillQueued(false) {}
+
+    /** Should be called once before any file is opened, after SDScheduler::begin() and MemoryPool::begin(). */
+    void begin();
+
+    /** File handle is shared with the caller, reader closes it on close(). */
+    void open(File f);
+
+    void close();
+
+    bool isOpen() { return (bool)file; }
+
+    inline int read() {
+        if(pos<len) return blocks[cur][pos++];
+        return nextBlock();
+    }
+
+private:
+
+    enum BlockState { EMPTY, REQUESTED, FILLED };
+
+    File file;
+    SemaphoreHandle_t mutex;
+    SDScheduler::Request fillRequest;
+    std::atomic<bool> fillQueued;
+
+    uint8_t* blocks[2];
+    size_t blockSize;
+    std::atomic<int> state[2];
+    size_t blockLen[2];
+
+    // consumer side
+    uint8_t cur;
+    size_t pos;
+    size_t len;
+
+    // prefetch side
+    uint8_t fillIdx;
+
+    int nextBlock();
+
+    void requestFill();
+
+    void fillBlocks();
+
+    static void fillFunc(void* arg);
+
+};
@@ -2,177 +2,404 @@
 
 
 #include <Arduino.h>
-#include <message_buffer.h>
-#include <etl/queue.h>
 
-class Counter {
+#include "MemoryPool.h"
+
+/**
+ * Ring of gcode lines, shared between command producers (Job, UI, web server) and the device task.
+ *
+ * A line is copied into the ring once. Device sends it straight from the ring and keeps it there
+ * until it's acknowledged, so sent-counters refer to lines in the ring instead of copying them.
+ * Lines are NUL-terminated in place.
+ *
+ * Any task can push; peekUnsent()/markSent()/release() must be called from the device task only.
+ *
+ * Entry layout: `len(1) flags(1) line(len) '\0'`. A zero len byte marks a jump to ring start.
+ *
+ * Ring memory is taken from MemoryPool and never freed; rings live as long as the device.
+ */
+class LineRing {
 public:
-    virtual void clear() = 0;
-
-    virtual bool canPush(size_t len) const = 0;
-
-    virtual bool push(char* msg, size_t len) = 0;
+    static const size_t OVERHEAD = 3;
+    static const size_t MAX_LINE = 255;
 
-    virtual size_t size() const = 0;
+    LineRing(): data(nullptr), capacity(0), head(0), sendPos(0), tail(0), used(0), 
+        nUnsent(0), nSent(0), unsentBytes(0) {}
 
-    virtual size_t getFreeLines() const = 0;
+    bool begin(size_t size) {
+        data = (uint8_t*)MemoryPool::alloc(size);
+        capacity = data!=nullptr ? size : 0;
+        clear();
+        return data!=nullptr;
+    }
 
-    virtual size_t bytes() const = 0;
+    bool isValid() const { return data!=nullptr; }
 
-    virtual size_t getFreeBytes() const = 0;
+    void clear() {
+        portENTER_CRITICAL(&mux);
+        head = sendPos = tail = 0;
+        used = 0;
+        nUnsent = nSent = 0;
+        unsentBytes = 0;
+        portEXIT_CRITICAL(&mux);
+    }
 
-    virtual size_t peek(char* &msg) = 0;
+    bool canPush(size_t len) const {
+        if(len==0 || len>MAX_LINE) return false;
+        portENTER_CRITICAL(&mux);
+        bool ok = fits(len+OVERHEAD);
+        portEXIT_CRITICAL(&mux);
+        return ok;
+    }
 
-    virtual void pop() = 0;
-};
+    bool push(const char* msg, size_t len) {
+        if(len==0 || len>MAX_LINE) return false;
+        portENTER_CRITICAL(&mux);
+        bool ok = pushLocked(msg, len);
+        portEXIT_CRITICAL(&mux);
+        return ok;
+    }
 
+    /** Pushes n lines at once or none of them, so the device task never sends a part of them */
+    bool push(const char* const msgs[], const size_t lens[], size_t n) {
+        for(size_t i=0; i<n; i++) if(lens[i]==0 || lens[i]>MAX_LINE) return false;
+        portENTER_CRITICAL(&mux);
+        size_t h = head, s = sendPos, t = tail, u = used, nu = nUnsent, ub = unsentBytes;
+        bool ok = true;
+        for(size_t i=0; i<n && ok; i++) ok = pushLocked(msgs[i], lens[i]);
+        if(!ok) { head = h; sendPos = s; tail = t; used = u; nUnsent = nu; unsentBytes = ub; } // only free space was written
+        portEXIT_CRITICAL(&mux);
+        return ok;
+    }
 
-template< uint16_t LEN_LINES = 16, uint16_t LEN_BYTES = 128, uint8_t MAX_LINE_LEN = 100 >
-class SizedQueue: public Counter {
-public:
-    SizedQueue() {
-        freeLines = LEN_LINES;
-        freeBytes = LEN_BYTES;
-        buf = xMessageBufferCreateStatic(LEN_BYTES, data, &bufStruct);
+    /** Next line to be sent. Pointer is valid until the line is released. */
+    size_t peekUnsent(char* &msg) {
+        portENTER_CRITICAL(&mux);
+        size_t n = nUnsent;
+        if(n!=0 && data[sendPos]==WRAP) sendPos = 0;
+        portEXIT_CRITICAL(&mux);
+        if(n==0) return 0;
+        msg = (char*)data+sendPos+2;
+        return data[sendPos];
     }
 
-    void clear() override {
-        xMessageBufferReset(buf);
-        havePeekedLine = false;
-        peekedLineLen = 0;
-        freeLines = LEN_LINES;
-        freeBytes = LEN_BYTES;
+    /** Marks line returned by peekUnsent() as sent. If done is true, it's not waiting for an ack and is released at once. */
+    void markSent(bool done=false) {
+        portENTER_CRITICAL(&mux);
+        if(nUnsent!=0) {
+            if(data[sendPos]==WRAP) sendPos = 0;
+            uint8_t len = data[sendPos];
+            if(done) data[sendPos+1] |= DONE;
+            sendPos += len+OVERHEAD; if(sendPos==capacity) sendPos = 0;
+            nUnsent--;
+            unsentBytes -= len;
+            nSent++;
+            if(done) sweep();
+        }
+        portEXIT_CRITICAL(&mux);
     }
 
-    bool canPush(size_t len) const override {
-        if(len>MAX_LINE_LEN) len = MAX_LINE_LEN;
-        return freeBytes>len+1 && freeLines>0;
+    /** Releases the oldest sent line, called when it's acknowledged. */
+    void release() {
+        portENTER_CRITICAL(&mux);
+        size_t p = tail;
+        for(size_t k=nSent; k>0; k--) {
+            if(data[p]==WRAP) p = 0;
+            if( (data[p+1] & DONE)==0 ) { data[p+1] |= DONE; break; }
+            p += data[p]+OVERHEAD; if(p==capacity) p = 0;
+        }
+        sweep();
+        portEXIT_CRITICAL(&mux);
     }
 
-    bool push(char* msg, size_t len)  override  {
-        if(!canPush(len)) return false;
-        if(len>MAX_LINE_LEN) len = MAX_LINE_LEN;
-        assert( xMessageBufferSend(buf, msg, len, 0) );
-        freeLines --;
-        freeBytes -= len+1;
+    size_t getUnsentLines() const { return nUnsent; }
+
+    /** Length of lines not sent yet */
+    size_t getUnsentBytes() const { return unsentBytes; }
+
+    /** Used space, including lines waiting for an ack */
+    size_t bytes() const { return used; }
+
+    size_t getCapacity() const { return capacity; }
+
+private:
+    static const uint8_t WRAP = 0;
+    static const uint8_t DONE = 1;
+
+    uint8_t *data;
+    size_t capacity;
+    size_t head, sendPos, tail;
+    size_t used;
+    size_t nUnsent, nSent;
+    size_t unsentBytes;
+    mutable portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    bool pushLocked(const char* msg, size_t len) {
+        const size_t need = len+OVERHEAD;
+        if(used==0) head = sendPos = tail = 0; // keep the whole ring contiguous when possible
+        if(!fits(need)) return false;
+        if(capacity-head < need) { used += capacity-head; data[head] = WRAP; head = 0; }
+        data[head] = len;
+        data[head+1] = 0;
+        memcpy(data+head+2, msg, len);
+        data[head+2+len] = 0;
+        head += need; if(head==capacity) head = 0;
+        used += need;
+        nUnsent++;
+        unsentBytes += len;
         return true;
     }
 
-    inline size_t size() const override  {
-        return LEN_LINES-freeLines;
+    bool fits(size_t need) const {
+        if(used==0) return need <= capacity;  // push() rewinds an empty ring
+        size_t pad = capacity-head >= need ? 0 : capacity-head;
+        return used + pad + need <= capacity;
     }
 
-    inline size_t getFreeLines() const override  {
-        return freeLines;
+    void sweep() {
+        while(nSent!=0) {
+            if(data[tail]==WRAP) { used -= capacity-tail; tail = 0; }
+            if( (data[tail+1] & DONE)==0 ) break;
+            size_t sz = data[tail]+OVERHEAD;
+            used -= sz;
+            tail += sz; if(tail==capacity) tail = 0;
+            nSent--;
+        }
     }
+};
 
-    inline size_t bytes() const override  {
-        return LEN_BYTES-freeBytes;
+
+/**
+ * Copies of the last sent lines, indexed by line number, to replay them on resend request.
+ * A line number maps to slot `n % lines`, so it holds as many lines as the sent window may keep in flight.
+ */
+class LineHistory {
+public:
+    static const size_t SLOT_LEN = 96; ///< Marlin MAX_CMD_SIZE, longer lines can't be numbered anyway
+
+    LineHistory(): slots(nullptr), nSlots(0) {}
+
+    bool begin(size_t lines) {
+        slots = (Slot*)MemoryPool::alloc(lines*sizeof(Slot));
+        nSlots = slots!=nullptr ? lines : 0;
+        clear();
+        return slots!=nullptr;
     }
 
-    inline size_t getFreeBytes() const  override {
-        return freeBytes;
+    bool isValid() const { return slots!=nullptr; }
+
+    size_t size() const { return nSlots; }
+
+    void clear() {
+        for(size_t i=0; i<nSlots; i++) slots[i].len = 0;
     }
 
-    size_t peek(char* &msg) override  {
-        if(size() == 0) return 0;
-        if(!havePeekedLine) {
-            loadLineFromBuf();
-        }
-        //len = peekedLineLen;
-        msg = peekedLine;
-        return peekedLineLen;
+    void store(uint32_t n, const char* line, size_t len) {
+        if(nSlots==0) return;
+        Slot &s = slots[n%nSlots];
+        s.n = n;
+        if(len>SLOT_LEN) { s.len = 0; return; } // forget the older line in this slot anyway
+        memcpy(s.line, line, len);
+        s.line[len] = 0;
+        s.len = len;
     }
 
-    void pop()  override {
-        if(size() == 0) return;
-        freeLines ++;
-        if(havePeekedLine) {
-            freeBytes += peekedLineLen+1;
-            havePeekedLine = false;
-            peekedLineLen = 0;
-        } else {
-            size_t r = xMessageBufferReceive(buf, peekedLine, MAX_LINE_LEN, 0);
-            freeBytes += r+1;
+    /** Returns 0 if the line is no longer kept */
+    size_t get(uint32_t n, const char* &line) const {
+        if(nSlots==0) return 0;
+        const Slot &s = slots[n%nSlots];
+        if(s.len==0 || s.n!=n) return 0;
+        line = s.line;
+        return s.len;
+    }
+
+private:
+    struct Slot {
+        uint32_t n;
+        uint8_t len;
+        char line[SLOT_LEN+1];
+    };
+    Slot *slots;
+    size_t nSlots;
+};
+
+
+/**
+ * Bytes written to the device ahead of any queued line, e.g. Grbl realtime commands.
+ * Any task can push; the device task pops them on its next iteration.
+ */
+class RealtimeQueue {
+public:
+    static const size_t SIZE = 32;
+
+    RealtimeQueue(): head(0), count(0) {}
+
+    /** All or nothing */
+    bool push(const uint8_t* b, size_t n) {
+        portENTER_CRITICAL(&mux);
+        bool ok = count+n <= SIZE;
+        if(ok) {
+            for(size_t i=0; i<n; i++) data[(head+count+i)%SIZE] = b[i];
+            count += n;
         }
+        portEXIT_CRITICAL(&mux);
+        return ok;
+    }
 
+    size_t pop(uint8_t* b, size_t max) {
+        portENTER_CRITICAL(&mux);
+        size_t n = count<max ? count : max;
+        for(size_t i=0; i<n; i++) b[i] = data[(head+i)%SIZE];
+        head = (head+n)%SIZE;
+        count -= n;
+        portEXIT_CRITICAL(&mux);
+        return n;
     }
 
+    void clear() {
+        portENTER_CRITICAL(&mux);
+        head = count = 0;
+        portEXIT_CRITICAL(&mux);
+    }
 
 private:
-    MessageBufferHandle_t buf;
-    StaticMessageBuffer_t bufStruct;
-    uint8_t data[LEN_BYTES];
-
-    size_t freeLines;
-    size_t freeBytes;
-    char peekedLine[MAX_LINE_LEN+1];
-    size_t peekedLineLen;
-    bool havePeekedLine;
-
-    bool loadLineFromBuf() {
-        peekedLineLen = xMessageBufferReceive(buf, peekedLine, MAX_LINE_LEN, 0);
-        havePeekedLine = peekedLineLen>0;
-        peekedLine[peekedLineLen]=0;
-        return havePeekedLine;
-    }
+    uint8_t data[SIZE];
+    size_t head, count;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+
+class Counter {
+public:
+    virtual void clear() = 0;
+
+    virtual bool canPush(size_t len) const = 0;
+
+    /** Line stays in the ring until it's popped from the counter */
+    virtual bool push(const char* msg, size_t len, LineRing* ring) = 0;
+
+    virtual size_t size() const = 0;
+
+    virtual size_t getFreeLines() const = 0;
+
+    virtual size_t bytes() const = 0;
+
+    virtual size_t getFreeBytes() const = 0;
+
+    virtual size_t peek(const char* &msg) = 0;
+
+    /** Releases line in its ring */
+    virtual void pop() = 0;
 };
 
 
-template< uint16_t LEN_LINES = 16, uint16_t LEN_BYTES = 128, uint8_t SUFFIX_LEN=1>
-class SimpleCounter : public Counter {
+/**
+ * Character-counting window of sent lines. 
+ * Up to `begin(lines)` lines and LEN_BYTES bytes; actual limits may be lowered at runtime with setLimits().
+ * 
+ * Oldest lines may be marked as drained (firmware reported they have left its RX buffer), 
+ * their bytes are not counted against the window until they are acknowledged.
+ */
+template< uint16_t LEN_BYTES = 128, uint8_t SUFFIX_LEN=1>
+class SimpleCounter final : public Counter {
 public:
-    SimpleCounter() {
-        freeBytes = LEN_BYTES;
+    SimpleCounter(): entries(nullptr), capacity(0), maxLines(0), maxBytes(LEN_BYTES), usedBytes(0), head(0), count(0), drained(0) {}
+
+    /** Takes room for lines from MemoryPool; nothing can be pushed before */
+    bool begin(size_t lines) {
+        entries = (Entry*)MemoryPool::alloc(lines*sizeof(Entry));
+        capacity = entries!=nullptr ? lines : 0;
+        maxLines = capacity;
+        clear();
+        return entries!=nullptr;
     }
 
+    size_t getCapacity() const { return capacity; }
+
     void clear()  override {
-        queue.clear();
-        freeBytes = LEN_BYTES;
+        head = count = drained = 0;
+        usedBytes = 0;
     }
 
+    /** Can be called with lines in flight; new limit applies to the next pushed lines */
+    void setLimits(size_t lines, size_t bytes) {
+        maxLines = lines<capacity ? lines : capacity;
+        maxBytes = bytes<LEN_BYTES ? bytes : LEN_BYTES;
+    }
+
+    size_t getMaxLines() const { return maxLines; }
+
+    size_t getMaxBytes() const { return maxBytes; }
+
+    /** Marks n oldest lines as drained from device RX buffer */
+    void setDrained(size_t n) {
+        if(n>count) n = count;
+        for(; drained<n; drained++) usedBytes -= at(drained).len+SUFFIX_LEN;
+        for(; drained>n; drained--) usedBytes += at(drained-1).len+SUFFIX_LEN;
+    }
+
+    size_t getDrained() const { return drained; }
+
     bool canPush(size_t len) const override {
-        return queue.size()<LEN_LINES && freeBytes >= len+SUFFIX_LEN;
+        return count<maxLines && usedBytes+len+SUFFIX_LEN <= maxBytes;
     }
 
-    bool push(char* msg, size_t len) override {
+    bool push(const char* msg, size_t len, LineRing* ring) override {
         if(!canPush(len)) return false;
-        queue.push(len);
-        freeBytes -= len+SUFFIX_LEN;
+        entries[(head+count)%capacity] = Entry{msg, len, ring};
+        count++;
+        usedBytes += len+SUFFIX_LEN;
         return true;
     }
 
     inline size_t size() const  override {
-        return queue.size();
+        return count;
     }
 
     inline size_t getFreeLines() const  override {
-        return LEN_LINES - queue.size();
+        return count<maxLines ? maxLines - count : 0;
     }
 
     inline size_t bytes() const  override {
-        return LEN_BYTES-freeBytes;
+        return usedBytes;
     }
 
     inline size_t getFreeBytes() const  override {
-        return freeBytes;
+        return usedBytes<maxBytes ? maxBytes-usedBytes : 0;
     }
 
-    size_t peek(char* &msg)  override {
-        if(queue.size()==0) return 0;
-        return queue.front();
+    size_t peek(const char* &msg)  override {
+        if(count==0) return 0;
+        msg = at(0).msg;
+        return at(0).len;
     }
 
     void pop()  override {
-        if(queue.size()==0) return ;
-        size_t v = queue.front();
-        queue.pop();
-        freeBytes += v+SUFFIX_LEN;
+        if(count==0) return ;
+        const Entry &e = at(0);
+        if(e.ring!=nullptr) e.ring->release();
+        if(drained>0) drained--; 
+        else usedBytes -= e.len+SUFFIX_LEN;
+        head = (head+1)%capacity;
+        count--;
     }
 
 
 
 private:
-    etl::queue<size_t, LEN_LINES> queue;
-    size_t freeBytes;
+    struct Entry {
+        const char* msg;
+        size_t len;
+        LineRing* ring;
+    };
+    Entry *entries;
+    size_t capacity;
+    size_t maxLines;
+    size_t maxBytes;
+    size_t usedBytes;
+    size_t head;
+    size_t count;
+    size_t drained;
+
+    inline const Entry& at(size_t i) const { return entries[(head+i)%capacity]; }
 };
@@ -0,0 +1,141 @@
+#include "DirIndex.h"
+
+#include <algorithm>
+
+
+SemaphoreHandle_t DirIndex::mutex = nullptr;
+DirIndex::Dir DirIndex::dirs[MAX_DIRS];
+uint32_t DirIndex::useCounter = 0;
+
+
+void DirIndex::begin() {
+    if(mutex!=nullptr) return;
+    mutex = xSemaphoreCreateMutex();
+    for(Dir &d: dirs) { d = Dir{}; d.valid = false; }
+}
+
+bool DirIndex::isGCode(const char* name) {
+    const char* dot = strrchr(name, '.');
+    if(dot==nullptr) return true; // files without extension can be printed
+    dot++;
+    return strcasecmp(dot, "gcode")==0 || strcasecmp(dot, "nc")==0 || strcasecmp(dot, "gc")==0 || strcasecmp(dot, "gco")==0;
+}
+
+bool DirIndex::isHidden(const char* name) {
+    const char* dot = strrchr(name, '.');
+    if(dot==nullptr) return false;
+    return strcmp(dot, ".jc")==0 || strcmp(dot, ".jt")==0 || strcmp(dot, ".ji")==0 || strcmp(dot, ".tmp")==0;
+}
+
+String DirIndex::parent(const String &path) {
+    int p = path.lastIndexOf('/');
+    if(p<=0) return "/";
+    return path.substring(0, p);
+}
+
+DirIndex::Dir* DirIndex::acquire(const String &path) {
+    assert(mutex!=nullptr);
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for(Dir &d: dirs) {
+        if(d.valid && d.path==path) { d.usedAt = ++useCounter; return &d; }
+    }
+    xSemaphoreGive(mutex);
+
+    // scan without the lock, listings of other directories remain available
+    Dir fresh{};
+    if(!load(path, fresh)) { clear(fresh); return nullptr; }
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    Dir *slot = &dirs[0];
+    for(Dir &d: dirs) {
+        if(d.valid && d.path==path) { slot = &d; break; } // loaded by someone else meanwhile
+        if(!d.valid) slot = &d;
+        else if(slot->valid && d.usedAt < slot->usedAt) slot = &d;
+    }
+    clear(*slot);
+    *slot = fresh;
+    slot->valid = true;
+    slot->usedAt = ++useCounter;
+    return slot;
+}
+
+void DirIndex::invalidate(const String &path) {
+    if(mutex==nullptr) return;
+    String dir = parent(path);
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for(Dir &d: dirs) {
+        if(d.valid && (d.path==dir || d.path==path) ) { DI_DEBUGF("DirIndex: invalidated %s\n", d.path.c_str() ); clear(d); }
+    }
+    xSemaphoreGive(mutex);
+}
+
+bool DirIndex::load(const String &path, Dir &d) {
+    uint32_t t = millis();
+    File dir;
+    bool isDir = false;
+    { SDScheduler::BusLock bus; dir = SD.open(path); isDir = dir && dir.isDirectory(); } // not held with the cache lock, invalidate() is called under it
+    if(!dir) return false;
+    if(!isDir) { dir.close(); return false; }
+    d.path = path;
+    while(true) {
+        File f;
+        SDScheduler::run(SDScheduler::INTERACTIVE, [&]() { f = dir.openNextFile(); });
+        if(!f) break;
+        const char* name = strrchr(f.name(), '/');
+        name = name!=nullptr ? name+1 : f.name();
+        bool ok = isHidden(name) || add(d, name, f.size(), f.isDirectory() );
+        f.close();
+        if(!ok) break;
+    }
+    dir.close();
+    sort(d);
+    DI_DEBUGF("DirIndex: loaded %s, %d entries in %d ms\n", path.c_str(), d.n, millis()-t );
+    return d.order[ALL]!=nullptr || d.n==0;
+}
+
+bool DirIndex::add(Dir &d, const char* name, uint32_t size, bool isDir) {
+    if(d.n>=MAX_ENTRIES) return false;
+    size_t len = strlen(name)+1;
+    if(d.namesLen+len > d.namesCap) {
+        size_t cap = d.namesCap==0 ? 1024 : d.namesCap*2;
+        while(cap < d.namesLen+len) cap *= 2;
+        char* p = (char*)realloc(d.names, cap);
+        if(p==nullptr) return false;
+        d.names = p; d.namesCap = cap;
+    }
+    if(d.n==d.cap) {
+        size_t cap = d.cap==0 ? 32 : d.cap*2;
+        Entry* p = (Entry*)realloc(d.entries, cap*sizeof(Entry));
+        if(p==nullptr) return false;
+        d.entries = p; d.cap = cap;
+    }
+    memcpy(d.names+d.namesLen, name, len);
+    d.entries[d.n++] = Entry{ size, (uint32_t)d.namesLen, isDir };
+    d.namesLen += len;
+    return true;
+}
+
+void DirIndex::sort(Dir &d) {
+    for(int f=0; f<N_FILTERS; f++) {
+        d.orderLen[f] = 0;
+        d.order[f] = d.n>0 ? (uint16_t*)malloc(d.n*sizeof(uint16_t)) : nullptr;
+        if(d.order[f]==nullptr) continue;
+        for(size_t i=0; i<d.n; i++) {
+            const Entry &e = d.entries[i];
+            if(f==ALL || e.isDir || isGCode(d.names+e.nameOfs) ) d.order[f][d.orderLen[f]++] = i;
+        }
+        std::sort(d.order[f], d.order[f]+d.orderLen[f], [&d](uint16_t a, uint16_t b) {
+            const Entry &ea = d.entries[a], &eb = d.entries[b];
+            if(ea.isDir!=eb.isDir) return ea.isDir;
+            return strcasecmp(d.names+ea.nameOfs, d.names+eb.nameOfs) < 0;
+        });
+    }
+}
+
+void DirIndex::clear(Dir &d) {
+    free(d.names);
+    free(d.entries);
+    for(int f=0; f<N_FILTERS; f++) free(d.order[f]);
+    d = Dir{};
+    d.valid = false;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "SDScheduler.h"
+
+#define DI_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+
+
+/**
+ * Cache of SD directory listings, shared by FileChooser and /fs web listing.
+ *
+ * A directory is scanned once; names go to one arena, sizes and types to a table, and two sorted
+ * orders (everything; directories and gcode only) are built, so a page of any listing is read
+ * by index. The MAX_DIRS most recently used directories are kept. Job cache sidecars are hidden.
+ *
+ * Whoever changes a directory on SD should invalidate() it. FAT doesn't update directory times,
+ * so the cache can't notice a card edited elsewhere and is kept in RAM only.
+ */
+class DirIndex {
+public:
+
+    enum Filter { ALL, GCODE, N_FILTERS };  ///< GCODE: directories and gcode files
+
+    static const size_t MAX_DIRS = 2;
+    static const size_t MAX_ENTRIES = 1024;  ///< per directory, the rest is not listed
+
+    struct Item {
+        const char* name;  ///< without path
+        uint32_t size;
+        bool isDir;
+    };
+
+    /** Should be called once before listing, after SDScheduler::begin() */
+    static void begin();
+
+    /**
+     * Calls f(const Item&) for entries [start, start+count) of a sorted listing; directories go first.
+     * Loads directory if it's not cached. Returns number of entries in the listing, 0 if there is no such directory.
+     * f runs under the cache lock, it must not call DirIndex.
+     */
+    template<typename F>
+    static size_t list(const String &path, Filter filter, size_t start, size_t count, F f) {
+        Dir *d = acquire(path);
+        if(d==nullptr) return 0;
+        size_t total = d->orderLen[filter];
+        for(size_t i=start; i<total && i-start<count; i++) {
+            const Entry &e = d->entries[ d->order[filter][i] ];
+            f( Item{ d->names+e.nameOfs, e.size, e.isDir } );
+        }
+        xSemaphoreGive(mutex);
+        return total;
+    }
+
+    /** Drops cached listing of a directory and of the directory containing path */
+    static void invalidate(const String &path);
+
+    static bool isGCode(const char* name);
+
+    /** Job cache sidecars and temporary files */
+    static bool isHidden(const char* name);
+
+private:
+
+    struct Entry {
+        uint32_t size;
+        uint32_t nameOfs;
+        bool isDir;
+    };
+
+    struct Dir {
+        String path;
+        bool valid;
+        uint32_t usedAt;
+        char* names;
+        size_t namesLen, namesCap;
+        Entry* entries;
+        size_t n, cap;
+        uint16_t* order[N_FILTERS];
+        size_t orderLen[N_FILTERS];
+    };
+
+    static SemaphoreHandle_t mutex;
+    static Dir dirs[MAX_DIRS];
+    static uint32_t useCounter;
+
+    /** Returns cached directory with mutex taken, or nullptr */
+    static Dir* acquire(const String &path);
+
+    static bool load(const String &path, Dir &d);
+
+    static bool add(Dir &d, const char* name, uint32_t size, bool isDir);
+
+    static void sort(Dir &d);
+
+    /** Frees listing memory */
+    static void clear(Dir &d);
+
+    static String parent(const String &path);
+
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <etl/observer.h>
+
+
+/**
+ * Coalescing replacement of etl::observable.
+ * Publishers post() bit flags of changed fields from any task, which only ORs them into a pending mask.
+ * Owner task calls dispatch() once per tick: each observer receives one notification with every
+ * field it subscribed to that changed since its last notification.
+ *
+ * An observer may set a minimum interval between notifications; fields changed meanwhile are kept
+ * for it till the interval passes. Urgent fields are delivered at once regardless of the interval.
+ *
+ * TEvent must be constructible from `uint32_t` field mask.
+ */
+template<typename TEvent, size_t MAX_OBSERVERS>
+class EventBus {
+public:
+    using Observer = etl::observer<const TEvent&>;
+
+    static const uint32_t ALL_FIELDS = 0xFFFFFFFF;
+
+    EventBus(uint32_t urgentFields = 0): urgent(urgentFields), pending(0), nObservers(0) {}
+
+    /** Must be called before dispatching starts */
+    bool add_observer(Observer &o, uint32_t fields = ALL_FIELDS, uint32_t minInterval = 0) {
+        if(nObservers>=MAX_OBSERVERS) return false;
+        subs[nObservers++] = Subscriber{&o, fields, minInterval, 0, 0};
+        return true;
+    }
+
+    void clear_observers() { nObservers = 0; }
+
+    /** Cheap, may be called from any task; observers are called from dispatch() only */
+    void post(uint32_t fields) { pending.fetch_or(fields, std::memory_order_relaxed); }
+
+    void dispatch() {
+        uint32_t fields = pending.exchange(0, std::memory_order_relaxed);
+        uint32_t now = millis();
+        for(size_t i=0; i<nObservers; i++) {
+            Subscriber &s = subs[i];
+            s.changed |= fields & s.fields;
+            if(s.changed==0) continue;
+            if( (s.changed & urgent)==0 && now-s.lastNotified < s.minInterval ) continue;
+            uint32_t c = s.changed;
+            s.changed = 0;
+            s.lastNotified = now;
+            s.observer->notification( TEvent(c) );
+        }
+    }
+
+private:
+    struct Subscriber {
+        Observer *observer;
+        uint32_t fields;
+        uint32_t minInterval;
+        uint32_t lastNotified;
+        uint32_t changed;
+    };
+
+    const uint32_t urgent;
+    std::atomic<uint32_t> pending;
+    Subscriber subs[MAX_OBSERVERS];
+    size_t nObservers;
+};
@@ -4,8 +4,14 @@
 #include <SD.h>
 #include <WiFi.h>
 #include <AsyncJson.h>
+#include <lwip/opt.h>  // TCP_WND
 
 #include "Job.h"
+#include "JobCache.h"
+#include "JobQueue.h"
+#include "SDScheduler.h"
+#include "DirIndex.h"
+#include "Stats.h"
 
 #define API_VERSION     "0.1"
 #define SKETCH_VERSION  "0.0.1"
@@ -13,13 +19,13 @@
 
 WebServer* WebServer::inst = nullptr;
 
-extern HardwareSerial PrinterSerial; // dirty hack
 
 void WebServer::config(JsonObjectConst cfg ) {
 
     essid = cfg.containsKey("essid") ? cfg["essid"].as<String>() : "WiFi";
     password = cfg.containsKey("password") ? cfg["password"].as<String>() : "Password";
     hostname = cfg.containsKey("hostname") ? cfg["hostname"].as<String>() : "espendant";
+    if(cfg.containsKey("uploadCache")) uploadCache = cfg["uploadCache"].as<bool>();
 
 }
 
@@ -53,30 +59,21 @@ void WebServer::begin() {
     MDNS.addServiceTxt("http", "tcp", "api", API_VERSION);
     MDNS.addServiceTxt("http", "tcp", "version", SKETCH_VERSION);
 
+    uploader.begin();
+
     registerOptoPrintApi();
     registerWebBrowser();
 
+    events.onConnect( [this](AsyncEventSourceClient *client) {
+        pushFull = true;
+        wakePush();
+    });
+    server.addHandler(&events);
+
     server.begin();
 
 
-    telnetServer.onClient( [this](void* arg, AsyncClient *cli) {
-        Serial.print("telnetServer.onClient "); cli->remoteIP().printTo(Serial);Serial.println("");
-        telnetClients.insert(cli);
-        cli->onData( [](void* arg, AsyncClient* client, void *data, size_t len) {
-            char t[50]; memcpy(t, data, min(len,size_t(49)) ); t[min(size_t(49),len)]=0;
-            Serial.printf("telnetServer onData: %s\n", t);
-            GCodeDevice *dev = GCodeDevice::getDevice();
-            if(dev==nullptr) return;
-            PrinterSerial.write((uint8_t*)data, len);
-        } );
-        cli->onTimeout( [](void* t, AsyncClient* cli_, uint32_t tm) { Serial.print("telnetServer onTimeout "); cli_->remoteIP().printTo(Serial); Serial.println("");}  );
-        cli->onError( [](void* t, AsyncClient* cli_, uint16_t e) { Serial.print("telnetServer onError "); cli_->remoteIP().printTo(Serial); Serial.println("");}  );
-        cli->onDisconnect( [this](void* t, AsyncClient* cli_) { 
-            Serial.print("telnetServer onDisconnect "); cli_->remoteIP().printTo(Serial); Serial.println("");
-            telnetClients.erase(cli_); 
-        } );
-    }, nullptr );
-    telnetServer.begin();
+    telnet.begin();
 
     running = true;
     notify_observers( WebServerStatusEvent{0} );
@@ -86,29 +83,19 @@ void WebServer::begin() {
 void WebServer::stop() {
     if(running) {
         server.end();
-        telnetServer.end();
+        telnet.end();
         running = false;
         notify_observers( WebServerStatusEvent{0} );
     }
 }
 
 void WebServer::resendDeviceResponse(const char* data, size_t len) {
-    constexpr char crlf[]="\n\r";
-    for(const auto &cli: telnetClients) {
-        if(cli->canSend() ) {
-            cli->write(data, len);
-            cli->write(crlf, strlen(crlf) );
-        } else Serial.printf("WebServer::resendDeviceResponse:  cannot send\n");
-    }
+    telnet.deviceOutput(data, len);
 }
 
-inline String stringify(bool value) {
-  return value ? "true" : "false";
-}
-
-String getStateText(Job * job = nullptr, MarlinDevice * dev = nullptr) {
+const char* getStateText(Job * job = nullptr, GCodeDevice * dev = nullptr) {
     if(job==nullptr) job=Job::getJob();
-    if(dev==nullptr) dev=static_cast<MarlinDevice*>( GCodeDevice::getDevice() );
+    if(dev==nullptr) dev=GCodeDevice::getDevice();
     if(dev==nullptr) return "Discovering";
     if(dev->isInPanic()) return "Error";
     if(!dev->isConnected() ) return "Offline";
@@ -118,6 +105,105 @@ String getStateText(Job * job = nullptr, MarlinDevice * dev = nullptr) {
     return "Operational";
 }
 
+static bool fileExists(const String &path) {
+    SDScheduler::BusLock bus;
+    return SD.exists(path);
+}
+
+/** Serializes straight into the response buffer, sized to fit, without intermediate Strings; headers may be added before it's sent */
+static AsyncResponseStream* jsonResponse(AsyncWebServerRequest *request, const JsonDocument &doc, int code=200) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json", measureJson(doc)+1 );
+    response->setCode(code);
+    serializeJson(doc, *response);
+    return response;
+}
+
+static void sendJson(AsyncWebServerRequest *request, const JsonDocument &doc, int code=200) {
+    request->send(jsonResponse(request, doc, code));
+}
+
+/**
+ * Error of an upload, kept in the request until its completion handler sends it.
+ * The request frees _tempObject when it's deleted.
+ */
+struct UploadError {
+    int code;
+    const char* message;
+};
+
+static void rejectUpload(AsyncWebServerRequest *request, int code, const char* message) {
+    if(request->_tempObject!=nullptr) return; // the first error is sent
+    UploadError *e = (UploadError*)malloc(sizeof(UploadError));
+    if(e==nullptr) return;
+    e->code = code;
+    e->message = message;
+    request->_tempObject = e;
+}
+
+/** Sends the error of a failed upload; false if it didn't fail */
+static bool sendUploadError(AsyncWebServerRequest *request) {
+    UploadError *e = (UploadError*)request->_tempObject;
+    if(e==nullptr) return false;
+    request->send(e->code, "text/plain", e->message);
+    return true;
+}
+
+void WebServer::pushLoop() {
+    pushTask = xTaskGetCurrentTaskHandle();
+    telnet.setWakeTask(pushTask);
+    uint32_t wait = TelnetBridge::IDLE;
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, wait==TelnetBridge::IDLE ? portMAX_DELAY : pdMS_TO_TICKS(wait) );
+        if(pushRequested.exchange(false)) pushState();
+        wait = telnet.loop();
+    }
+}
+
+/** 
+ * Sends "state" event with fields changed since the last push, compared on snapshots.
+ * One event goes to all subscribers, so their number doesn't change the work done here.
+ */
+void WebServer::pushState() {
+    if(events.count()==0) return;
+    GCodeDevice *dev = GCodeDevice::getDevice();
+    DeviceSnapshot d = {};
+    if(dev!=nullptr) d = dev->getSnapshot();
+    JobSnapshot j = Job::getJob()->getSnapshot();
+    const char* state = getStateText();
+    bool full = pushFull.exchange(false);
+
+    StaticJsonDocument< JSON_OBJECT_SIZE(8) + 4*JSON_ARRAY_SIZE(3) > doc;
+    if(full || state!=pushedState) doc["state"] = state;
+    if(full || strcmp(d.state, pushedDev.state)!=0) doc["status"] = d.state;
+    if(full || d.x!=pushedDev.x || d.y!=pushedDev.y || d.z!=pushedDev.z) {
+        JsonArray pos = doc.createNestedArray("pos");
+        pos.add(d.x); pos.add(d.y); pos.add(d.z);
+    }
+    if(full || memcmp(d.ofs, pushedDev.ofs, sizeof(d.ofs))!=0) {
+        JsonArray ofs = doc.createNestedArray("wco");
+        ofs.add(d.ofs[0]); ofs.add(d.ofs[1]); ofs.add(d.ofs[2]);
+    }
+    if(d.type=='m' && (full || d.toolTemp!=pushedDev.toolTemp || d.toolTarget!=pushedDev.toolTarget
+            || d.bedTemp!=pushedDev.bedTemp || d.bedTarget!=pushedDev.bedTarget) ) {
+        JsonArray t = doc.createNestedArray("temp");  // tool actual, target, bed actual, target
+        t.add(d.toolTemp); t.add(d.toolTarget); t.add(d.bedTemp); t.add(d.bedTarget);
+    }
+    if(full || j.completion!=pushedJob.completion) doc["completion"] = j.completion*100;
+    if(full || d.sentQueue!=pushedDev.sentQueue || d.queue!=pushedDev.queue) {
+        JsonArray q = doc.createNestedArray("queue");  // sent, scheduled bytes
+        q.add(d.sentQueue); q.add(d.queue);
+    }
+    pushedDev = d;
+    pushedJob = j;
+    pushedState = state;
+    if(doc.size()==0) return;
+
+    char buf[256];
+    size_t len = serializeJson(doc, buf, sizeof(buf));
+    if(len==0 || len>=sizeof(buf)) return;
+    events.send(buf, "state");
+}
+
 void WebServer::registerOptoPrintApi() {
     
     server.on("/api/login", HTTP_POST, [](AsyncWebServerRequest * request) {
@@ -139,28 +225,22 @@ void WebServer::registerOptoPrintApi() {
     server.on("/api/connection", HTTP_GET, [](AsyncWebServerRequest * request) {
         Serial.printf("/api/connection");
         // http://docs.octoprint.org/en/master/api/connection.html#get-connection-settings
-        String baudsString; baudsString.reserve(50);
-        for(int i=0; i<DeviceDetector::N_SERIAL_BAUDS; i++) {
-            if(i!=0) baudsString += ", ";
-            baudsString += String(DeviceDetector::serialBauds[i]);
-        }
-        request->send(200, "application/json", "{\r\n"
-                "  \"current\": {\r\n"
-                "    \"state\": \"" + getStateText() + "\",\r\n"
-                "    \"port\": \"Serial\",\r\n"
-                "    \"baudrate\": " + DeviceDetector::serialBaud + ",\r\n"
-                "    \"printerProfile\": \"Default\"\r\n"
-                "  },\r\n"
-                "  \"options\": {\r\n"
-                "    \"ports\": \"Serial\",\r\n"
-                "    \"baudrates\": ["+baudsString+"],\r\n"
-                "    \"printerProfiles\": \"Default\",\r\n"
-                "    \"portPreference\": \"Serial\",\r\n"
-                "    \"baudratePreference\": 115200,\r\n"
-                "    \"printerProfilePreference\": \"Default\",\r\n"
-                "    \"autoconnect\": true\r\n"
-                "  }\r\n"
-                "}");
+        StaticJsonDocument< JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(DeviceDetector::N_SERIAL_BAUDS) > doc;
+        JsonObject current = doc.createNestedObject("current");
+        current["state"] = getStateText();
+        current["port"] = "Serial";
+        current["baudrate"] = DeviceDetector::serialBaud;
+        current["printerProfile"] = "Default";
+        JsonObject options = doc.createNestedObject("options");
+        options["ports"] = "Serial";
+        JsonArray bauds = options.createNestedArray("baudrates");
+        for(int i=0; i<DeviceDetector::N_SERIAL_BAUDS; i++) bauds.add( DeviceDetector::serialBauds[i] );
+        options["printerProfiles"] = "Default";
+        options["portPreference"] = "Serial";
+        options["baudratePreference"] = 115200;
+        options["printerProfilePreference"] = "Default";
+        options["autoconnect"] = true;
+        sendJson(request, doc);
     });
 
 
@@ -182,30 +262,27 @@ void WebServer::registerOptoPrintApi() {
         Serial.printf("POST %s\n", request->url().c_str() );
 
         //if( request->hasHeader("Content-Type") ) Serial.println(request->getHeader("Content-Type")->value() );
-
-        if(request->hasParam("select", true) && request->getParam("select", true)->value()=="true") {
-            Job *job = Job::getJob();
-            job->setFile(uploadedFilePath);
-        }
-        if(request->hasParam("print", true) && request->getParam("print", true)->value()=="true") { 
-            Job *job = Job::getJob();
-            job->start();
-        } // print now
-
-
-        // OctoPrint sends 201 here; https://github.com/fieldOfView/Cura-OctoPrintPlugin/issues/155#issuecomment-596110996
-        AsyncWebServerResponse *response = request->beginResponse(201, "application/json", "{\r\n"
-                "  \"files\": {\r\n"
-                "    \"local\": {\r\n"
-                "      \"name\": \"" + uploadedFilePath + "\",\r\n"
-                "      \"origin\": \"local\"\r\n"
-                "    }\r\n"
-                "  },\r\n"
-                "  \"done\": true\r\n"
-                "}");
-        response->addHeader("Location", "http://"+request->host()+"/api/files/local"+uploadedFilePath);
-        request->send(response);
-
+        replyToUpload(request, [this](AsyncWebServerRequest *request) {
+            bool print = request->hasParam("print", true) && request->getParam("print", true)->value()=="true";
+            if(request->hasParam("select", true) && request->getParam("select", true)->value()=="true") {
+                Job::getJob()->requestFile(uploadedFilePath, print);
+            } else if(print) { 
+                Job::getJob()->requestStart();
+            } // print now
+
+
+            DynamicJsonDocument doc( 2*JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(1) + uploadedFilePath.length()+1 );
+            JsonObject local = doc.createNestedObject("files").createNestedObject("local");
+            local["name"] = uploadedFilePath; // copied and escaped
+            local["origin"] = "local";
+            doc["done"] = true;
+            // OctoPrint sends 201 here; https://github.com/fieldOfView/Cura-OctoPrintPlugin/issues/155#issuecomment-596110996
+            AsyncResponseStream *response = jsonResponse(request, doc, 201);
+            response->addHeader("Location", "http://"+request->host()+"/api/files/local"+uploadedFilePath);
+            char crc[9]; snprintf(crc, sizeof(crc), "%08x", uploadedFileCrc);
+            response->addHeader("X-Checksum-CRC32", crc);
+            request->send(response);
+        });
     }, [this](AsyncWebServerRequest *req, String filename, size_t index, uint8_t *data, size_t len, bool final) {
         //Serial.printf("FILE %s file %s\n", req->url().c_str(), filename.c_str() );
         if(index==0) {
@@ -223,9 +300,7 @@ void WebServer::registerOptoPrintApi() {
             String file = extractPath(req->url(), filesPrefixLen);
             Serial.printf("JSON %s, file is %s\n", req->url().c_str(), file.c_str() );
             if( doc["command"] == "select" ) {
-                Job *job = Job::getJob();
-                job->setFile(file);
-                if(doc["print"] == true) job->start();
+                Job::getJob()->requestFile(file, doc["print"] == true);
                 // fail with 409 if no printer
                 req->send(204, "text/plain", "");
             } else {
@@ -241,40 +316,44 @@ void WebServer::registerOptoPrintApi() {
         // http://docs.octoprint.org/en/master/api/job.html#retrieve-information-about-the-current-job
         //Serial.println("GET /api/job");
         
+        GCodeDevice *dev = GCodeDevice::getDevice();
+        if(dev!=nullptr) dev->watchStatus(GCodeDevice::WATCH_WEB, FAST_STATUS_INTERVAL, WEB_WATCH_HOLD);
+
         Job *job = Job::getJob();
         if(job==nullptr) {//} || !job->isValid()) {
             request->send(500, "text/plain", "");
+            return;
         }
         int32_t printTime=0, printTimeLeft = INT32_MAX;
+        int32_t estimatedPrintTime = INT32_MAX;
+        bool analysed = job->hasTimeEstimate();
+        if(analysed) estimatedPrintTime = job->getEstimatedTotal() / 1000;
         if (job->isRunning() ) {
             printTime = job->getPrintDuration() / 1000;
-            float p = job->getCompletion();
-            printTimeLeft = (p > 0) ? printTime / p * (1-p) : INT32_MAX;
+            if(analysed) {
+                printTimeLeft = (job->getEstimatedTotal() - job->getEstimatedElapsed()) / 1000;
+            } else {
+                float p = job->getCompletion();
+                printTimeLeft = (p > 0) ? printTime / p * (1-p) : INT32_MAX;
+                estimatedPrintTime = printTimeLeft==INT32_MAX ? INT32_MAX : printTime + printTimeLeft;
+            }
         }
         
-        request->send(200, "application/json", "{\r\n"
-                "  \"job\": {\r\n"
-                "    \"file\": {\r\n"
-                "      \"name\": \"" + job->getFilename() + "\",\r\n"
-                "      \"origin\": \"local\",\r\n"
-                "      \"size\": " + String(job->getFileSize() ) + "\r\n"
-                "    },\r\n"
-                "    \"estimatedPrintTime\": \"" + String(printTime + printTimeLeft) + "\" \r\n"
-                //"    \"filament\": {\r\n"
-                //"      \"length\": \"" + filementLength + "\",\r\n"
-                //"      \"volume\": \"" + filementVolume + "\"\r\n"
-                //"    }\r\n"
-                "  },\r\n"
-                "  \"progress\": {\r\n"
-                "    \"completion\": " + String(job->getCompletion()*100 ) + ",\r\n"
-                "    \"filepos\": " + String(job->getFilePos()) + ",\r\n"
-                //"    \"filepos\": 0,\r\n"
-                "    \"printTime\": " + String(printTime) + ",\r\n"
-                "    \"printTimeLeft\": " + String(printTimeLeft) + ",\r\n"
-                "    \"printTimeLeftOrigin\": \"linear\"\r\n"
-                "  },\r\n"
-                "  \"state\": \"" + getStateText(job) + "\"\r\n"
-                "}");
+        StaticJsonDocument< JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(5) + 256 > doc;  // + file name copy
+        JsonObject jobObj = doc.createNestedObject("job");
+        JsonObject file = jobObj.createNestedObject("file");
+        file["name"] = job->getFilename();
+        file["origin"] = "local";
+        file["size"] = job->getFileSize();
+        jobObj["estimatedPrintTime"] = estimatedPrintTime;
+        JsonObject progress = doc.createNestedObject("progress");
+        progress["completion"] = job->getCompletion()*100;
+        progress["filepos"] = job->getFilePos();
+        progress["printTime"] = printTime;
+        progress["printTimeLeft"] = printTimeLeft;
+        progress["printTimeLeftOrigin"] = analysed ? "analysis" : "linear";
+        doc["state"] = getStateText(job);
+        sendJson(request, doc);
     });
 
     AsyncCallbackJsonWebHandler* jobHandler = new AsyncCallbackJsonWebHandler("/api/job", 
@@ -295,58 +374,62 @@ void WebServer::registerOptoPrintApi() {
     });
 
 
+    // stage timings and queue high-water marks, ?reset clears them after the report
+    server.on("/api/stats", HTTP_GET, [](AsyncWebServerRequest * request) {
+        AsyncResponseStream *resp = request->beginResponseStream("application/json");
+        Stats::printJson(*resp);
+        request->send(resp);
+        if(request->hasParam("reset")) Stats::reset();
+    });
+
+
     server.on("/api/printer", HTTP_GET, [this](AsyncWebServerRequest * request) {
         //Serial.print("GET "); Serial.println(request->url() );
         // https://docs.octoprint.org/en/master/api/printer.html#retrieve-the-current-printer-state
-        //String readyState = stringify(printerConnected);
         Job * job = Job::getJob();
-        MarlinDevice * dev = static_cast<MarlinDevice*>(GCodeDevice::getDevice());
+        GCodeDevice * dev = GCodeDevice::getDevice();
+        if(dev!=nullptr) dev->watchStatus(GCodeDevice::WATCH_WEB, FAST_STATUS_INTERVAL, WEB_WATCH_HOLD);
         bool connected = dev==nullptr ? false : dev->isConnected();
         bool queueEmpty = dev==nullptr ? true : dev->getSentQueueLength()==0;
         bool error = dev==nullptr ? false : dev->isInPanic();
-        String readyState = stringify(connected);
-
-        String message = "{\r\n"
-                "  \"state\": {\r\n"
-                "    \"text\": \"" + getStateText(job,dev) + "\",\r\n"
-                "    \"sentQueueLength: " + (dev!=nullptr?dev->getSentQueueLength():0) + ",\r\n"
-                "    \"queueLength: " + (dev!=nullptr?dev->getQueueLength():0) + ",\r\n"
-                "    \"flags\": {\r\n"
-                "      \"operational\": " + readyState + ",\r\n"
-                "      \"paused\": " + stringify(job->isPaused()) + ",\r\n"
-                "      \"printing\": " + stringify(job->isRunning()) + ",\r\n"
-                "      \"pausing\": " + stringify(job->isPaused() && !queueEmpty ) + ",\r\n"
-                "      \"cancelling\": " + stringify(job->isCancelled() && !queueEmpty ) + ",\r\n"
-                "      \"sdReady\": false,\r\n"
-                "      \"error\": " + stringify(error) + ",\r\n"
-                "      \"ready\": " + readyState + ",\r\n"
-                "      \"closedOrError\": " + stringify(!connected | error) + "\r\n"
-                "    }\r\n"
-                "  },\r\n";
-                
-        if(dev!=nullptr) {
-            message +=
-                "  \"temperature\": {\r\n";
-            for (int t = 0; t < dev->getExtruderCount(); ++t) message += 
-                "    \"tool" + String(t) + "\": {\r\n"
-                "      \"actual\": " + String(dev->getExtruderTemp(t).actual) + ",\r\n"
-                "      \"target\": " + String(dev->getExtruderTemp(t).target) + ",\r\n"
-                "      \"offset\": 0\r\n"
-                "    },\r\n";
-        
-            message +=  
-                "    \"bed\": {\r\n"
-                "      \"actual\": " + String(dev->getBedTemp().actual) + ",\r\n"
-                "      \"target\": " + String(dev->getBedTemp().target) + ",\r\n"
-                "      \"offset\": 0\r\n"
-                "    }\r\n"
-                "  },\r\n";
+
+        static const char* const toolKeys[] = {"tool0", "tool1", "tool2"};
+        const int MAX_TOOLS = sizeof(toolKeys)/sizeof(toolKeys[0]);
+        StaticJsonDocument< JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(9) 
+            + JSON_OBJECT_SIZE(MAX_TOOLS+1) + (MAX_TOOLS+1)*JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(1) > doc;
+        JsonObject state = doc.createNestedObject("state");
+        state["text"] = getStateText(job,dev);
+        state["sentQueueLength"] = dev!=nullptr ? dev->getSentQueueLength() : 0;
+        state["queueLength"] = dev!=nullptr ? dev->getQueueLength() : 0;
+        JsonObject flags = state.createNestedObject("flags");
+        flags["operational"] = connected;
+        flags["paused"] = job->isPaused();
+        flags["printing"] = job->isRunning();
+        flags["pausing"] = job->isPaused() && !queueEmpty;
+        flags["cancelling"] = job->isCancelled() && !queueEmpty;
+        flags["sdReady"] = false;
+        flags["error"] = error;
+        flags["ready"] = connected;
+        flags["closedOrError"] = !connected || error;
+
+        // temperatures are known for Marlin only
+        if(dev!=nullptr && dev->getSnapshot().type=='m') {
+            MarlinDevice * mdev = static_cast<MarlinDevice*>(dev);
+            JsonObject temperature = doc.createNestedObject("temperature");
+            int n = mdev->getExtruderCount()<MAX_TOOLS ? mdev->getExtruderCount() : MAX_TOOLS;
+            for (int t = 0; t < n; ++t) {
+                JsonObject tool = temperature.createNestedObject(toolKeys[t]);
+                tool["actual"] = mdev->getExtruderTemp(t).actual;
+                tool["target"] = mdev->getExtruderTemp(t).target;
+                tool["offset"] = 0;
+            }
+            JsonObject bed = temperature.createNestedObject("bed");
+            bed["actual"] = mdev->getBedTemp().actual;
+            bed["target"] = mdev->getBedTemp().target;
+            bed["offset"] = 0;
         }
-        message +=    
-                "  \"sd\": { \"ready\": false }\r\n"
-                "}";
-            
-        request->send(200, "application/json", message);
+        doc.createNestedObject("sd")["ready"] = false;
+        sendJson(request, doc);
     });
 
     // http://docs.octoprint.org/en/master/api/printer.html#send-an-arbitrary-command-to-the-printer
@@ -365,9 +448,67 @@ void WebServer::registerOptoPrintApi() {
     );    
     server.addHandler(printerCommandHandler);
 
+    // https://docs.octoprint.org/en/master/api/printer.html#issue-a-print-head-command, feedrate only;
+    // not in OctoPrint: {"command":"override","override":"feed|rapid|spindle|flow","delta":N} or "factor":N
+    // https://docs.octoprint.org/en/master/api/printer.html#issue-a-tool-command, flowrate only
+    // Overrides skip the command queues and apply to the running motion
+    auto overrideHandler = [](AsyncWebServerRequest *req, JsonVariant &json) {
+        JsonObject doc = json.as<JsonObject>();
+        GCodeDevice * dev = GCodeDevice::getDevice();
+        if(dev==nullptr) { req->send(409, "text/plain", "No printer"); return; }
+        const char* command = doc["command"] | "";
+        DeviceOverride o = N_OVERRIDES;
+        if(strcmp(command, "feedrate")==0) o = OV_FEED;
+        else if(strcmp(command, "flowrate")==0) o = OV_FLOW;
+        else if(strcmp(command, "override")==0) {
+            static const char* const names[N_OVERRIDES] = {"feed", "rapid", "spindle", "flow"};
+            const char* name = doc["override"] | "";
+            for(int i=0; i<N_OVERRIDES; i++) if(strcmp(name, names[i])==0) o = DeviceOverride(i);
+        }
+        if(o==N_OVERRIDES) { req->send(400, "text/plain", "Unknown command"); return; }
+        bool ok;
+        if(doc.containsKey("delta")) ok = dev->adjustOverride(o, doc["delta"].as<int>() );
+        else if(doc.containsKey("factor")) {
+            // OctoPrint sends percent, or a fraction in older versions
+            float f = doc["factor"].as<float>();
+            ok = dev->setOverride(o, f<=5 ? int(f*100+0.5) : int(f+0.5) );
+        } else { req->send(400, "text/plain", "No factor"); return; }
+        req->send(ok ? 204 : 409, "text/plain", "");
+    };
+    server.addHandler( new AsyncCallbackJsonWebHandler("/api/printer/printhead", overrideHandler) );
+    server.addHandler( new AsyncCallbackJsonWebHandler("/api/printer/tool", overrideHandler) );
+
 }
 
 
+/** 
+ * `{"command":"add","file":"/a.gcode","pre":"G55","post":"G0 Z10","index":0}`, `"remove"` and `"move"` with 
+ * `index`/`from`,`to`, `"clear"`, `"start"`, `"stop"` (after the running job)
+ */
+int WebServer::apiQueueHandler(JsonObject &root) {
+    const char* command = root["command"];
+    if(command==nullptr) return 400;
+    const size_t none = JobQueue::MAX_JOBS;
+    if(strcmp(command, "add")==0) {
+        const char* file = root["file"];
+        if(file==nullptr || !fileExists(file)) return 400;
+        size_t index = root["index"] | none;
+        if(!JobQueue::add(file, root["pre"], root["post"], index) ) return 409;
+    } else if(strcmp(command, "remove")==0) {
+        if(!JobQueue::remove(root["index"] | none) ) return 400;
+    } else if(strcmp(command, "move")==0) {
+        if(!JobQueue::move(root["from"] | none, root["to"] | none) ) return 400;
+    } else if(strcmp(command, "clear")==0) {
+        JobQueue::clear();
+    } else if(strcmp(command, "start")==0) {
+        if(JobQueue::size()==0) return 409;
+        JobQueue::start();
+    } else if(strcmp(command, "stop")==0) {
+        JobQueue::stop();
+    } else return 400;
+    return 204;
+}
+
 int WebServer::apiJobHandler(JsonObject &root) {
   const char* command = root["command"];
   Job *job = Job::getJob();
@@ -378,13 +519,18 @@ int WebServer::apiJobHandler(JsonObject &root) {
     if (strcmp(command, "cancel") == 0) {
         if (!job->isRunning() )
             return 409;
-        job->cancel();
+        job->requestCancel();
     }
     else if (strcmp(command, "start") == 0) {
         if (job->isRunning() )
             return 409;
-        if(!job->isValid() ) { job->setFile(uploadedFilePath); Serial.println("Starting empty job, selecting uploaded file"); }
-        job->start();
+        uint32_t line = 0;
+        if(root.containsKey("line")) {
+            // not in OctoPrint API: continue the last file from a line, e.g. after an alarm
+            line = root["line"].as<uint32_t>();
+            if(line==0) return 400;
+        }
+        job->requestStart(line, uploadedFilePath); // the job task checks that the line exists
     }
     else if (strcmp(command, "restart") == 0) {
         //if (!printPause)
@@ -415,36 +561,125 @@ String WebServer::extractPath(String sdir, int prefixLen) {
     return sdir;
 }
 
+/** Files worth a job cache; others are uploaded as they are */
+static bool isGCodeFile(const String &name) {
+    return name.endsWith(".gcode") || name.endsWith(".gco") || name.endsWith(".nc");
+}
+
+/** Free space of the upload ring needed to reopen TCP window: all of the window, or all of a smaller ring */
+size_t WebServer::uploadWindow() const {
+    return uploader.capacity() < TCP_WND ? uploader.capacity() : TCP_WND;
+}
+
 void WebServer::handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
-    static File file;
+
+    if(request->_tempObject!=nullptr) return; // rejected, the rest of it is dropped
 
     if (index==0) { // first chunk
+        if(uploadRequest!=nullptr || !uploader.isClosed()) { rejectUpload(request, 409, "Another upload is in progress"); return; }
+
         uploadedFilePath = filename;
         uploadedFileSize = 0;
+        uploadedFileCrc = 0;
 
         if (uploadedFilePath.length() > 255)//storageFS.getMaxPathLength())
             uploadedFilePath = "/cached.gco";   // TODO maybe a different solution
 
         Serial.printf("Uploading to file %s\n", filename.c_str() );
-
-        if(SD.exists(uploadedFilePath)) SD.remove(uploadedFilePath);
-        file = SD.open(uploadedFilePath, "w"); // create or truncate file
-        if(!file) { request->send(400, "text/plain", "Could not open file"); return; }
+        if(Job::getJob()->usesFile(uploadedFilePath)) { rejectUpload(request, 409, "File is used by a job"); return; }
+
+        // the old file and its cache are removed by the writer task
+        if(!uploader.open(uploadedFilePath, uploadCache && isGCodeFile(uploadedFilePath))) { rejectUpload(request, 400, "Could not open file"); return; }
+        uploadRequest = request;
+        request->onDisconnect([this, request]() {
+            if(uploadRequest!=request) return;
+            uploader.abort();
+            uploadRequest = nullptr;
+            uploadReply = nullptr;
+            downloading = false;  notify_observers( WebServerStatusEvent{1} );
+        });
+        // replaces the request's own poll, which only helps to send responses larger than the TCP buffer
+        request->client()->onPoll([](void *arg, AsyncClient *c) { inst->pollUpload((AsyncWebServerRequest*)arg); }, request);
         downloading = true;  notify_observers( WebServerStatusEvent{1} );
 
     }
 
-    if(!file) return;
+    if(request!=uploadRequest) return;
 
     //Serial.printf("uploading pos %d if size %d to %s\n", index, len, uploadedFullname.c_str() );
-    file.write(data, len);
+    if(!uploader.write(data, len)) {
+        Serial.printf("Upload of %s failed\n", uploadedFilePath.c_str() );
+        rejectUpload(request, 500, "Could not write file");
+        uploadRequest = nullptr;
+        request->client()->ack(SIZE_MAX); // the rest of the body is read and dropped
+        downloading = false;  notify_observers( WebServerStatusEvent{1} );
+        return;
+    }
 
     if (final) { // last chunk
-        Serial.printf("uploaded\n");
-        uploadedFileSize = index + len;
-        file.close();
+        uploader.finish(); // the reply waits for the writer to close the file
+        request->client()->ack(SIZE_MAX);
+        return;
+    }
+
+    // TCP window is reopened once the ring can take all of it, so data never has to wait for SD here
+    if(uploader.freeSpace() < uploadWindow()) request->client()->ackLater();
+    else request->client()->ack(SIZE_MAX);
+}
+
+void WebServer::replyToUpload(AsyncWebServerRequest *request, ArRequestHandlerFunction reply) {
+    if(request==uploadRequest && uploader.isOpen()) {
+        // body ended without the last chunk
+        uploader.abort();
+        uploadRequest = nullptr;
         downloading = false;  notify_observers( WebServerStatusEvent{1} );
+        rejectUpload(request, 400, "Upload is incomplete");
+    }
+    if(sendUploadError(request)) return;
+    if(request!=uploadRequest) { reply(request); return; } // no file in it
+    uploadReply = reply;
+    if(uploader.isClosed()) uploadClosed(request); // pollUpload() does it otherwise
+}
+
+void WebServer::pollUpload(AsyncWebServerRequest *request) {
+    if(request!=uploadRequest) return;
+    if(uploader.isOpen()) {
+        // stalled with a closed window: SD was slower than network
+        if(uploader.freeSpace() >= uploadWindow()) request->client()->ack(SIZE_MAX);
+        return;
     }
+    if(uploadReply && uploader.isClosed()) uploadClosed(request);
+}
+
+void WebServer::uploadClosed(AsyncWebServerRequest *request) {
+    ArRequestHandlerFunction reply = uploadReply;
+    uploadReply = nullptr;
+    uploadRequest = nullptr;
+    bool ok = uploader.isWritten();
+    uploadedFileSize = uploader.getSize();
+    uploadedFileCrc = uploader.getCrc();
+    Serial.printf("uploaded %d bytes, crc32 %08x%s\n", uploadedFileSize, uploadedFileCrc, ok ? "" : ", write failed");
+    downloading = false;  notify_observers( WebServerStatusEvent{1} );
+    if(!ok) { request->send(500, "text/plain", "Could not write file"); return; }
+    if(!uploader.isCached() && isGCodeFile(uploadedFilePath)) JobCache::prepare(uploadedFilePath);
+    reply(request);
+}
+
+/** Streams a file, reading it in SD task at bulk priority as the connection takes data */
+static void sendFile(AsyncWebServerRequest *request, File file) {
+    String name = file.name();
+    const char* type = name.endsWith(".htm") || name.endsWith(".html") ? "text/html"
+        : name.endsWith(".json") ? "application/json"
+        : name.endsWith(".txt") || isGCodeFile(name) ? "text/plain"
+        : "application/octet-stream";
+    File *f = new File(file);
+    AsyncWebServerResponse *response = request->beginResponse(type, f->size(), [f](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+        size_t rd = 0;
+        SDScheduler::run(SDScheduler::BULK, [&]() { rd = f->read(buf, maxLen); });
+        return rd;
+    });
+    request->onDisconnect( [f]() { f->close(); delete f; } );
+    request->send(response);
 }
 
 void WebServer::registerWebBrowser() {
@@ -464,44 +699,41 @@ void WebServer::registerWebBrowser() {
         request->redirect(fsPrefixSlash);
     });
 
-    server.serveStatic(fsPrefix, SD, "/").setDefaultFile(""); // disable index.htm searching
-
     server.on(fsPrefix, HTTP_GET, [](AsyncWebServerRequest * request) {
         String sdir = extractPath(request->url(), fsPrefixLength );            
         
-        Serial.println("listing dir "+sdir);
-        File dir = SD.open(sdir);
+        File dir;
+        bool isDir = false;
+        { SDScheduler::BusLock bus; dir = SD.open(sdir); isDir = dir && dir.isDirectory(); }
+        if(!dir) { request->send(404, "text/plain", "No such file"); return; }
+        if(!isDir) { sendFile(request, dir); return; }
 
-        if(!dir || !dir.isDirectory()) { dir.close(); request->send(404, "text/plain", "No such file"); return; }
+        Serial.println("listing dir "+sdir);
 
-        String resp; resp.reserve(2048);
-        resp += "<html><body>\n<h1>Listing of \""+sdir+"\"</h1>\n<form method='post' enctype='multipart/form-data'><input type='file' name='f'><input type='submit'></form>\n<ul>\n";
+        dir.close();
+        AsyncResponseStream *resp = request->beginResponseStream("text/html");
+        resp->printf("<html><body>\n<h1>Listing of \"%s\"</h1>\n<form method='post' enctype='multipart/form-data'><input type='file' name='f'><input type='submit'></form>\n<ul>\n", sdir.c_str() );
 
         if(sdir.length()>1) {
             int p=sdir.lastIndexOf('/'); 
-            resp += "<li><a href=\"";
-            resp += fsPrefixSlash;
-            resp += sdir.substring(0,p);
-            resp += "\">../</a></li>\n";
+            resp->printf("<li><a href=\"%s%s\">../</a></li>\n", fsPrefixSlash, sdir.substring(0,p).c_str() );
         }
-        File f;
-        while( f = dir.openNextFile() ) {
-            String fname = f.name(); 
-            int p = fname.lastIndexOf('/'); fname = fname.substring(p+1);
-            if(f.isDirectory())
-                resp += "<li><a href=\"/fs"+String(f.name())+"/\">"+fname+"</a></li>\n";
+        const char* base = sdir=="/" ? "" : sdir.c_str();
+        DirIndex::list(sdir, DirIndex::ALL, 0, DirIndex::MAX_ENTRIES, [&](const DirIndex::Item &f) {
+            if(f.isDir)
+                resp->printf("<li><a href=\"/fs%s/%s/\">%s</a></li>\n", base, f.name, f.name);
             else 
-                resp += "<li><a href=\"/fs"+String(f.name())+"\">"+fname+"</a> "+f.size()+"B "+
-                        +"[<a href=\"/api2/print?file="+String(f.name())+"\">print</a>]</li>\n";
-            f.close();
-        }
-        dir.close();
-        resp += "\n</ul>\n</body></html>";
-        request->send(200, "text/html", resp);
+                resp->printf("<li><a href=\"/fs%s/%s\">%s</a> %uB "
+                        "[<a href=\"/api2/print?file=%s/%s\">print</a>] "
+                        "[<a href=\"/api2/prepare?file=%s/%s\">prepare</a>]</li>\n", 
+                        base, f.name, f.name, f.size, base, f.name, base, f.name);
+        });
+        resp->print("\n</ul>\n</body></html>");
+        request->send(resp);
     });
     
-    server.on("/fs", HTTP_POST, [](AsyncWebServerRequest * request) {
-        request->send(201, "text/html", "created");
+    server.on("/fs", HTTP_POST, [this](AsyncWebServerRequest * request) {
+        replyToUpload(request, [](AsyncWebServerRequest *request) { request->send(201, "text/html", "created"); });
     }, [this](AsyncWebServerRequest *req, String filename, size_t index, uint8_t *data, size_t len, bool final) {
         if(index==0) {
             String sdir = req->url();
@@ -526,17 +758,59 @@ void WebServer::registerWebBrowser() {
             return;
         }
         Job *job = Job::getJob();
-        if(job->isValid() ) { 
-            req->send(409, "text/plain", "Job already set");
+        if(job->isRunning() ) { 
+            // runs after the current job
+            if(!fileExists(file)) { req->send(400, "text/plain", "File not found"); return; }
+            if(!JobQueue::add(file.c_str()) ) { req->send(409, "text/plain", "Job queue is full"); return; }
+            JobQueue::start();
+            req->send(202, "text/plain", "queued");
+            return;
+        }
+        if(!fileExists(file)) { req->send(400, "text/plain", "File not found"); return; }
+        job->requestFile(file, true);
+        req->send(200, "text/plain", "ok");
+    } );
+
+    server.on("/api2/queue", HTTP_GET, [](AsyncWebServerRequest * req) {
+        DynamicJsonDocument doc( JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(JobQueue::MAX_JOBS) + JobQueue::MAX_JOBS*JSON_OBJECT_SIZE(3) 
+            + JobQueue::MAX_JOBS*(JobQueue::MAX_PATH + 2*JobQueue::AMBLE_LEN + 3) );
+        doc["started"] = JobQueue::isStarted();
+        JsonArray jobs = doc.createNestedArray("jobs");
+        JobQueue::list([&](size_t i, const JobQueue::Entry &e) {
+            JsonObject j = jobs.createNestedObject();
+            j["file"] = String(e.path); // copied, entries may change after the lock
+            j["pre"] = String(e.pre);
+            j["post"] = String(e.post);
+        });
+        sendJson(req, doc);
+    } );
+
+    server.addHandler( new AsyncCallbackJsonWebHandler("/api2/queue", 
+        [this](AsyncWebServerRequest *req, JsonVariant &json) {
+            Serial.printf("JSON %s\n", req->url().c_str() );
+            JsonObject doc = json.as<JsonObject>();
+            req->send(apiQueueHandler(doc), "text/plain", "");
+        }
+    ) );
+
+    server.on("/api2/prepare", HTTP_GET, [](AsyncWebServerRequest * req) {
+        if(!req->hasParam("file")) {
+            Serial.printf("GET %s\n", req->url().c_str() );
+            req->send(400, "text/plain", "no file paraameter");
+            return;
+        }
+        String file = req->getParam("file")->value();
+        Serial.printf("GET %s, file=%s\n", req->url().c_str(), file.c_str() );
+        if(!fileExists(file)) {
+            req->send(400, "text/plain", "File not found");
             return;
         }
-        job->setFile(file);
-        if(!job->isValid() ){ 
-            req->send(400, "text/plain", "File not found or invalid");
+        if(JobCache::isPreparing()) {
+            req->send(409, "text/plain", "Another file is being prepared");
             return;
         }
-        job->start();
-        req->send(200, "text/plain", "ok");
+        JobCache::prepare(file);
+        req->send(202, "text/plain", "ok");
     } );
 
     server.on("/api2/cmd", HTTP_GET, [](AsyncWebServerRequest * req) {
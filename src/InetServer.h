@@ -6,15 +6,21 @@
 #include <ArduinoJson.h>   // for implementing a subset of the OctoPrint API
 
 #include <etl/observer.h>
-#include <etl/set.h>
+#include <atomic>
+
+#include "Job.h"
+#include "UploadWriter.h"
+#include "TelnetBridge.h"
 
 struct WebServerStatusEvent { int statusField; };
 
 typedef etl::observer<const WebServerStatusEvent&> WebServerObserver;
 
-class WebServer : public etl::observable<WebServerObserver, 3> {
+#define PUSH_INTERVAL  250  // ms, state deltas are pushed to /events at most this often
+
+class WebServer : public etl::observable<WebServerObserver, 3>, public DeviceObserver, public JobObserver {
 public:
-    WebServer(uint16_t port=80): server(port), telnetServer(23), port(port) {
+    WebServer(uint16_t port=80): server(port), telnet(23), events("/events"), port(port) {
         inst = this;
     }
 
@@ -34,23 +40,49 @@ public:
 
     void resendDeviceResponse(const char*, size_t);
 
+    /** Wakes the push loop, if anyone listens to /events */
+    void notification(const DeviceStatusEvent &e) override { wakePush(); }
+    void notification(const JobStatusEvent &e) override { wakePush(); }
+
+    /** Runs in its own task after begin(): sends state deltas to /events subscribers, serves telnet bridge */
+    void pushLoop();
+
 private:
 
     static WebServer * inst;
 
     AsyncWebServer server;
-    AsyncServer telnetServer;
+    TelnetBridge telnet;
+    AsyncEventSource events;
     String essid, password;
     uint16_t port;
     String hostname;
 
     String uploadedFilePath;
     size_t uploadedFileSize;
+    uint32_t uploadedFileCrc;
+    UploadWriter uploader;
+    AsyncWebServerRequest *uploadRequest = nullptr; ///< whose file the uploader has open or is closing
+    ArRequestHandlerFunction uploadReply;           ///< response to uploadRequest, sent once its file is closed
+    bool uploadCache = true; ///< build job cache while the file streams in
     //String localUrlBase;
     bool downloading;
     bool running;
 
-    etl::set<AsyncClient*, 5> telnetClients;
+    TaskHandle_t pushTask = nullptr;
+    std::atomic<bool> pushFull{true};  ///< next push sends every field, e.g. for a new subscriber
+    std::atomic<bool> pushRequested{false};
+    DeviceSnapshot pushedDev = {};
+    JobSnapshot pushedJob = {};
+    const char* pushedState = nullptr;
+
+    void wakePush() { 
+        if(pushTask==nullptr || events.count()==0) return;
+        pushRequested = true;
+        xTaskNotifyGive(pushTask); 
+    }
+
+    void pushState();
     
     void registerOptoPrintApi() ;
     
@@ -59,8 +91,20 @@ private:
 
     void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final);
 
+    /** Completion of an upload request: sends its error, or reply once the file is on SD */
+    void replyToUpload(AsyncWebServerRequest *request, ArRequestHandlerFunction reply);
+
+    /** Poll of the uploading connection: reopens TCP window, sends the reply once the file is closed */
+    void pollUpload(AsyncWebServerRequest *request);
+
+    void uploadClosed(AsyncWebServerRequest *request);
+
+    size_t uploadWindow() const;
+
     void registerWebBrowser() ;
 
     int apiJobHandler(JsonObject &root);
 
+    int apiQueueHandler(JsonObject &root);
+
 };
\ No newline at end of file
@@ -9,29 +9,236 @@ Job * Job::getJob() { return &job; }
 #define J_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
 #define J_DEBUGS(s)   // { Serial.println(s); }
 
-void Job::readNextLine() {
-    if(gcodeFile.available()==0) { 
-        stop();
-        return; 
-    }
-    while( gcodeFile.available()>0 ) {
-        int rd = gcodeFile.read();
-        filePos++;  if(filePos%200==0) notify_observers(JobStatusEvent{0}); // every Nth byte
+/** Returns true if a full line was read into curLine; false if waiting for data or the job has stopped. */
+bool Job::readNextLine() {
+    STATS_SCOPE(READ_LINE);
+    while(true) {
+        int rd = reader().read();
+        if(rd==BlockReader::WAIT) return false; // continue this line on the next loop
+        if(rd==BlockReader::END) {
+            if(curLinePos!=0) break; // last line without a trailing newline
+            endOfFile();
+            return false;
+        }
+        filePos++;
         if(rd=='\n' || rd=='\r') {
             if(curLinePos!=0) break; // if it's an empty string or LF after last CR, just continue reading
         } else {
-            if(curLinePos<MAX_LINE) curLine[curLinePos++] = rd;
+            if(curLinePos<maxLine) curLine[curLinePos++] = rd;
             else { 
                 stop(); 
                 J_DEBUGF("Line length exceeded\n");
-                break; 
+                return false;
             }
         }
     }
     curLine[curLinePos]=0;
+    return true;
+}
+
+/** Same as readNextLine(), but reads a record from job cache. Line is already normalized */
+bool Job::readCachedLine() {
+    STATS_SCOPE(READ_LINE);
+    while(cacheHdrPos < JobCache::RECORD_HEADER) {
+        int rd = reader().read();
+        if(rd==BlockReader::WAIT) return false;
+        if(rd==BlockReader::END) {
+            endOfFile();
+            return false;
+        }
+        cacheHdr[cacheHdrPos++] = rd;
+    }
+    size_t len = cacheHdr[0];
+    while(curLinePos < len) {
+        int rd = reader().read();
+        if(rd==BlockReader::WAIT) return false;
+        if(rd==BlockReader::END) {
+            J_DEBUGF("Truncated job cache\n");
+            stop();
+            return false;
+        }
+        curLine[curLinePos++] = rd;
+    }
+    curLine[curLinePos] = 0;
+    cacheHdrPos = 0;
+    memcpy(&filePos, cacheHdr+1, 4);
+    return true;
+}
+
+/**
+ * Sends the post-amble, then switches to the file set by setNext(), already read ahead, with its preamble.
+ * Stops the job if there is neither. Returns false if the job has stopped.
+ */
+bool Job::endOfFile() {
+    filePos = fileSize; // trailing comments and empty lines are not cached
+    preambleLen = 0;
+    preamblePos = 0;
+    appendPreamble(postamble);
+    postamble[0] = 0;
+
+    if(nextFile) {
+        reader().close();
+        if(gcodeFile) gcodeFile.close();
+        curReader ^= 1;
+        gcodeFile = nextFile;
+        nextFile = File();
+        lastFile = nextPath;
+        nextPath = "";
+        cached = nextCached;
+        fileSize = nextSize;
+        filePos = 0;
+        lastNotifiedPos = 0;
+        cacheHdrPos = 0;
+        curLineNum = 0;
+        startTime = millis();
+        endTime = 0;
+        timed = false;
+        timesPending = false;
+        loadTimes();
+        if(!timed) { if(!JobCache::isPreparing()) JobCache::prepare(lastFile); timesPending = true; }
+        appendPreamble(nextPreamble);
+        strcpy(postamble, nextPostamble);
+        chainCount++;
+        post(JOB_STATE | JOB_PROGRESS);
+        J_DEBUGF("Chained %s\n", lastFile.c_str() );
+        return true;
+    }
+
+    if(preambleLen!=0) return true; // the next END stops the job
+    stop();
+    return false;
+}
+
+bool Job::setNext(const String& file, const char* pre, const char* post) {
+    SDScheduler::BusLock bus;
+    clearNext();
+    if(!isValid()) return false;
+    File src = SD.open(file);
+    if(!src) return false;
+    File cache = JobCache::open(file, src);
+    nextCached = (bool)cache;
+    if(!nextCached && !JobCache::isPreparing()) JobCache::prepare(file); // at least its times are ready when it starts
+    nextFile = src;
+    nextPath = file;
+    nextSize = src.size();
+    copyAmble(nextPreamble, pre);
+    copyAmble(nextPostamble, post);
+    nextReader().open( nextCached ? cache : nextFile );
+    J_DEBUGF("Next job %s%s\n", file.c_str(), nextCached ? ", cached" : "" );
+    return true;
+}
+
+void Job::clearNext() {
+    nextReader().close(); // it holds the cache or shares nextFile
+    if(nextFile) nextFile.close();
+    nextFile = File();
+    nextPath = "";
+}
+
+/** Takes the next line of the preamble into curLine */
+bool Job::readPreambleLine() {
+    while(preamblePos<preambleLen) {
+        char c = preamble[preamblePos++];
+        if(c=='\n') break;
+        if(curLinePos<maxLine) curLine[curLinePos++] = c;
+    }
+    curLine[curLinePos] = 0;
+    return curLinePos>0;
+}
+
+bool Job::seekToLine(uint32_t line) {
+    if(running || lastFile.length()==0) return false;
+    SDScheduler::BusLock bus; // SD requests below run in place
+    String path = lastFile;
+    setFile(path); // from the start, also reopens a cancelled job
+    if(!isValid()) return false;
+    if(line==0) return true;
+
+    SeekIndex::Entry e;
+    bool found = false;
+    SDScheduler::run(SDScheduler::INTERACTIVE, [&]() { found = SeekIndex::find(path, gcodeFile, line, e); });
+    if(!found) {
+        J_DEBUGF("No seek index for %s, scanning from start\n", path.c_str() );
+        e = SeekIndex::Entry{ 0, 0, sizeof(JobCache::Header), MotionEstimator().getModalState() };
+    }
+
+    reader().close(); // it holds the cache or shares gcodeFile, both are reopened at the new position
+    File src = SD.open(path);
+    bool ok = false;
+    SDScheduler::run(SDScheduler::INTERACTIVE, [&]() { ok = src && src.seek(e.srcPos); });
+
+    // skip lines from the index entry to the requested one, tracking modal state
+    MotionEstimator modal;
+    modal.setModalState(e.modal);
+    uint32_t curLineNo = e.line;
+    uint32_t pos = e.srcPos;
+    char buf[MAX_LINE+1];
+    size_t len = 0;
+    static const size_t CHUNK = 512;
+    uint8_t chunk[CHUNK];
+    while(ok && curLineNo<line) {
+        size_t rd = 0;
+        SDScheduler::run(SDScheduler::INTERACTIVE, [&]() { rd = src.read(chunk, CHUNK); });
+        if(rd==0) { ok = false; break; } // file has fewer lines
+        size_t i = 0;
+        for(; i<rd && curLineNo<line; i++) {
+            char c = chunk[i];
+            if(c=='\n' || c=='\r') {
+                if(len>0 && JobCache::normalizeLine(buf, len)>0 ) modal.feed(buf);
+                len = 0;
+                if(c=='\n') curLineNo++;
+            } else if(len<maxLine) buf[len++] = c;
+        }
+        pos += i;
+    }
+
+    File cache;
+    if(ok) SDScheduler::run(SDScheduler::INTERACTIVE, [&]() {
+        if(!src.seek(pos)) { ok = false; return; }
+        if(!cached) return;
+        // first record of a line at or after pos
+        cache = JobCache::open(path, src);
+        if(!cache || !cache.seek(e.cachePos)) { if(cache) cache.close(); cache = File(); return; }
+        uint8_t hdr[JobCache::RECORD_HEADER];
+        while(true) {
+            uint32_t at = cache.position();
+            uint32_t srcEnd;
+            if(cache.read(hdr, sizeof(hdr)) != sizeof(hdr)) { cache.seek(at); break; }
+            memcpy(&srcEnd, hdr+1, 4);
+            if(srcEnd>pos) { cache.seek(at); break; }
+            cache.seek(at + sizeof(hdr) + hdr[0]);
+        }
+    });
+
+    if(!ok) {
+        J_DEBUGF("Can't seek %s to line %d\n", path.c_str(), line );
+        if(src) src.close();
+        setFile(path);
+        return false;
+    }
+
+    if(cached && cache) {
+        src.close();
+        reader().open(cache);
+    } else {
+        cached = false; // cache is gone, stream the source
+        if(gcodeFile) gcodeFile.close();
+        gcodeFile = src;
+        reader().open(gcodeFile);
+    }
+    filePos = pos;
+    lastNotifiedPos = pos;
+    GCodeDevice *dev = GCodeDevice::getDevice();
+    bool dwellMs = dev!=nullptr && dev->getType()=="marlin";
+    preambleLen = SeekIndex::preamble(modal.getModalState(), preamble, sizeof(preamble), dwellMs);
+    preamblePos = 0;
+    post(JOB_PROGRESS);
+    J_DEBUGF("Seeked %s to line %d, offset %d\n", path.c_str(), line, pos );
+    return true;
 }
 
 bool Job::scheduleNextCommand(GCodeDevice *dev) {
+    STATS_SCOPE(SCHEDULE);
     if(dev->isInPanic() ) {
         cancel();
         return false;
@@ -39,26 +246,20 @@ bool Job::scheduleNextCommand(GCodeDevice *dev) {
 
     if(paused) return false;
     
-    if(curLinePos==0) {
-        readNextLine();
-        if(!running) return false;    // don't run next time
-
-        char* pos = strchr(curLine, ';');
-        if(pos!=NULL) {*pos = 0; curLinePos = pos-curLine; }
-
-        bool empty=false;//true;
-        //for(int i=0; i<curLinePos; i++) if(!isspace(curLine[i])) empty=false;
-
-        if(curLinePos==0 || empty) { return true; } // can seek next
-
-        #ifdef ADD_LINENUMBERS
-            char out[MAX_LINE+1];
-            snprintf(out, MAX_LINE, "N%d %s", ++curLineNum, curLine);
-            uint8_t checksum = 0, count = strlen(out);
-            while (count) checksum ^= out[--count];
-            snprintf(curLine, MAX_LINE, "%s*%d", out, checksum);
-            curLinePos = strlen(curLine);
-        #endif
+    if(!lineReady) {
+        if(preamblePos<preambleLen) {
+            if(!readPreambleLine()) return true;
+            curLinePos = JobCache::normalizeLine(curLine, curLinePos); // ambles are typed by the user
+            if(curLinePos==0) return true;
+        } else if(cached) {
+            if(!readCachedLine()) return running && preamblePos<preambleLen;    // no data yet or EOF, don't run next time unless EOF queued the ambles
+        } else {
+            if(!readNextLine()) return running && preamblePos<preambleLen;
+
+            curLinePos = JobCache::normalizeLine(curLine, curLinePos);
+            if(curLinePos==0) { return true; } // can seek next
+        }
+        lineReady = true;
     }
 
     if(dev->canSchedule(curLinePos)) {        
@@ -69,17 +270,63 @@ bool Job::scheduleNextCommand(GCodeDevice *dev) {
         assert(queued);
 
         curLinePos = 0;
+        lineReady = false;
+        curLineNum++;
         return true; //can try next command
 
     } else return false; // stop trying for now
 }
 
+void Job::runRequests() {
+    if(cancelRequested.exchange(false) && isValid()) cancel();
+
+    char path[MAX_PATH];
+    portENTER_CRITICAL(&pendingMux);
+    Request r = pending;
+    pending = NO_REQUEST;
+    memcpy(path, pendingFile, sizeof(path));
+    uint32_t line = pendingLine;
+    portEXIT_CRITICAL(&pendingMux);
+
+    switch(r) {
+        case SELECT:
+            setFile(path);
+            break;
+        case SELECT_START:
+            if(running) break;
+            setFile(path);
+            if(isValid()) start();
+            break;
+        case START:
+            if(running) break;
+            if(line!=0) {
+                if(lastFile.length()==0 && path[0]!=0) setFile(path);
+                if(!seekToLine(line-1)) { Serial.printf("No line %u in %s, not started\n", line, lastFile.c_str() ); break; }
+            }
+            if(!isValid()) { setFile(path); Serial.println("Starting empty job, selecting uploaded file"); }
+            start();
+            break;
+        default: break;
+    }
+}
+
 void Job::loop() {
-    if(!running || paused) return;
+    runRequests();
 
     GCodeDevice * dev = GCodeDevice::getDevice();
-    if(dev==nullptr) return;
+    if(running && !paused && dev!=nullptr) {
+        while( scheduleNextCommand(dev) ) {}
+    }
+    STATS_WINDOW(dev==nullptr || dev->getSentQueueLength()==0, running && !paused);
+
+    if(timesPending && !JobCache::isPreparing()) {
+        timesPending = false;
+        if(isValid()) { loadTimes(); if(timed) post(JOB_PROGRESS); }
+    }
+
+    if(filePos!=lastNotifiedPos) { lastNotifiedPos = filePos; post(JOB_PROGRESS); }
 
-    while( scheduleNextCommand(dev) ) {}
+    publishSnapshot();
 
+    dispatch();
 }
\ No newline at end of file
@@ -2,17 +2,34 @@
 
 #include <Arduino.h>
 #include <SD.h>
-#include <etl/observer.h>
+#include <atomic>
 
 #include "devices/GCodeDevice.h"
+#include "BlockReader.h"
+#include "JobCache.h"
+#include "SDScheduler.h"
 
 
-//#define ADD_LINENUMBERS 
+/** Fields of JobStatusEvent */
+enum JobField : uint32_t {
+    JOB_STATE    = 1<<0,  ///< file, running, paused, cancelled
+    JOB_PROGRESS = 1<<1,
+};
+struct JobStatusEvent {
+    uint32_t fields;  ///< JobField bits changed since the last notification
+    JobStatusEvent(uint32_t f): fields(f) {}
+};
 
-//struct JobStatusEvent{  int status;  };
-typedef int JobStatusEvent;
+typedef etl::observer<const JobStatusEvent&> JobObserver;
 
-typedef etl::observer<JobStatusEvent> JobObserver;
+/** Job state published by the job feeding loop for UI, see Job::getSnapshot() */
+struct JobSnapshot {
+    bool valid;
+    bool running;
+    bool paused;
+    bool cancelled;
+    float completion;
+};
 
 
 /**
@@ -33,83 +50,260 @@ typedef etl::observer<JobStatusEvent> JobObserver;
  *   [valid&running&paused]-+------------+
  *    
  * ```
+ * A file set with setNext() is read ahead while the job runs; at EOF the job switches to it
+ * and keeps running, see JobQueue.
+ *
+ * Job and its readers belong to the task running loop(). Other tasks (web server, device) don't call
+ * setFile(), start(), seekToLine() or cancel(), they request it with requestFile(), requestStart()
+ * and requestCancel(), and loop() runs the request.
  */
-class Job : public DeviceObserver, public etl::observable<JobObserver, 3> {
+class Job : public DeviceObserver, public EventBus<JobStatusEvent, 3> {
 
 public:
 
     static Job* getJob();
     //static void setJob(Job* job);
 
-    ~Job() { if(gcodeFile) gcodeFile.close(); clear_observers(); }
+    static const size_t AMBLE_LEN = 63;  ///< per-job preamble and post-amble, see setAmbles()
+
+    ~Job() { clearNext(); reader().close(); if(gcodeFile) gcodeFile.close(); clear_observers(); }
+
+    /** Starts file prefetching task */
+    void begin() { maxLine = JobCache::maxLine(); readers[0].begin(); readers[1].begin(); }
 
     void loop();
 
     void setFile(String file) { 
+        SDScheduler::BusLock bus;
+        clearNext();
+        reader().close();
         if(gcodeFile) gcodeFile.close();
 
         gcodeFile = SD.open(file);
-        if(gcodeFile) fileSize = gcodeFile.size();
+        lastFile = file;
+        cached = false;
+        timed = false;
+        timesPending = false;
+        if(gcodeFile) { 
+            fileSize = gcodeFile.size(); 
+            File cache = JobCache::open(file, gcodeFile);
+            cached = (bool)cache;
+            reader().open( cached ? cache : gcodeFile ); 
+            loadTimes();
+            if(!timed && !JobCache::isPreparing()) { JobCache::prepare(file); timesPending = true; } // builds both sidecars
+        }
         filePos = 0;
+        lastNotifiedPos = 0;
+        curLinePos = 0;
+        cacheHdrPos = 0;
+        lineReady = false;
+        preambleLen = 0;
+        preamblePos = 0;
+        postamble[0] = 0;
         running = false; 
         paused = false;
         cancelled = false;
-        notify_observers(JobStatusEvent{0}); 
+        post(JOB_STATE | JOB_PROGRESS); 
         curLineNum = 0;
         startTime=0;
         endTime=0;
     }
 
     void notification(const DeviceStatusEvent& e) override {
-        if(e.statusField==1 && isValid() ) {
+        if( (e.fields & DEV_ERROR) && isValid() ) {
             Serial.println("Device error, canceling job");
-            cancel();
+            requestCancel();
         }
     }
 
-    void start() { startTime = millis(); paused=false; running=true;  notify_observers(JobStatusEvent{0}); }
-    void cancel() { cancelled=true; stop(); notify_observers(JobStatusEvent{0});  }
+    /** Has loop() select file, and start it if start is set. Replaces a select or start not run yet. */
+    void requestFile(const String &file, bool start) { request(start ? SELECT_START : SELECT, file, 0); }
+
+    /**
+     * Has loop() start the job, from a 1-based line if line isn't 0, see seekToLine(). If there is no
+     * last file to continue, or no valid file to start, fallback is selected first, e.g. the last upload.
+     */
+    void requestStart(uint32_t line=0, const String &fallback=String()) { request(START, fallback, line); }
+
+    /** Has loop() cancel the job; never dropped by a later request */
+    void requestCancel() { cancelRequested = true; }
+
+    /** 
+     * Continues the file from a 0-based line (counted by LF) instead of its start, once started. 
+     * A preamble is sent first, which restores modal state and moves to the end point of the previous line
+     * from above, see SeekIndex::preamble().
+     * Returns false if job is running or there is no such line.
+     */
+    bool seekToLine(uint32_t line);
+
+    /** 
+     * Commands sent before the file and after its last line, lines are separated by '\n'.
+     * Should be called after setFile(), before start(); each is cut to AMBLE_LEN.
+     */
+    void setAmbles(const char* pre, const char* post) {
+        preambleLen = 0;
+        preamblePos = 0;
+        appendPreamble(pre);
+        copyAmble(postamble, post);
+    }
+
+    /**
+     * Opens a file to continue with right after this one, with its own ambles. Its first blocks are read
+     * ahead at once, so the device queue doesn't drain when the job switches to it at EOF.
+     * Replaces a file set before. Returns false if there is no job or no such file.
+     */
+    bool setNext(const String& file, const char* pre, const char* post);
+
+    /** Drops the file set by setNext(), the job ends with the current file */
+    void clearNext();
+
+    bool hasNext() { return (bool)nextFile; }
+
+    /** True if the job or its next file is read from path or its cache, so they must not be replaced */
+    bool usesFile(const String& path) { return (isValid() && lastFile==path) || (hasNext() && nextPath==path); }
+
+    /** Times the job has switched to a file set by setNext() */
+    uint32_t getChainCount() { return chainCount; }
+
+    /** File of the last job, valid or not, e.g. to restart it after cancel */
+    const String& getLastFile() { return lastFile; }
+
+    void start() { startTime = millis(); paused=false; running=true;  post(JOB_STATE); }
+    void cancel() { cancelled=true; stop(); }
     bool isRunning() {  return running; }
     bool isCancelled() { return cancelled; }
 
     void pause() { setPaused(true);  }
     void resume() { setPaused(false); }
-    void setPaused(bool v) { paused = v; notify_observers(JobStatusEvent{0}); }
+    void setPaused(bool v) { paused = v; post(JOB_STATE); }
     bool isPaused() { return paused; }
 
-    float getCompletion() { if(isValid()) return 1.0 * filePos/fileSize; else return 0; }
+    /** Part of estimated job time done if there is a time index, or part of file bytes */
+    float getCompletion() { 
+        if(!isValid()) return 0;
+        if(timed && times.total()>0) return 1.0 * times.at(filePos)/times.total();
+        return 1.0 * filePos/fileSize; 
+    }
     size_t getFilePos() { if(isValid()) return filePos; else return 0;}
     size_t getFileSize() { if(isValid()) return fileSize; else return 0;}
     bool isValid() { return (bool)gcodeFile; }
     String getFilename() { if(isValid()) return gcodeFile.name(); else return ""; }
+    /** True if job is streamed from a pre-tokenized cache */
+    bool isCached() { return cached; }
     uint32_t getPrintDuration() { return (endTime!=0 ? endTime : millis())-startTime; }
+    /** True if job time is estimated from gcode motion, see MotionEstimator */
+    bool hasTimeEstimate() { return isValid() && timed; }
+    /** Estimated time of the whole job, ms */
+    uint32_t getEstimatedTotal() { return hasTimeEstimate() ? times.total() : 0; }
+    /** Estimated time of the lines queued so far, ms */
+    uint32_t getEstimatedElapsed() { return hasTimeEstimate() ? times.at(filePos) : 0; }
+
+    /** Consistent copy of job state as of the last loop(), may be read from any task */
+    JobSnapshot getSnapshot() const { return snapshot.read(); }
 
 private:
 
     File gcodeFile;
+    String lastFile;
+    BlockReader readers[2];  ///< the running file and the next one
+    uint8_t curReader;
+    bool cached;
+    TimeIndex times;
+    bool timed;         ///< times is valid for this file
+    bool timesPending;  ///< times is being built, load it when it's done
     uint32_t fileSize;
     uint32_t filePos;
+    uint32_t lastNotifiedPos;
     uint32_t startTime;
     uint32_t endTime;
-    static const int MAX_LINE = 100;
+    static const size_t MAX_LINE = JobCache::MAX_LINE;
+    size_t maxLine;     ///< JobCache::maxLine(), fixed at begin()
     char curLine[MAX_LINE+1];
     size_t curLinePos;
+    bool lineReady;
+    uint8_t cacheHdr[JobCache::RECORD_HEADER];
+    size_t cacheHdrPos;
+    char preamble[192];  ///< lines to send before the file after seekToLine() or setAmbles(), or between chained files
+    size_t preambleLen;
+    size_t preamblePos;
+    char postamble[AMBLE_LEN+1];
+
+    // file to switch to at EOF, see setNext()
+    File nextFile;
+    String nextPath;
+    bool nextCached;
+    uint32_t nextSize;
+    char nextPreamble[AMBLE_LEN+1];
+    char nextPostamble[AMBLE_LEN+1];
+    uint32_t chainCount;
 
-    size_t curLineNum;
+    size_t curLineNum; ///< lines queued so far
 
     //float percentage = 0;
     bool running;
     bool cancelled;
     bool paused;
 
+    Seqlock<JobSnapshot> snapshot;
+
+    // requests of other tasks, run by loop()
+    enum Request : uint8_t { NO_REQUEST, SELECT, SELECT_START, START };
+    static const size_t MAX_PATH = 128;
+    Request pending = NO_REQUEST;
+    char pendingFile[MAX_PATH];
+    uint32_t pendingLine;
+    portMUX_TYPE pendingMux = portMUX_INITIALIZER_UNLOCKED;
+    std::atomic<bool> cancelRequested{false};
+
+    void request(Request r, const String &file, uint32_t line) {
+        portENTER_CRITICAL(&pendingMux);
+        strncpy(pendingFile, file.c_str(), MAX_PATH-1);
+        pendingFile[MAX_PATH-1] = 0;
+        pendingLine = line;
+        pending = r;
+        portEXIT_CRITICAL(&pendingMux);
+    }
+
+    void runRequests();
+
+    BlockReader& reader() { return readers[curReader]; }
+    BlockReader& nextReader() { return readers[curReader^1]; }
+
+    static void copyAmble(char* dst, const char* src) {
+        strncpy(dst, src!=nullptr ? src : "", AMBLE_LEN);
+        dst[AMBLE_LEN] = 0;
+    }
+
+    void appendPreamble(const char* s) {
+        size_t n = strlen(s);
+        if(n==0 || preambleLen+1 >= sizeof(preamble)) return;
+        if(preambleLen+n+1 > sizeof(preamble)) n = sizeof(preamble)-1-preambleLen;
+        memcpy(preamble+preambleLen, s, n);
+        preambleLen += n;
+        preamble[preambleLen++] = '\n';
+    }
+
+    void publishSnapshot() {
+        snapshot.write( JobSnapshot{ isValid(), running, paused, cancelled, getCompletion() } );
+    }
+
+    void loadTimes() {
+        SDScheduler::run(SDScheduler::INTERACTIVE, [this]() { timed = JobCache::loadTimes(gcodeFile.name(), gcodeFile, times); });
+    }
+
     void stop() {   
         paused = false;
         running = false; 
         endTime=millis();
+        clearNext();
+        reader().close();
         if(gcodeFile) gcodeFile.close();
-        notify_observers(JobStatusEvent{0}); 
+        post(JOB_STATE); 
     }
-    void readNextLine();
+    bool readNextLine();
+    bool readCachedLine();
+    bool readPreambleLine();
+    bool endOfFile();
     bool scheduleNextCommand(GCodeDevice *dev);
 
 
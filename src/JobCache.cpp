@@ -0,0 +1,238 @@
+#include "JobCache.h"
+#include "SDScheduler.h"
+
+
+std::atomic<bool> JobCache::preparing(false);
+
+
+size_t JobCache::normalizeLine(char* line, size_t len) {
+    size_t o = 0;
+    bool space = false;
+    for(size_t i=0; i<len; i++) {
+        char c = line[i];
+        if(c==';') break;
+        if(isspace(c)) { space = o!=0; continue; }
+        if(space) { line[o++] = ' '; space = false; }
+        line[o++] = c;
+    }
+    line[o] = 0;
+    return o;
+}
+
+File JobCache::open(const String &path, File &src) {
+    String cpath = sidecarPath(path);
+    if(!SD.exists(cpath)) return File();
+    File f = SD.open(cpath);
+    if(!f) return f;
+    Header h;
+    if( f.read((uint8_t*)&h, sizeof(h)) != sizeof(h)
+            || strncmp(h.magic, "GJC", 3)!=0 || h.version!=VERSION
+            || h.srcSize != src.size() || h.srcTime != (uint32_t)src.getLastWrite() ) {
+        JC_DEBUGF("JobCache: %s is stale\n", cpath.c_str() );
+        f.close();
+        return File();
+    }
+    return f;
+}
+
+bool JobCache::loadTimes(const String &path, File &src, TimeIndex &times) {
+    String tpath = timesPath(path);
+    times.clear();
+    if(!SD.exists(tpath)) return false;
+    File f = SD.open(tpath);
+    if(!f) return false;
+    bool ok = times.read(f, src.size(), src.getLastWrite() );
+    f.close();
+    if(!ok) { JC_DEBUGF("JobCache: %s is stale\n", tpath.c_str() ); times.clear(); }
+    return ok;
+}
+
+void JobCache::remove(const String &path) {
+    String cpath = sidecarPath(path);
+    if(SD.exists(cpath)) SD.remove(cpath);
+    String tpath = timesPath(path);
+    if(SD.exists(tpath)) SD.remove(tpath);
+    String ipath = SeekIndex::path(path);
+    if(SD.exists(ipath)) SD.remove(ipath);
+}
+
+uint8_t JobCache::missing(const String &path, File &src) {
+    uint8_t parts = 0;
+    File cache = open(path, src);
+    if(cache) cache.close(); else parts |= JobCacheWriter::CACHE;
+    String tpath = timesPath(path);
+    File f = SD.exists(tpath) ? SD.open(tpath) : File();
+    if(!f || !TimeIndex::matches(f, src.size(), src.getLastWrite()) ) parts |= JobCacheWriter::TIMES;
+    if(f) f.close();
+    if(!SeekIndex::exists(path, src)) parts |= JobCacheWriter::SEEKS;
+    return parts;
+}
+
+void JobCache::prepare(const String &path) {
+    bool expected = false;
+    if(!preparing.compare_exchange_strong(expected, true)) {
+        JC_DEBUGF("JobCache: already preparing a file, skipping %s\n", path.c_str() );
+        return;
+    }
+    String *arg = new String(path);
+    if(xTaskCreate(prepareTask, "JobCache", 4096, arg, 1, nullptr) != pdPASS) {
+        delete arg;
+        preparing = false;
+    }
+}
+
+void JobCache::prepareTask(void* arg) {
+    String *path = static_cast<String*>(arg);
+    uint32_t t = millis();
+
+    File src;
+    { SDScheduler::BusLock bus; src = SD.open(*path); }
+    JobCacheWriter *writer = new JobCacheWriter();
+    bool ok = false;
+    uint8_t parts = 0;
+    SDScheduler::run(SDScheduler::BULK, [&]() { 
+        if(!src) return;
+        parts = missing(*path, src);
+        ok = parts!=0 && writer->begin(*path, src.size(), src.getLastWrite(), parts); 
+    });
+    if(ok) {
+        // a chunk per SD request, so a running job isn't held up by the whole file
+        static const size_t CHUNK = 512;
+        uint8_t buf[CHUNK];
+        size_t rd;
+        do {
+            SDScheduler::run(SDScheduler::BULK, [&]() { rd = src.read(buf, CHUNK); if(rd>0) writer->feed(buf, rd); });
+        } while(rd>0);
+        SDScheduler::run(SDScheduler::BULK, [&]() { ok = writer->finish(); });
+    }
+    if(src) { SDScheduler::BusLock bus; src.close(); }
+    JC_DEBUGF("JobCache: prepared %s (parts %d): %s in %d ms\n", path->c_str(), parts, ok ? "ok" : "failed", millis()-t );
+
+    delete writer;
+    delete path;
+    preparing = false;
+    vTaskDelete( NULL );
+}
+
+
+
+bool JobCacheWriter::begin(const String &srcPath, uint32_t srcSize, uint32_t srcTime, uint8_t parts) {
+    this->srcPath = srcPath;
+    this->srcSize = srcSize;
+    this->srcTime = srcTime;
+    this->parts = parts;
+    estimator.reset();
+    times.clear();
+    path = JobCache::sidecarPath(srcPath);
+    if(parts & CACHE) {
+        String tmp = path + ".tmp";
+        if(SD.exists(tmp)) SD.remove(tmp);
+        out = SD.open(tmp, "w");
+        if(!out) return false;
+    }
+    lineLen = 0; maxLen = JobCache::maxLine();
+    srcPos = 0; srcLine = 0; outLen = 0; outPos = 0;
+    failed = false;
+    opened = true;
+    JobCache::Header h{ {'G','J','C'}, JobCache::VERSION, srcSize, srcTime };
+    write(&h, sizeof(h));
+    if(parts & SEEKS) seeks.begin(srcPath);
+    if(parts & SEEKS) seeks.add( SeekIndex::Entry{ 0, 0, outPos, estimator.getModalState() } );
+    return true;
+}
+
+void JobCacheWriter::feed(const uint8_t* data, size_t len) {
+    if(failed) return;
+    for(size_t i=0; i<len; i++) {
+        char c = data[i];
+        srcPos++;
+        if(c=='\n' || c=='\r') {
+            if(lineLen!=0) endLine();
+            if(c=='\n' && ++srcLine % SeekIndex::STRIDE == 0 && (parts & SEEKS) ) {
+                seeks.add( SeekIndex::Entry{ srcLine, srcPos, outPos, estimator.getModalState() } );
+            }
+        } else {
+            if(lineLen<maxLen) line[lineLen++] = c;
+            else { failed = true; return; } // job would be stopped on such a line, don't cache it
+        }
+    }
+}
+
+void JobCacheWriter::endLine() {
+    uint8_t len = JobCache::normalizeLine(line, lineLen);
+    lineLen = 0;
+    if(len==0) return;
+    uint8_t hdr[JobCache::RECORD_HEADER];
+    hdr[0] = len;
+    memcpy(hdr+1, &srcPos, 4);
+    write(hdr, sizeof(hdr));
+    write(line, len);
+    estimator.feed(line);
+    times.add(srcPos, estimator.getTime()*1000);
+}
+
+void JobCacheWriter::write(const void* data, size_t len) {
+    if( !(parts & CACHE) ) { outPos += len; return; } // positions of the existing cache
+    const uint8_t *d = static_cast<const uint8_t*>(data);
+    while(len>0) {
+        size_t n = min(len, sizeof(outBuf)-outLen);
+        memcpy(outBuf+outLen, d, n);
+        outLen += n; outPos += n; d += n; len -= n;
+        if(outLen==sizeof(outBuf)) flush();
+    }
+}
+
+void JobCacheWriter::flush() {
+    if(outLen==0) return;
+    if(out.write(outBuf, outLen) != outLen) failed = true;
+    outLen = 0;
+}
+
+bool JobCacheWriter::finish() {
+    if(!opened) return false;
+    opened = false;
+    if(lineLen!=0 && !failed) endLine();
+    if(parts & CACHE) {
+        flush();
+        out.close();
+        String tmp = path + ".tmp";
+        if(failed) { SD.remove(tmp); seeks.abort(); return false; }
+        // the old cache is stale, so no job has it open
+        if(SD.exists(path)) SD.remove(path);
+        if(!SD.rename(tmp, path)) { seeks.abort(); return false; }
+    } else if(failed) { seeks.abort(); return false; }
+    if(parts & TIMES) writeTimes();
+    if(parts & SEEKS) seeks.finish(srcSize, srcTime);
+    return true;
+}
+
+void JobCacheWriter::writeTimes() {
+    times.add(srcPos, estimator.getTime()*1000, true);
+    String tpath = JobCache::timesPath(srcPath);
+    String tmp = tpath + ".tmp";
+    File f = SD.open(tmp, "w");
+    if(!f) return;
+    bool ok = times.write(f, srcSize, srcTime);
+    f.close();
+    if(SD.exists(tpath)) SD.remove(tpath);
+    if(!ok || !SD.rename(tmp, tpath)) { SD.remove(tmp); return; }
+    JC_DEBUGF("JobCache: estimated %s at %d s\n", srcPath.c_str(), times.total()/1000 );
+}
+
+bool JobCacheWriter::finish(uint32_t srcSize, uint32_t srcTime) {
+    if(!opened) return false;
+    if(lineLen!=0 && !failed) endLine();
+    flush();
+    this->srcSize = srcSize;
+    this->srcTime = srcTime;
+    JobCache::Header h{ {'G','J','C'}, JobCache::VERSION, srcSize, srcTime };
+    if( (parts & CACHE) && (!out.seek(0) || out.write((const uint8_t*)&h, sizeof(h)) != sizeof(h)) ) failed = true;
+    return finish();
+}
+
+void JobCacheWriter::abort() {
+    if(!opened) return;
+    opened = false;
+    if(out) { out.close(); SD.remove(path + ".tmp"); }
+    if(parts & SEEKS) seeks.abort();
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+#include <atomic>
+
+#include "MotionEstimator.h"
+#include "SeekIndex.h"
+#include "MemoryPool.h"
+
+#define JC_DEBUGF(...)  // { Serial.printf(__VA_ARGS__); }
+#define JC_DEBUGS(s)    // { Serial.println(s); }
+
+
+/**
+ * Pre-tokenized job cache.
+ *
+ * A sidecar file next to a gcode file (`file.gcode` -> `file.gcode.jc`) holds comment-stripped,
+ * whitespace-minimised lines, so a job can be streamed from it without any per-line parsing.
+ *
+ * Format (little endian):
+ * ```
+ * header:   'G' 'J' 'C' version(1) srcSize(4) srcTime(4)
+ * record:   len(1) srcEnd(4) line(len)
+ * ```
+ * `srcEnd` is the offset in the original file right after the line, so job progress is still
+ * reported in bytes of the original file.
+ *
+ * While the cache is built, lines are also run through MotionEstimator, and the resulting TimeIndex
+ * is saved to another sidecar (`file.gcode.jt`), so job completion and ETA are a lookup by file offset.
+ * A SeekIndex is built in the same pass.
+ */
+class JobCache {
+public:
+
+    static const size_t MAX_LINE = 255; ///< line buffers are this long, record len is one byte
+
+    /** Longest line a job may have, MemoryBudget::lineLength; a job stops on a longer one */
+    static size_t maxLine() {
+        size_t n = MemoryPool::budget().lineLength;
+        return n<MAX_LINE ? n : (size_t)MAX_LINE;
+    }
+
+    static const uint8_t VERSION = 2;  ///< 2: built along with .jt and .ji
+
+    struct __attribute__((packed)) Header {
+        char magic[3];
+        uint8_t version;
+        uint32_t srcSize;
+        uint32_t srcTime;
+    };
+
+    static const size_t RECORD_HEADER = 5;
+
+    static String sidecarPath(const String &path) { return path + ".jc"; }
+
+    static String timesPath(const String &path) { return path + ".jt"; }
+
+    /** Opens cache of a source file, positioned at the first record. Returns invalid File if there is no valid cache. */
+    static File open(const String &path, File &src);
+
+    /** Reads time index of a source file. Returns false if there is no valid one. */
+    static bool loadTimes(const String &path, File &src, TimeIndex &times);
+
+    static void remove(const String &path);
+
+    /** 
+     * Builds the missing or stale sidecars of a file in a background task. A valid cache is never rewritten,
+     * a job may be reading it; its times and seek index are rebuilt from the source if they are missing.
+     */
+    static void prepare(const String &path);
+
+    /** JobCacheWriter::Part bits of sidecars a file lacks */
+    static uint8_t missing(const String &path, File &src);
+
+    static bool isPreparing() { return preparing; }
+
+    /** Strips comment, leading/trailing whitespace and collapses whitespace runs. Returns new length. */
+    static size_t normalizeLine(char* line, size_t len);
+
+private:
+
+    static std::atomic<bool> preparing;
+
+    static void prepareTask(void* arg);
+
+};
+
+
+/** Builds cache incrementally from raw bytes of a source file */
+class JobCacheWriter {
+public:
+
+    enum Part : uint8_t { CACHE = 1, TIMES = 2, SEEKS = 4, ALL = 7 };
+
+    JobCacheWriter(): srcSize(0), srcTime(0), parts(ALL), lineLen(0), srcPos(0), srcLine(0), outLen(0), outPos(0), failed(false), opened(false) {}
+
+    /** 
+     * parts: sidecars to write. Without CACHE, records are only counted, so the seek index refers to 
+     * the existing cache built from the same source.
+     */
+    bool begin(const String &srcPath, uint32_t srcSize, uint32_t srcTime, uint8_t parts=ALL);
+
+    void feed(const uint8_t* data, size_t len);
+
+    /** Writes the last line and moves cache in place. Returns false if cache could not be built. */
+    bool finish();
+
+    /** Same as finish(), for a source whose size and time are known only after it's written */
+    bool finish(uint32_t srcSize, uint32_t srcTime);
+
+    void abort();
+
+private:
+
+    String srcPath;
+    String path;
+    File out;
+    uint32_t srcSize, srcTime;
+    uint8_t parts;
+
+    MotionEstimator estimator;
+    TimeIndex times;
+    SeekIndexWriter seeks;
+
+    char line[JobCache::MAX_LINE+1];
+    size_t lineLen;
+    size_t maxLen;
+    uint32_t srcPos;
+    uint32_t srcLine;   ///< LFs so far
+
+    uint8_t outBuf[1024];
+    size_t outLen;
+    uint32_t outPos;    ///< bytes of cache written, incl. buffered
+
+    bool failed;
+    bool opened;    ///< between begin() and finish() or abort()
+
+    void endLine();
+    void write(const void* data, size_t len);
+    void flush();
+    void writeTimes();
+
+};
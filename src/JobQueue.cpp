@@ -0,0 +1,178 @@
+#include "JobQueue.h"
+
+#include <ArduinoJson.h>
+
+
+static const char* QUEUE_FILE = "/jobqueue.json";
+
+SemaphoreHandle_t JobQueue::mutex = nullptr;
+JobQueue::Entry JobQueue::entries[MAX_JOBS];
+size_t JobQueue::count = 0;
+uint32_t JobQueue::lastId = 0;
+bool JobQueue::started = false;
+bool JobQueue::starting = false;
+bool JobQueue::handedOff = false;
+uint32_t JobQueue::handedId = 0;
+uint32_t JobQueue::handedAt = 0;
+bool JobQueue::dirty = false;
+
+
+static void copyField(char* dst, const char* src, size_t len) {
+    strncpy(dst, src!=nullptr ? src : "", len);
+    dst[len] = 0;
+}
+
+void JobQueue::begin() {
+    if(mutex!=nullptr) return;
+    mutex = xSemaphoreCreateMutex();
+
+    File f = SD.open(QUEUE_FILE);
+    if(!f) return;
+    DynamicJsonDocument doc( JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(MAX_JOBS)
+        + MAX_JOBS*(JSON_OBJECT_SIZE(3) + MAX_PATH + 2*AMBLE_LEN + 3) );
+    DeserializationError error;
+    SDScheduler::run(SDScheduler::INTERACTIVE, [&]() { error = deserializeJson(doc, f); });
+    f.close();
+    if(error) { JQ_DEBUGF("JobQueue: can't read %s\n", QUEUE_FILE); return; }
+    for(JsonVariantConst j: doc["jobs"].as<JsonArrayConst>()) {
+        add( j["file"] | "", j["pre"] | "", j["post"] | "" );
+    }
+    dirty = false;
+    JQ_DEBUGF("JobQueue: %d jobs\n", count);
+}
+
+bool JobQueue::add(const char* path, const char* pre, const char* post, size_t index) {
+    if(path==nullptr || path[0]==0 || strlen(path)>MAX_PATH) return false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool ok = count<MAX_JOBS;
+    if(ok) {
+        if(index>count) index = count;
+        memmove(entries+index+1, entries+index, (count-index)*sizeof(Entry));
+        Entry &e = entries[index];
+        e.id = ++lastId;
+        copyField(e.path, path, MAX_PATH);
+        copyField(e.pre, pre, AMBLE_LEN);
+        copyField(e.post, post, AMBLE_LEN);
+        count++;
+        dirty = true;
+    }
+    xSemaphoreGive(mutex);
+    return ok;
+}
+
+bool JobQueue::remove(size_t index) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool ok = index<count;
+    if(ok) removeAt(index);
+    xSemaphoreGive(mutex);
+    return ok;
+}
+
+bool JobQueue::move(size_t from, size_t to) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool ok = from<count && to<count;
+    if(ok && from!=to) {
+        Entry e = entries[from];
+        if(from<to) memmove(entries+from, entries+from+1, (to-from)*sizeof(Entry));
+        else memmove(entries+to+1, entries+to, (from-to)*sizeof(Entry));
+        entries[to] = e;
+        dirty = true;
+    }
+    xSemaphoreGive(mutex);
+    return ok;
+}
+
+void JobQueue::clear() {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    count = 0;
+    dirty = true;
+    xSemaphoreGive(mutex);
+}
+
+void JobQueue::start() {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    started = true;
+    starting = true;
+    xSemaphoreGive(mutex);
+}
+
+void JobQueue::stop() {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    started = false;
+    xSemaphoreGive(mutex);
+}
+
+void JobQueue::removeAt(size_t i) {
+    memmove(entries+i, entries+i+1, (count-i-1)*sizeof(Entry));
+    count--;
+    dirty = true;
+}
+
+void JobQueue::loop() {
+    Job *job = Job::getJob();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if(handedOff) {
+        if(job->getChainCount()!=handedAt) {
+            // job has switched to it
+            handedOff = false;
+            for(size_t i=0; i<count; i++) if(entries[i].id==handedId) { removeAt(i); break; }
+        } else if(!job->hasNext()) {
+            handedOff = false; // dropped with a cancelled job, stays queued
+        } else if(!started || count==0 || entries[0].id!=handedId) {
+            job->clearNext(); // queue was edited or stopped
+            handedOff = false;
+        }
+    }
+
+    if(started) {
+        if(job->isRunning()) {
+            if(!handedOff && count!=0) {
+                const Entry &e = entries[0];
+                if(job->setNext(e.path, e.pre, e.post)) {
+                    handedOff = true;
+                    handedId = e.id;
+                    handedAt = job->getChainCount();
+                    JQ_DEBUGF("JobQueue: %s is next\n", e.path);
+                } else {
+                    JQ_DEBUGF("JobQueue: can't open %s, skipped\n", e.path);
+                    removeAt(0);
+                }
+            }
+        } else if(job->isCancelled() && !starting) {
+            started = false;
+        } else if(count!=0) {
+            const Entry &e = entries[0];
+            JQ_DEBUGF("JobQueue: starting %s\n", e.path);
+            job->setFile(e.path);
+            if(job->isValid()) {
+                job->setAmbles(e.pre, e.post);
+                job->start();
+            }
+            removeAt(0);
+        } else {
+            started = false; // all done
+        }
+        starting = false;
+    }
+
+    if(dirty) save();
+    xSemaphoreGive(mutex);
+}
+
+void JobQueue::save() {
+    DynamicJsonDocument doc( JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(MAX_JOBS) + MAX_JOBS*JSON_OBJECT_SIZE(3) );
+    JsonArray jobs = doc.createNestedArray("jobs");
+    for(size_t i=0; i<count; i++) {
+        JsonObject j = jobs.createNestedObject();
+        j["file"] = (const char*)entries[i].path; // not copied, entries are locked while it's written
+        if(entries[i].pre[0]!=0) j["pre"] = (const char*)entries[i].pre;
+        if(entries[i].post[0]!=0) j["post"] = (const char*)entries[i].post;
+    }
+    dirty = false; // not retried if the card is gone
+    SDScheduler::BusLock bus;
+    File f = SD.open(QUEUE_FILE, "w");
+    if(!f) { JQ_DEBUGF("JobQueue: can't write %s\n", QUEUE_FILE); return; }
+    SDScheduler::run(SDScheduler::INTERACTIVE, [&]() { serializeJson(doc, f); });
+    f.close();
+}
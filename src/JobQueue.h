@@ -0,0 +1,86 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "Job.h"
+#include "SDScheduler.h"
+
+#define JQ_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+
+
+/**
+ * Files to run one after another, e.g. the same part in several work offsets, each with optional
+ * commands before and after it. Entries are kept in /jobqueue.json across restarts; started state is not,
+ * so a reboot never starts the machine.
+ *
+ * While the queue is started and a job is running, the first entry is handed to Job::setNext(), so it's
+ * opened and read ahead before the running file ends and the device queue doesn't drain between jobs.
+ * An entry leaves the queue when the job switches to it. If nothing is running, the first entry is started.
+ * Cancelling a job stops the queue.
+ *
+ * Any task may edit the queue; loop() must run in the job feeding loop, after Job::loop().
+ */
+class JobQueue {
+public:
+
+    static const size_t MAX_JOBS = 16;
+    static const size_t MAX_PATH = 96;
+    static const size_t AMBLE_LEN = Job::AMBLE_LEN;
+
+    struct Entry {
+        uint32_t id;
+        char path[MAX_PATH+1];
+        char pre[AMBLE_LEN+1];   ///< commands before the file, lines are separated by '\n'
+        char post[AMBLE_LEN+1];  ///< commands after its last line
+    };
+
+    /** Loads the saved queue, should be called once after SDScheduler::begin() */
+    static void begin();
+
+    static void loop();
+
+    /** Inserts a file before index, appends by default. False if the queue is full or path is too long */
+    static bool add(const char* path, const char* pre=nullptr, const char* post=nullptr, size_t index=MAX_JOBS);
+
+    static bool remove(size_t index);
+
+    static bool move(size_t from, size_t to);
+
+    static void clear();
+
+    /** Runs the entries after the running job, or starts the first one if there is none */
+    static void start();
+
+    /** Stops after the running job, entries are kept */
+    static void stop();
+
+    static bool isStarted() { return started; }
+
+    static size_t size() { return count; }
+
+    /** Calls f(size_t i, const Entry&) for each entry under the queue lock, f must not call JobQueue */
+    template<typename F>
+    static void list(F f) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for(size_t i=0; i<count; i++) f(i, entries[i]);
+        xSemaphoreGive(mutex);
+    }
+
+private:
+
+    static SemaphoreHandle_t mutex;
+    static Entry entries[MAX_JOBS];
+    static size_t count;
+    static uint32_t lastId;
+    static bool started;
+    static bool starting;   ///< start() was called, a cancelled job doesn't stop the queue this time
+    static bool handedOff;  ///< entry handedId is the Job's next file
+    static uint32_t handedId;
+    static uint32_t handedAt;  ///< Job::getChainCount() when it was handed off
+    static bool dirty;
+
+    static void removeAt(size_t i);
+
+    static void save();
+};
@@ -0,0 +1,62 @@
+#include "MemoryPool.h"
+
+
+MemoryBudget MemoryPool::b = { 0, 0, 0, 4096, 4, 4096, 100, 0 };
+uint8_t* MemoryPool::pool = nullptr;
+size_t MemoryPool::size = 0;
+size_t MemoryPool::used = 0;
+portMUX_TYPE MemoryPool::mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+static void readSize(JsonObjectConst cfg, const char* key, size_t &v, size_t minV, size_t maxV) {
+    if(!cfg.containsKey(key)) return;
+    size_t x = cfg[key].as<size_t>();
+    if(x!=0 && x<minV) x = minV;
+    if(x>maxV) x = maxV;
+    v = x;
+}
+
+void MemoryPool::config(JsonObjectConst cfg) {
+    readSize(cfg, "deviceQueue", b.deviceQueue, 256, 16384);
+    readSize(cfg, "devicePriorityQueue", b.devicePriorityQueue, 64, 4096);
+    readSize(cfg, "sentLines", b.sentLines, 4, 255);
+    readSize(cfg, "jobBlock", b.jobBlock, 512, 32768);
+    readSize(cfg, "uploadBlocks", b.uploadBlocks, 2, 16);
+    readSize(cfg, "uploadBlock", b.uploadBlock, 512, 32768);
+    readSize(cfg, "lineLength", b.lineLength, 32, 255);
+    readSize(cfg, "pool", b.pool, 0, 256*1024);
+    // whole SD sectors
+    b.jobBlock = (b.jobBlock+511) & ~511;
+    b.uploadBlock = (b.uploadBlock+511) & ~511;
+    if(b.jobBlock==0) b.jobBlock = 4096;
+    if(b.uploadBlocks==0) b.uploadBlocks = 4;
+    if(b.uploadBlock==0) b.uploadBlock = 4096;
+    if(b.lineLength==0) b.lineLength = 100;
+}
+
+void MemoryPool::begin() {
+    if(pool!=nullptr) return;
+    size_t need = b.pool;
+    if(need==0) {
+        // sizes left at device defaults are covered by the reserve
+        need = DEVICE_RESERVE + b.deviceQueue + b.devicePriorityQueue + b.sentLines*16
+            + 4*b.jobBlock + b.uploadBlocks*b.uploadBlock;
+    }
+    pool = (uint8_t*)malloc(need);
+    size = pool!=nullptr ? need : 0;
+    used = 0;
+    MP_DEBUGF("MemoryPool: %d bytes%s, heap free %d\n", need, pool!=nullptr ? "" : " could not be allocated", ESP.getFreeHeap() );
+}
+
+void* MemoryPool::alloc(size_t len) {
+    len = (len+3) & ~3;
+    void *p = nullptr;
+    portENTER_CRITICAL(&mux);
+    if(pool!=nullptr && size-used >= len) { p = pool+used; used += len; }
+    portEXIT_CRITICAL(&mux);
+    if(p==nullptr) {
+        if(pool!=nullptr) MP_DEBUGF("MemoryPool: %d bytes over budget, taken from heap\n", len);
+        p = malloc(len);
+    }
+    return p;
+}
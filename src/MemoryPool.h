@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define MP_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+
+
+/** Sizes of long-lived buffers, from "memory" section of config.json. 0 means the owner's default. */
+struct MemoryBudget {
+    size_t deviceQueue;          ///< bytes, device command ring; lines stay there until acknowledged
+    size_t devicePriorityQueue;  ///< bytes, ring of UI, jog and realtime commands
+    size_t sentLines;            ///< lines in flight to firmware; the byte window follows firmware RX buffer
+    size_t jobBlock;             ///< bytes, job read-ahead block, two for the running job and two for the next one
+    size_t uploadBlocks;         ///< blocks of the upload ring
+    size_t uploadBlock;          ///< bytes, a multiple of SD sector
+    size_t lineLength;           ///< longest job line
+    size_t pool;                 ///< bytes taken at boot, 0 to sum up the above
+};
+
+
+/**
+ * Memory for buffers that live as long as the firmware: device queues and sent window,
+ * job read-ahead and upload ring.
+ *
+ * Sizes come from MemoryBudget, and all of them are taken from the heap in one piece at boot,
+ * so RAM can be moved between job pipeline and web server by editing config.json, without
+ * fragmenting the heap. Allocation just advances a pointer, nothing is ever freed.
+ * When the pool is exhausted, or before begin(), alloc() falls back to malloc.
+ */
+class MemoryPool {
+public:
+
+    static void config(JsonObjectConst cfg);
+
+    /** Takes the pool from the heap. Should be called after config() and before devices, job and web server start */
+    static void begin();
+
+    /** 4-byte aligned, may be called from any task */
+    static void* alloc(size_t size);
+
+    static const MemoryBudget& budget() { return b; }
+
+    static size_t getSize() { return size; }
+
+    static size_t getUsed() { return used; }
+
+private:
+
+    static const size_t DEVICE_RESERVE = 5120;  ///< covers default rings, sent window and Marlin resend history
+
+    static MemoryBudget b;
+    static uint8_t* pool;
+    static size_t size;
+    static size_t used;
+    static portMUX_TYPE mux;
+
+};
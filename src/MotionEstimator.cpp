@@ -0,0 +1,220 @@
+#include "MotionEstimator.h"
+
+
+void TimeIndex::add(uint32_t pos, uint32_t ms, bool force) {
+    if(!force && ++skipped < stride) return;
+    skipped = 0;
+    if(n>0 && entries[n-1].pos==pos) { entries[n-1].ms = ms; return; }
+    if(n==MAX_ENTRIES) {
+        // keep odd entries, so the latest one stays
+        for(size_t i=0; i<MAX_ENTRIES/2; i++) entries[i] = entries[2*i+1];
+        n = MAX_ENTRIES/2;
+        stride *= 2;
+    }
+    entries[n++] = Entry{pos, ms};
+}
+
+uint32_t TimeIndex::at(uint32_t pos) const {
+    if(n==0) return 0;
+    size_t lo = 0, hi = n;  // first entry with entries[i].pos >= pos
+    while(lo<hi) {
+        size_t mid = (lo+hi)/2;
+        if(entries[mid].pos < pos) lo = mid+1; else hi = mid;
+    }
+    if(lo==n) return total();
+    Entry a = lo>0 ? entries[lo-1] : Entry{0, 0};
+    const Entry &b = entries[lo];
+    if(b.pos==a.pos) return b.ms;
+    return a.ms + (uint64_t)(b.ms-a.ms) * (pos-a.pos) / (b.pos-a.pos);
+}
+
+bool TimeIndex::write(File &f, uint32_t srcSize, uint32_t srcTime) const {
+    Header h{ {'G','J','T'}, VERSION, srcSize, srcTime, (uint16_t)n };
+    size_t len = n*sizeof(Entry);
+    return f.write((const uint8_t*)&h, sizeof(h))==sizeof(h) && f.write((const uint8_t*)entries, len)==len;
+}
+
+bool TimeIndex::matches(File &f, uint32_t srcSize, uint32_t srcTime) {
+    Header h;
+    return f.read((uint8_t*)&h, sizeof(h)) == sizeof(h)
+        && strncmp(h.magic, "GJT", 3)==0 && h.version==VERSION
+        && h.srcSize==srcSize && h.srcTime==srcTime && h.count<=MAX_ENTRIES;
+}
+
+bool TimeIndex::read(File &f, uint32_t srcSize, uint32_t srcTime) {
+    clear();
+    Header h;
+    if( f.read((uint8_t*)&h, sizeof(h)) != sizeof(h)
+            || strncmp(h.magic, "GJT", 3)!=0 || h.version!=VERSION
+            || h.srcSize!=srcSize || h.srcTime!=srcTime || h.count>MAX_ENTRIES ) return false;
+    size_t len = h.count*sizeof(Entry);
+    if( f.read((uint8_t*)entries, len) != len ) return false;
+    n = h.count;
+    return true;
+}
+
+
+
+float MotionEstimator::accel = 500;
+float MotionEstimator::rapidFeed = 3000;
+
+
+void MotionEstimator::setLimits(float accel, float rapidFeed) {
+    setAccel(accel);
+    setRapidFeed(rapidFeed);
+}
+
+void MotionEstimator::reset() {
+    absolute = true;
+    scale = 1;
+    motion = 0;
+    feedRate = 0;
+    for(int i=0; i<3; i++) { pos[i] = 0; dir[i] = 0; }
+    moving = false;
+    time = 0;
+    wcs = 0;
+    spindle = 0;
+    spindleMode = 5;
+    maxZ = 0;
+}
+
+ModalState MotionEstimator::getModalState() const {
+    ModalState m;
+    for(int i=0; i<3; i++) m.pos[i] = pos[i];
+    m.feed = feedRate;
+    m.spindle = spindle;
+    m.inches = scale!=1;
+    m.absolute = absolute;
+    m.wcs = wcs;
+    m.motion = motion;
+    m.spindleMode = spindleMode;
+    m.maxZ = maxZ;
+    return m;
+}
+
+void MotionEstimator::setModalState(const ModalState &m) {
+    for(int i=0; i<3; i++) { pos[i] = m.pos[i]; dir[i] = 0; }
+    feedRate = m.feed;
+    spindle = m.spindle;
+    scale = m.inches ? 25.4 : 1;
+    absolute = m.absolute;
+    wcs = m.wcs;
+    motion = m.motion;
+    spindleMode = m.spindleMode;
+    maxZ = m.maxZ;
+    moving = false;
+}
+
+void MotionEstimator::feed(const char* line) {
+    float words[3] = {0, 0, 0};
+    bool axis[3] = {false, false, false};
+    float ij[2] = {0, 0};
+    float r = 0;
+    bool hasR = false;
+    bool noMove = false; // axis words are not a move: G4, G10, G28, G53, G92...
+
+    if(line[0]=='$') return; // Grbl settings and jogs
+
+    const char* p = line;
+    while(*p) {
+        char c = toupper(*p);
+        if(c=='(') { while(*p && *p!=')') p++; if(*p) p++; continue; }
+        if(!isalpha(c)) { p++; continue; }
+        char* end;
+        float v = strtod(p+1, &end);
+        if(end==p+1) { p++; continue; }
+        p = end;
+        switch(c) {
+            case 'G': {
+                int g = (int)(v*10+0.5);
+                switch(g) {
+                    case 0: case 10: case 20: case 30: motion = g/10; break;
+                    case 800: motion = -1; break;
+                    case 900: absolute = true; break;
+                    case 910: absolute = false; break;
+                    case 200: scale = 25.4; break;
+                    case 210: scale = 1; break;
+                    case 540: case 550: case 560: case 570: case 580: case 590: wcs = g/10-54; break;
+                    case 40: case 100: case 280: case 300: case 530: case 920: noMove = true; break;
+                }
+                break;
+            }
+            case 'X': case 'Y': case 'Z': words[c-'X'] = v; axis[c-'X'] = true; break;
+            case 'I': case 'J': ij[c-'I'] = v; break;
+            case 'R': r = v; hasR = true; break;
+            case 'F': feedRate = v; break;
+            case 'S': spindle = v; break;
+            case 'M': if(v==3 || v==4 || v==5) spindleMode = v; break;
+        }
+    }
+    if(noMove || motion<0 || !(axis[0]||axis[1]||axis[2]) ) return;
+
+    float target[3];
+    float delta[3];
+    for(int i=0; i<3; i++) {
+        target[i] = !axis[i] ? pos[i] : absolute ? words[i]*scale : pos[i]+words[i]*scale;
+        delta[i] = target[i]-pos[i];
+    }
+    if(target[2]>maxZ) maxZ = target[2];
+
+    float speed = motion==0 || feedRate<=0 ? rapidFeed : feedRate*scale;
+    if(speed>rapidFeed) speed = rapidFeed;
+
+    bool arc = motion>=2;
+    float ox = 0, oy = 0;  // arc center, relative to start
+    if(arc && hasR) {
+        r *= scale;
+        float h = 4*r*r - delta[0]*delta[0] - delta[1]*delta[1];
+        float chord = sqrt(delta[0]*delta[0] + delta[1]*delta[1]);
+        if(h<0 || chord<=0) arc = false; // Grbl would reject it, count as a line
+        else {
+            h = -sqrt(h)/chord;
+            if(motion==3) h = -h;
+            if(r<0) h = -h;
+            ox = 0.5*(delta[0] - delta[1]*h);
+            oy = 0.5*(delta[1] + delta[0]*h);
+        }
+    } else if(arc) {
+        ox = ij[0]*scale;
+        oy = ij[1]*scale;
+    }
+    float radius = sqrt(ox*ox + oy*oy);
+    if(radius<=0) arc = false;
+
+    if(!arc) {
+        float len = sqrt(delta[0]*delta[0] + delta[1]*delta[1] + delta[2]*delta[2]);
+        if(len<=0) return;
+        float d[3] = { delta[0]/len, delta[1]/len, delta[2]/len };
+        move(target, len, speed, d, d);
+        return;
+    }
+
+    // arc in XY plane
+    float a0 = atan2(-oy, -ox);
+    float a1 = atan2(delta[1]-oy, delta[0]-ox);
+    float sweep = a1-a0;
+    if(motion==2) { if(sweep>=0) sweep -= 2*PI; }
+    else { if(sweep<=0) sweep += 2*PI; }
+    float arcLen = fabs(sweep)*radius;
+    float len = sqrt(arcLen*arcLen + delta[2]*delta[2]);
+
+    float s = motion==2 ? -1 : 1;  // tangent is radius turned by 90 deg in direction of motion
+    float zs = delta[2]/len, xys = arcLen/len;
+    float startDir[3] = { -s*sin(a0)*xys, s*cos(a0)*xys, zs };
+    float endDir[3]   = { -s*sin(a1)*xys, s*cos(a1)*xys, zs };
+
+    float vmax = sqrt(accel*radius)*60;  // centripetal acceleration limit
+    if(speed>vmax) speed = vmax;
+    move(target, len, speed, startDir, endDir);
+}
+
+void MotionEstimator::move(const float *target, float len, float speed, const float *startDir, const float *endDir) {
+    float v = speed/60;
+    // part of a full stop spent at the junction: 0 going straight on, 1 reversing or starting
+    float k = 1;
+    if(moving) k = (1 - (dir[0]*startDir[0] + dir[1]*startDir[1] + dir[2]*startDir[2]) ) / 2;
+    if(!moving && len < v*v/accel) time += 2*sqrt(len/accel); // too short to reach full speed
+    else time += len/v + k*v/accel;
+    for(int i=0; i<3; i++) { pos[i] = target[i]; dir[i] = endDir[i]; }
+    moving = true;
+}
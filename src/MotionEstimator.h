@@ -0,0 +1,133 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+
+
+/**
+ * Time from start of a job to source file offsets.
+ * Holds up to MAX_ENTRIES points and interpolates between them; when it's full, every other point
+ * is dropped, so points stay evenly spread over a file of any length.
+ */
+class TimeIndex {
+public:
+
+    static const size_t MAX_ENTRIES = 256;
+
+    struct Entry {
+        uint32_t pos;  ///< offset in source file
+        uint32_t ms;   ///< estimated time from start of the job to this offset
+    };
+
+    TimeIndex() { clear(); }
+
+    void clear() { n = 0; stride = 1; skipped = 0; }
+
+    bool isValid() const { return n>0; }
+
+    /** Called for every line; last entry must be added with force set */
+    void add(uint32_t pos, uint32_t ms, bool force=false);
+
+    /** Estimated time of the whole job, ms */
+    uint32_t total() const { return n>0 ? entries[n-1].ms : 0; }
+
+    /** Estimated time from start to source offset, ms */
+    uint32_t at(uint32_t pos) const;
+
+    /** Writes index to a sidecar, tagged with source file size and time like JobCache */
+    bool write(File &f, uint32_t srcSize, uint32_t srcTime) const;
+
+    /** Reads index, fails if it was built for another version of the source file */
+    bool read(File &f, uint32_t srcSize, uint32_t srcTime);
+
+    /** Same check as read(), header only */
+    static bool matches(File &f, uint32_t srcSize, uint32_t srcTime);
+
+private:
+
+    static const uint8_t VERSION = 1;
+
+    struct __attribute__((packed)) Header {
+        char magic[3];
+        uint8_t version;
+        uint32_t srcSize;
+        uint32_t srcTime;
+        uint16_t count;
+    };
+
+    Entry entries[MAX_ENTRIES];
+    size_t n;
+    uint32_t stride;   ///< lines per entry
+    uint32_t skipped;  ///< lines since the last entry
+};
+
+
+/** Modal state of a gcode program before some line, enough to run the program from there */
+struct __attribute__((packed)) ModalState {
+    float pos[3];         ///< mm, in current work coordinates
+    float feed;           ///< F word, in program units
+    float spindle;        ///< S word
+    uint8_t inches;       ///< G20
+    uint8_t absolute;     ///< G90
+    uint8_t wcs;          ///< 0..5 for G54..G59
+    int8_t motion;        ///< 0..3 for G0..G3, -1 for G80
+    uint8_t spindleMode;  ///< 3, 4 or 5 for M3, M4, M5
+    float maxZ;           ///< mm, highest Z so far, clearance to resume from
+};
+
+
+/**
+ * Estimates execution time of gcode lines, fed one by one (as normalized by JobCache).
+ *
+ * Tracks G90/G91, G20/G21, F, and lengths of G0/G1 and G2/G3 (I,J or R) moves.
+ * Each move costs its length at feed rate plus acceleration time, scaled by how sharp the corner
+ * to the previous move is: a stop costs a full v/a, a straight continuation costs nothing.
+ * Dwells and Z-only arcs are ignored.
+ * Also keeps the rest of modal state (WCS, spindle) for SeekIndex.
+ */
+class MotionEstimator {
+public:
+
+    MotionEstimator() { reset(); }
+
+    /** Acceleration in mm/s2 and rapid feed in mm/min, as read from firmware settings */
+    static void setLimits(float accel, float rapidFeed);
+
+    static void setAccel(float accel) { if(accel>0) MotionEstimator::accel = accel; }
+
+    static void setRapidFeed(float rapidFeed) { if(rapidFeed>0) MotionEstimator::rapidFeed = rapidFeed; }
+
+    void reset();
+
+    ModalState getModalState() const;
+
+    /** Continues from a saved state, as if the machine has stopped there */
+    void setModalState(const ModalState &m);
+
+    /** Accounts one 0-terminated line */
+    void feed(const char* line);
+
+    /** Seconds from reset() */
+    float getTime() const { return time; }
+
+private:
+
+    static float accel;
+    static float rapidFeed;
+
+    bool absolute;
+    float scale;       ///< mm per unit
+    int motion;        ///< modal G0..G3
+    float feedRate;    ///< mm/min
+    float pos[3];
+    float dir[3];      ///< of the last move, unit length
+    bool moving;       ///< last move ended without a stop
+    double time;
+    uint8_t wcs;
+    float spindle;
+    uint8_t spindleMode;
+    float maxZ;
+
+    /** speed in mm/min, directions are unit vectors at move ends */
+    void move(const float *target, float len, float speed, const float *startDir, const float *endDir);
+};
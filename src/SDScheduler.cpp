@@ -0,0 +1,35 @@
+#include "SDScheduler.h"
+
+
+TaskHandle_t SDScheduler::task = nullptr;
+QueueHandle_t SDScheduler::queues[N_PRIORITIES];
+SemaphoreHandle_t SDScheduler::pending = nullptr;
+SemaphoreHandle_t SDScheduler::bus = nullptr;
+
+
+void SDScheduler::begin() {
+    if(task!=nullptr) return;
+    for(int p=0; p<N_PRIORITIES; p++) queues[p] = xQueueCreate(QUEUE_LEN, sizeof(Request*));
+    pending = xSemaphoreCreateCounting(N_PRIORITIES*QUEUE_LEN, 0);
+    bus = xSemaphoreCreateRecursiveMutex();
+    xTaskCreatePinnedToCore(taskFunc, "SDScheduler",
+        4096, nullptr, 2, &task, 0); // cpu0, the job is fed from cpu1
+}
+
+void SDScheduler::submit(Priority p, Request *r) {
+    xQueueSend(queues[p], &r, portMAX_DELAY);
+    xSemaphoreGive(pending);
+}
+
+void SDScheduler::taskFunc(void* arg) {
+    while(1) {
+        xSemaphoreTake(pending, portMAX_DELAY);
+        Request *r = nullptr;
+        for(int p=0; p<N_PRIORITIES; p++) {
+            if(xQueueReceive(queues[p], &r, 0) == pdTRUE) { SDS_DEBUGF("SDScheduler: running prio %d\n", p); break; }
+        }
+        if(r==nullptr) continue;
+        { BusLock lock; r->func(r->ctx); }
+        if(r->done!=nullptr) xSemaphoreGive(r->done);
+    }
+}
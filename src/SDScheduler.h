@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define SDS_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+
+
+/**
+ * Single owner of SD card bandwidth.
+ *
+ * File reads and writes of all tasks are queued here as requests and run one by one by an SD task
+ * (pinned to cpu0), highest priority first. Active job's read-ahead goes before everything else,
+ * so an upload or a download gets only what the job leaves, and can delay a job block by one request at most.
+ *
+ * A request should be a bounded piece of work, e.g. one block. Requests must not submit requests.
+ * Opening, removing and checking files go directly to SD, they're short, but under a BusLock.
+ *
+ * SD card shares the SPI bus with the LCD, whose chip select is driven outside SD transactions.
+ * Requests run under the bus lock, and so does the LCD flush. A task holding the lock runs its requests
+ * in place, it would wait for itself otherwise.
+ */
+class SDScheduler {
+public:
+
+    enum Priority { JOB, INTERACTIVE, BULK, N_PRIORITIES };
+
+    struct Request {
+        void (*func)(void* ctx);
+        void* ctx;
+        SemaphoreHandle_t done;  ///< given when request has run, nullptr if nobody waits
+    };
+
+    /** Creates SD task. Should be called once before any file is accessed. */
+    static void begin();
+
+    /** Queues request and returns at once; request must stay valid till it has run. */
+    static void submit(Priority p, Request *r);
+
+    /** Holds the SPI bus shared by SD card and LCD for its scope. Recursive. */
+    class BusLock {
+    public:
+        BusLock() { if(bus!=nullptr) xSemaphoreTakeRecursive(bus, portMAX_DELAY); }
+        ~BusLock() { if(bus!=nullptr) xSemaphoreGiveRecursive(bus); }
+        BusLock(const BusLock&) = delete;
+        BusLock& operator=(const BusLock&) = delete;
+    };
+
+    /** Runs f() in SD task and waits for it */
+    template<typename F>
+    static void run(Priority p, F f) {
+        TaskHandle_t self = xTaskGetCurrentTaskHandle();
+        if(task==nullptr || self==task || (bus!=nullptr && xSemaphoreGetMutexHolder(bus)==self) ) { f(); return; }
+        StaticSemaphore_t sem;
+        Request r{ &call<F>, &f, xSemaphoreCreateBinaryStatic(&sem) };
+        submit(p, &r);
+        xSemaphoreTake(r.done, portMAX_DELAY);
+        vSemaphoreDelete(r.done);
+    }
+
+private:
+
+    static const size_t QUEUE_LEN = 8;
+
+    static TaskHandle_t task;
+    static QueueHandle_t queues[N_PRIORITIES];
+    static SemaphoreHandle_t pending;  ///< counts queued requests of all priorities
+    static SemaphoreHandle_t bus;      ///< recursive mutex, see BusLock
+
+    template<typename F>
+    static void call(void* ctx) { (*static_cast<F*>(ctx))(); }
+
+    static void taskFunc(void* arg);
+
+};
@@ -0,0 +1,92 @@
+#include "SeekIndex.h"
+
+
+bool SeekIndex::find(const String &srcPath, File &src, uint32_t line, Entry &e) {
+    String ipath = path(srcPath);
+    if(!SD.exists(ipath)) return false;
+    File f = SD.open(ipath);
+    if(!f) return false;
+    Trailer t;
+    bool ok = f.size() >= sizeof(t) && f.seek(f.size()-sizeof(t))
+        && f.read((uint8_t*)&t, sizeof(t)) == sizeof(t)
+        && strncmp(t.magic, "GJI", 3)==0 && t.version==VERSION
+        && t.srcSize==src.size() && t.srcTime==(uint32_t)src.getLastWrite() && t.count>0;
+    if(ok) {
+        uint32_t k = line/STRIDE;
+        if(k>=t.count) k = t.count-1;
+        ok = f.seek(k*sizeof(Entry)) && f.read((uint8_t*)&e, sizeof(e)) == sizeof(e);
+    }
+    f.close();
+    return ok;
+}
+
+size_t SeekIndex::preamble(const ModalState &m, char* buf, size_t size, bool dwellMs) {
+    // positions are in mm of the current WCS
+    size_t n = snprintf(buf, size, "G21 G90 G%d\n", 54+m.wcs);
+    // after an alarm the tool may be in the stock: up first, then XY, spindle, and down to Z
+    float clearZ = m.maxZ > m.pos[2] ? m.maxZ : m.pos[2];
+    if(n<size) n += snprintf(buf+n, size-n, "G0 Z%.3f\n", clearZ);
+    if(n<size) n += snprintf(buf+n, size-n, "G0 X%.3f Y%.3f\n", m.pos[0], m.pos[1]);
+    if(m.spindleMode!=5 && n<size) {
+        n += snprintf(buf+n, size-n, "S%.0f M%d\n", m.spindle, m.spindleMode);
+        if(dwellMs) { if(n<size) n += snprintf(buf+n, size-n, "G4 P%u\n", (unsigned)SPINDLE_DWELL_MS); }
+        else if(n<size) n += snprintf(buf+n, size-n, "G4 P%.1f\n", SPINDLE_DWELL_MS/1000.0);
+    }
+    float feedMm = m.inches ? m.feed*25.4 : m.feed;
+    if(n<size) {
+        if(feedMm>0) n += snprintf(buf+n, size-n, "G1 Z%.3f F%.1f\n", m.pos[2], feedMm);
+        else n += snprintf(buf+n, size-n, "G0 Z%.3f\n", m.pos[2]);
+    }
+    // arcs can't be set without axis words, G1 is the nearest; see preamble() doc
+    const char* motion = m.motion<0 ? "G80" : m.motion==0 ? "G0" : "G1";
+    if(n<size) n += snprintf(buf+n, size-n, "G%d G%d %s", m.inches ? 20 : 21, m.absolute ? 90 : 91, motion);
+    if(m.feed>0 && n<size) n += snprintf(buf+n, size-n, " F%.3f", m.feed);
+    if(n<size) n += snprintf(buf+n, size-n, "\n");
+    return n<size ? n : 0;
+}
+
+
+
+bool SeekIndexWriter::begin(const String &srcPath) {
+    path = SeekIndex::path(srcPath);
+    String tmp = path + ".tmp";
+    if(SD.exists(tmp)) SD.remove(tmp);
+    count = 0; bufLen = 0;
+    failed = false;
+    return true;
+}
+
+void SeekIndexWriter::add(const SeekIndex::Entry &e) {
+    if(failed) return;
+    buf[bufLen++] = e;
+    count++;
+    if(bufLen==BUF_ENTRIES) flush();
+}
+
+void SeekIndexWriter::flush() {
+    if(bufLen==0) return;
+    File f = SD.open(path + ".tmp", "a");
+    size_t len = bufLen*sizeof(SeekIndex::Entry);
+    if(!f || f.write((const uint8_t*)buf, len) != len) failed = true;
+    if(f) f.close();
+    bufLen = 0;
+}
+
+bool SeekIndexWriter::finish(uint32_t srcSize, uint32_t srcTime) {
+    flush();
+    String tmp = path + ".tmp";
+    if(!failed) {
+        SeekIndex::Trailer t{ count, srcSize, srcTime, SeekIndex::VERSION, {'G','J','I'} };
+        File f = SD.open(tmp, "a");
+        if(!f || f.write((const uint8_t*)&t, sizeof(t)) != sizeof(t)) failed = true;
+        if(f) f.close();
+    }
+    if(failed) { SD.remove(tmp); return false; }
+    if(SD.exists(path)) SD.remove(path);
+    return SD.rename(tmp, path);
+}
+
+void SeekIndexWriter::abort() {
+    String tmp = path + ".tmp";
+    if(SD.exists(tmp)) SD.remove(tmp);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "MotionEstimator.h"
+
+
+/**
+ * Sparse index of lines of a gcode file, to start a job from any line.
+ *
+ * An entry per STRIDE lines (counted by LF) holds offsets of the line start in the source file
+ * and in the job cache, and modal state before the line. Entries are fixed size and stored in order
+ * in a sidecar (`file.gcode.ji`), entry k is for line k*STRIDE, so finding one is a single seek.
+ * A trailer ties the index to size and time of the source, like JobCache header.
+ *
+ * Built by JobCacheWriter along with the cache.
+ */
+class SeekIndex {
+public:
+
+    static const uint32_t STRIDE = 256;
+
+    struct __attribute__((packed)) Entry {
+        uint32_t line;      ///< 0-based
+        uint32_t srcPos;    ///< line start in source file
+        uint32_t cachePos;  ///< first record of this line or after it in job cache
+        ModalState modal;
+    };
+
+    static String path(const String &srcPath) { return srcPath + ".ji"; }
+
+    /** Reads the last entry at or before a line. Returns false if there is no valid index. */
+    static bool find(const String &srcPath, File &src, uint32_t line, Entry &e);
+
+    /** True if there is an index built for this version of the source */
+    static bool exists(const String &srcPath, File &src) { Entry e; return find(srcPath, src, 0, e); }
+
+    static const uint32_t SPINDLE_DWELL_MS = 2000; ///< spin-up time before plunging
+
+    /** 
+     * Writes commands that restore modal state and move to the start point, separated by '\n'.
+     * Retracts to the highest Z of the program first, rapids over the start point, starts the spindle
+     * and plunges at feed. dwellMs: G4 P is in ms (Marlin), not seconds (Grbl).
+     *
+     * G2/G3 are restored as G1, so the first line should have its own motion word: 
+     * a line that continues an arc with axis words only would run as a straight move.
+     */
+    static size_t preamble(const ModalState &m, char* buf, size_t size, bool dwellMs);
+
+private:
+
+    friend class SeekIndexWriter;
+
+    static const uint8_t VERSION = 2;  ///< 2: ModalState::maxZ
+
+    struct __attribute__((packed)) Trailer {
+        uint32_t count;
+        uint32_t srcSize;
+        uint32_t srcTime;
+        uint8_t version;
+        char magic[3];
+    };
+
+};
+
+
+/**
+ * Collects entries in a small buffer and appends them to the index file in batches,
+ * so the file is not kept open next to the source and the cache.
+ */
+class SeekIndexWriter {
+public:
+
+    SeekIndexWriter(): count(0), bufLen(0), failed(false) {}
+
+    bool begin(const String &srcPath);
+
+    void add(const SeekIndex::Entry &e);
+
+    /** Writes trailer and moves index in place */
+    bool finish(uint32_t srcSize, uint32_t srcTime);
+
+    void abort();
+
+private:
+
+    static const size_t BUF_ENTRIES = 16;
+
+    String path;
+    uint32_t count;
+    SeekIndex::Entry buf[BUF_ENTRIES];
+    size_t bufLen;
+    bool failed;
+
+    void flush();
+
+};
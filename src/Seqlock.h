@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+
+
+/**
+ * Snapshot of a state, published by one writer task and read by any task without locks.
+ * Writer never waits; a reader retries if a write happened while it was copying.
+ * T should be trivially copyable and small.
+ */
+template<typename T>
+class Seqlock {
+public:
+
+    Seqlock(): seq(0), data() {}
+
+    /** Must be called from a single task */
+    void write(const T &v) {
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s+1, std::memory_order_relaxed);  // odd: write in progress
+        std::atomic_thread_fence(std::memory_order_release);
+        data = v;
+        std::atomic_thread_fence(std::memory_order_release);
+        seq.store(s+2, std::memory_order_relaxed);
+    }
+
+    T read() const {
+        T v;
+        uint32_t s0, s1;
+        do {
+            s0 = seq.load(std::memory_order_acquire);
+            v = data;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s1 = seq.load(std::memory_order_relaxed);
+        } while( (s0 & 1) || s0!=s1 );
+        return v;
+    }
+
+private:
+    std::atomic<uint32_t> seq;
+    T data;
+};
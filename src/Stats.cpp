@@ -0,0 +1,69 @@
+#include "Stats.h"
+
+
+Stats::StageStats Stats::stages[N_STAGES];
+uint32_t Stats::levels[N_LEVELS];
+uint32_t Stats::mhz = 0;
+uint32_t Stats::since = 0;
+uint32_t Stats::lastWindow = 0;
+bool Stats::lastEmpty = false;
+bool Stats::lastStreaming = false;
+uint64_t Stats::streamingUs = 0;
+uint64_t Stats::starvedUs = 0;
+
+
+void Stats::reset() {
+    mhz = getCpuFrequencyMhz();
+    for(StageStats &s: stages) s = StageStats{};
+    for(uint32_t &l: levels) l = 0;
+    streamingUs = starvedUs = 0;
+    lastWindow = micros();
+    lastStreaming = false;
+    since = millis();
+}
+
+void Stats::window(bool empty, bool streaming) {
+    uint32_t now = micros();
+    uint32_t dt = now-lastWindow;
+    // the interval since the last call is in the state seen then
+    if(lastStreaming) {
+        streamingUs += dt;
+        if(lastEmpty) starvedUs += dt;
+    }
+    lastWindow = now;
+    lastEmpty = empty;
+    lastStreaming = streaming;
+}
+
+const char* Stats::stageName(Stage s) {
+    static const char* const names[N_STAGES] = { "readLine", "schedule", "send", "trySend", "receive", "draw",
+        "deviceTask", "jobTask", "uiTask" };
+    return names[s];
+}
+
+const char* Stats::levelName(Level l) {
+    static const char* const names[N_LEVELS] = { "jobQueue", "priorityQueue", "sentLines", "sentBytes" };
+    return names[l];
+}
+
+uint32_t Stats::load(Stage s) {
+    uint64_t elapsedUs = (uint64_t)getElapsedMs()*1000;
+    if(elapsedUs==0) return 0;
+    return toUs(stages[s].cycles)*1000 / elapsedUs;
+}
+
+void Stats::printJson(Print &p) {
+    p.printf("{\"enabled\":%s,\"elapsed\":%u,\"streaming\":%u,\"starved\":%u,\"stages\":{",
+        isEnabled() ? "true" : "false", getElapsedMs(), getStreamingMs(), getStarvedMs() );
+    for(int i=0; i<N_STAGES; i++) {
+        const StageStats &s = stages[i];
+        uint32_t l = load(Stage(i));
+        p.printf("%s\"%s\":{\"count\":%u,\"totalMs\":%u,\"maxUs\":%u,\"load\":%u.%u,\"buckets\":[", i==0 ? "" : ",",
+            stageName(Stage(i)), s.count, (uint32_t)(toUs(s.cycles)/1000), (uint32_t)toUs(s.maxCycles), l/10, l%10 );
+        for(size_t b=0; b<N_BUCKETS; b++) p.printf(b==0 ? "%u" : ",%u", s.buckets[b]);
+        p.print("]}");
+    }
+    p.print("},\"highWater\":{");
+    for(int i=0; i<N_LEVELS; i++) p.printf("%s\"%s\":%u", i==0 ? "" : ",", levelName(Level(i)), levels[i]);
+    p.print("}}");
+}
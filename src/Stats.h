@@ -0,0 +1,113 @@
+#pragma once
+
+#include <Arduino.h>
+#include <xtensa/hal.h>
+
+
+/**
+ * Timing and occupancy counters of the streaming pipeline.
+ *
+ * Each instrumented stage keeps a histogram of its run times in power-of-two microsecond buckets,
+ * its total and longest run; cycles come from the CPU cycle counter, so a record costs a few
+ * instructions. Queues keep their high-water marks. Time the sent window stays empty while a job
+ * is streaming is counted as starvation: firmware may be running out of planned moves then.
+ * The *_TASK stages wrap whole loop iterations, their share of elapsed time is the task's CPU load.
+ *
+ * Recording is compiled in only with STATS_ENABLED build flag; without it the macros are empty.
+ * Counters are written without locks by their own task; a report may be slightly inconsistent.
+ */
+class Stats {
+public:
+
+    enum Stage { READ_LINE, SCHEDULE, SEND, TRY_SEND, RECEIVE, DRAW, DEVICE_TASK, JOB_TASK, UI_TASK, N_STAGES };
+
+    enum Level { JOB_QUEUE, PRIORITY_QUEUE, SENT_LINES, SENT_BYTES, N_LEVELS };
+
+    static const size_t N_BUCKETS = 16;  ///< [0,1), [1,2), [2,4) .. us; the last one is open
+
+    struct StageStats {
+        uint32_t count;
+        uint64_t cycles;
+        uint32_t maxCycles;
+        uint32_t buckets[N_BUCKETS];
+    };
+
+    static bool isEnabled() {
+#ifdef STATS_ENABLED
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static void reset();
+
+    static inline void record(Stage s, uint32_t cycles) {
+        if(mhz==0) mhz = getCpuFrequencyMhz();
+        StageStats &st = stages[s];
+        st.count++;
+        st.cycles += cycles;
+        if(cycles>st.maxCycles) st.maxCycles = cycles;
+        uint32_t us = cycles/mhz;
+        size_t b = us==0 ? 0 : 32-__builtin_clz(us);
+        st.buckets[b<N_BUCKETS ? b : N_BUCKETS-1]++;
+    }
+
+    static inline void level(Level l, uint32_t v) { if(v>levels[l]) levels[l] = v; }
+
+    /** Called on every job loop with the current state of the sent window; time between calls is counted as streaming and, if the window was empty, starved */
+    static void window(bool empty, bool streaming);
+
+    static const StageStats& stage(Stage s) { return stages[s]; }
+
+    static uint32_t highWater(Level l) { return levels[l]; }
+
+    static const char* stageName(Stage s);
+
+    static const char* levelName(Level l);
+
+    static uint64_t toUs(uint64_t cycles) { return mhz!=0 ? cycles/mhz : 0; }
+
+    static uint32_t getElapsedMs() { return millis()-since; }
+
+    static uint32_t getStreamingMs() { return streamingUs/1000; }
+
+    static uint32_t getStarvedMs() { return starvedUs/1000; }
+
+    /** Share of elapsed time spent in a stage, in 0.1% */
+    static uint32_t load(Stage s);
+
+    static void printJson(Print &p);
+
+    /** Measures the enclosing block */
+    class Scope {
+    public:
+        Scope(Stage s): s(s), t0(xthal_get_ccount()) {}
+        ~Scope() { record(s, xthal_get_ccount()-t0); }
+    private:
+        Stage s;
+        uint32_t t0;
+    };
+
+private:
+
+    static StageStats stages[N_STAGES];
+    static uint32_t levels[N_LEVELS];
+    static uint32_t mhz;
+    static uint32_t since;         ///< ms, last reset
+    static uint32_t lastWindow;    ///< us, last window() call
+    static bool lastEmpty, lastStreaming;
+    static uint64_t streamingUs, starvedUs;
+
+};
+
+
+#ifdef STATS_ENABLED
+#define STATS_SCOPE(s)              Stats::Scope _statsScope(Stats::s)
+#define STATS_LEVEL(l, v)           Stats::level(Stats::l, v)
+#define STATS_WINDOW(empty, streaming) Stats::window(empty, streaming)
+#else
+#define STATS_SCOPE(s)
+#define STATS_LEVEL(l, v)
+#define STATS_WINDOW(empty, streaming)
+#endif
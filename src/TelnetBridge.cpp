@@ -0,0 +1,152 @@
+#include "TelnetBridge.h"
+
+
+void TelnetBridge::begin() {
+    if(mutex==nullptr) mutex = xSemaphoreCreateMutex();
+    server.onClient( [](void* arg, AsyncClient *cli) { static_cast<TelnetBridge*>(arg)->onClient(cli); }, this );
+    server.begin();
+}
+
+void TelnetBridge::end() {
+    server.end();
+}
+
+void TelnetBridge::onClient(AsyncClient *cli) {
+    Serial.print("telnetServer.onClient "); cli->remoteIP().printTo(Serial);Serial.println("");
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint8_t *bufs = nClients<MAX_CLIENTS ? (uint8_t*)malloc(IN_BUF+OUT_BUF) : nullptr;
+    if(bufs==nullptr) {
+        xSemaphoreGive(mutex);
+        Serial.println("telnetServer: no room for a client");
+        cli->close(true);
+        return;
+    }
+    Client &c = clients[nClients++];
+    c = Client{};
+    c.cli = cli;
+    c.in = bufs;
+    c.out = bufs+IN_BUF;
+    xSemaphoreGive(mutex);
+
+    cli->onData( [](void* arg, AsyncClient* client, void *data, size_t len) {
+        static_cast<TelnetBridge*>(arg)->onData(client, (const uint8_t*)data, len);
+    }, this );
+    cli->onTimeout( [](void* t, AsyncClient* cli_, uint32_t tm) { Serial.print("telnetServer onTimeout "); cli_->remoteIP().printTo(Serial); Serial.println("");}  );
+    cli->onError( [](void* t, AsyncClient* cli_, uint16_t e) { Serial.print("telnetServer onError "); cli_->remoteIP().printTo(Serial); Serial.println("");}  );
+    cli->onDisconnect( [](void* arg, AsyncClient* cli_) {
+        Serial.print("telnetServer onDisconnect "); cli_->remoteIP().printTo(Serial); Serial.println("");
+        static_cast<TelnetBridge*>(arg)->onDisconnect(cli_);
+    }, this );
+}
+
+void TelnetBridge::onDisconnect(AsyncClient *cli) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    Client *c = find(cli);
+    if(c!=nullptr) {
+        free(c->in);
+        *c = clients[--nClients];
+    }
+    xSemaphoreGive(mutex);
+}
+
+TelnetBridge::Client* TelnetBridge::find(AsyncClient *cli) {
+    for(size_t i=0; i<nClients; i++) if(clients[i].cli==cli) return &clients[i];
+    return nullptr;
+}
+
+void TelnetBridge::onData(AsyncClient *cli, const uint8_t *data, size_t len) {
+    GCodeDevice *dev = GCodeDevice::getDevice();
+    if(dev==nullptr) return;
+    bool wake = false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    Client *c = find(cli);
+    if(c!=nullptr) {
+        for(size_t i=0; i<len; i++) {
+            char ch = data[i];
+            if(dev->isRealtimeChar(ch)) { dev->sendRealtime((const uint8_t*)&ch, 1); continue; }
+            if(c->inLen<IN_BUF) c->in[c->inLen++] = ch;
+            else TB_DEBUGF("telnet: input overflow\n");
+        }
+        drain(*c, dev);
+        if(c->lineReady) {
+            cli->ackLater(); // this data is acked when device takes the held line
+            wake = !c->held;
+            c->held = true;
+        }
+    }
+    xSemaphoreGive(mutex);
+    if(wake && wakeTask!=nullptr) xTaskNotifyGive(wakeTask); // to retry the held line
+}
+
+void TelnetBridge::drain(Client &c, GCodeDevice *dev) {
+    size_t i = 0;
+    while(true) {
+        if(c.lineReady) {
+            if(dev->isInPanic()) { TB_DEBUGF("telnet: device in panic, dropping '%s'\n", c.line); }
+            else if(dev->canSchedule(c.lineLen)) dev->scheduleCommand(c.line, c.lineLen);
+            else break;
+            c.lineLen = 0;
+            c.lineReady = false;
+        }
+        if(i>=c.inLen) break;
+        char ch = c.in[i++];
+        if(ch=='\n' || ch=='\r') {
+            if(c.lineLen>0) { c.line[c.lineLen] = 0; c.lineReady = true; }
+        } else if(c.lineLen<LineRing::MAX_LINE) c.line[c.lineLen++] = ch;
+    }
+    memmove(c.in, c.in+i, c.inLen-i);
+    c.inLen -= i;
+}
+
+void TelnetBridge::deviceOutput(const char* data, size_t len) {
+    static const char crlf[] = "\r\n";
+    bool wake = false;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for(size_t k=0; k<nClients; k++) {
+        Client &c = clients[k];
+        if(c.outLen+len+2 > OUT_BUF) { TB_DEBUGF("telnet: output overflow, line dropped\n"); continue; }
+        if(c.outLen==0) { c.outSince = millis(); wake = true; }
+        for(size_t i=0; i<len+2; i++) c.out[(c.outHead+c.outLen+i) % OUT_BUF] = i<len ? data[i] : crlf[i-len];
+        c.outLen += len+2;
+        if(c.outLen>=FLUSH_THRESHOLD) wake = true;
+    }
+    xSemaphoreGive(mutex);
+    if(wake && wakeTask!=nullptr) xTaskNotifyGive(wakeTask);
+}
+
+void TelnetBridge::flush(Client &c) {
+    while(c.outLen>0) {
+        size_t n = OUT_BUF-c.outHead;
+        if(n>c.outLen) n = c.outLen;
+        size_t sent = c.cli->add((const char*)c.out+c.outHead, n);
+        c.outHead = (c.outHead+sent) % OUT_BUF;
+        c.outLen -= sent;
+        if(sent<n) break; // TCP send buffer is full, rest goes next time
+    }
+    c.cli->send();
+    c.outSince = millis();
+}
+
+uint32_t TelnetBridge::loop() {
+    if(mutex==nullptr) return IDLE;
+    GCodeDevice *dev = GCodeDevice::getDevice();
+    uint32_t now = millis();
+    uint32_t wait = IDLE;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for(size_t k=0; k<nClients; k++) {
+        Client &c = clients[k];
+        if(c.held && dev!=nullptr) {
+            drain(c, dev);
+            if(!c.lineReady) { c.cli->ack(IN_BUF*2); c.held = false; } // ack() is capped by unacked length
+        }
+        if(c.held && wait>RETRY_INTERVAL) wait = RETRY_INTERVAL;
+
+        if(c.outLen>=FLUSH_THRESHOLD || (c.outLen>0 && now-c.outSince>=FLUSH_INTERVAL) ) flush(c);
+        if(c.outLen>0) {
+            uint32_t due = now-c.outSince>=FLUSH_INTERVAL ? 1 : FLUSH_INTERVAL-(now-c.outSince);
+            if(due<wait) wait = due;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return wait;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+
+#include "devices/GCodeDevice.h"
+
+#define TB_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+
+
+/**
+ * TCP bridge to the device, for PC senders.
+ *
+ * Lines from clients are scheduled to the device queue, so they're flow-controlled by its sent-counter
+ * like lines of a job. Realtime characters (Grbl `?`, `!`, `~`, overrides...) bypass the queue at once.
+ * When the device queue is full, received data is kept and TCP acks are held back, so the client's
+ * window closes instead of data being lost.
+ *
+ * Device responses are collected in a ring per client and written to TCP in large segments.
+ *
+ * Client callbacks run in async_tcp task, deviceOutput() in device task and loop() in web server task.
+ */
+class TelnetBridge {
+public:
+
+    static const size_t MAX_CLIENTS = 4;
+    static const size_t IN_BUF = 6144;          ///< a whole TCP window may arrive after acks are held back
+    static const size_t OUT_BUF = 2048;
+    static const size_t FLUSH_THRESHOLD = 1024; ///< bytes of output to flush without waiting
+    static const uint32_t FLUSH_INTERVAL = 20;  ///< ms, output is flushed at least this often
+    static const uint32_t RETRY_INTERVAL = 5;   ///< ms, to retry held lines while device queue is full
+
+    static const uint32_t IDLE = 0xFFFFFFFF;
+
+    TelnetBridge(uint16_t port=23): server(port), mutex(nullptr), wakeTask(nullptr) {}
+
+    void begin();
+
+    void end();
+
+    /** Task running loop(), it's notified when there is output to flush */
+    void setWakeTask(TaskHandle_t t) { wakeTask = t; }
+
+    /** Queues a device response line to every client */
+    void deviceOutput(const char* data, size_t len);
+
+    /** Moves held input to device and flushes output. Returns ms till it should run again, or IDLE */
+    uint32_t loop();
+
+private:
+
+    struct Client {
+        AsyncClient *cli;
+        char line[LineRing::MAX_LINE+1];
+        size_t lineLen;
+        bool lineReady;   ///< complete line waiting for space in device queue
+        bool held;        ///< TCP acks are held back
+        uint8_t *in;      ///< received, not parsed yet
+        size_t inLen;
+        uint8_t *out;     ///< ring of output
+        size_t outHead, outLen;
+        uint32_t outSince;
+    };
+
+    AsyncServer server;
+    SemaphoreHandle_t mutex;
+    TaskHandle_t wakeTask;
+
+    Client clients[MAX_CLIENTS];
+    size_t nClients = 0;
+
+    void onClient(AsyncClient *cli);
+    void onData(AsyncClient *cli, const uint8_t *data, size_t len);
+    void onDisconnect(AsyncClient *cli);
+
+    Client* find(AsyncClient *cli);
+
+    /** Schedules complete lines from input while device accepts them */
+    void drain(Client &c, GCodeDevice *dev);
+
+    void flush(Client &c);
+
+};
@@ -0,0 +1,157 @@
+#include "UploadWriter.h"
+
+#include <rom/crc.h>
+
+
+void UploadWriter::begin() {
+    if(task!=nullptr) return;
+    const MemoryBudget &mb = MemoryPool::budget();
+    nBlocks = mb.uploadBlocks;
+    blockSize = mb.uploadBlock < 32768 ? mb.uploadBlock : 32768; // Block::len is 16 bit
+    blocks = (uint8_t*)MemoryPool::alloc(nBlocks*blockSize);
+    freeQueue = xQueueCreate(nBlocks, sizeof(uint8_t));
+    fullQueue = xQueueCreate(nBlocks+2, sizeof(Block)); // blocks, open and close: sending never waits
+    done = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(taskFunc, "UploadWriter",
+        4096, this, 1, &task, 0); // cpu0, SD writes themselves wait for SDScheduler
+}
+
+bool UploadWriter::open(const String &p, bool buildCache) {
+    assert(task!=nullptr);
+    if(!isClosed() || blocks==nullptr) return false;
+
+    path = p;
+    this->buildCache = buildCache;
+    failed = false;
+    size = 0;
+    crc = 0;
+    cached = false;
+    written = false;
+    cacheWriter = nullptr;
+
+    // the writer is idle, its queues can be reset
+    xQueueReset(freeQueue);
+    xQueueReset(fullQueue);
+    for(uint8_t i=0; i<nBlocks; i++) xQueueSend(freeQueue, &i, 0);
+    fillIdx = -1;
+    fillLen = 0;
+    state = OPEN;
+    return send(OPEN_FILE);
+}
+
+size_t UploadWriter::freeSpace() const {
+    if(state!=OPEN) return 0;
+    return uxQueueMessagesWaiting(freeQueue)*blockSize + (fillIdx<0 ? 0 : blockSize-fillLen);
+}
+
+bool UploadWriter::write(const uint8_t* data, size_t len) {
+    if(!isOpen()) return false;
+    while(len>0) {
+        if(fillIdx<0) {
+            uint8_t idx;
+            if(xQueueReceive(freeQueue, &idx, pdMS_TO_TICKS(WRITE_TIMEOUT)) != pdTRUE || failed) {
+                UW_DEBUGF("UploadWriter: %s, aborting\n", failed ? "write failed" : "timeout");
+                abort();
+                return false;
+            }
+            fillIdx = idx;
+            fillLen = 0;
+        }
+        size_t room = blockSize-fillLen;
+        size_t n = len<room ? len : room;
+        memcpy(blocks + fillIdx*blockSize + fillLen, data, n);
+        fillLen += n; data += n; len -= n;
+        if(fillLen==blockSize) send(DATA);
+    }
+    return true;
+}
+
+bool UploadWriter::send(uint8_t op) {
+    Block b{ uint8_t(fillIdx<0 ? 0 : fillIdx), op, uint16_t(fillIdx<0 ? 0 : fillLen) };
+    fillIdx = -1;
+    fillLen = 0;
+    // never waits: the queue holds every block, an open and a close
+    return xQueueSend(fullQueue, &b, 0) == pdTRUE;
+}
+
+bool UploadWriter::finish() {
+    if(!isOpen()) return false;
+    if(fillIdx>=0 && fillLen>0) send(DATA);
+    state = CLOSING;
+    return send(FINISH);
+}
+
+void UploadWriter::abort() {
+    if(!isOpen()) return;
+    state = CLOSING;
+    send(ABORT);
+}
+
+bool UploadWriter::isClosed() {
+    if(state==CLOSING && xSemaphoreTake(done, 0)==pdTRUE) state = CLOSED;
+    return state==CLOSED;
+}
+
+void UploadWriter::openFile() {
+    {
+        SDScheduler::BusLock bus;
+        if(SD.exists(path)) SD.remove(path);
+        JobCache::remove(path);
+        file = SD.open(path, "w");
+        if(file && buildCache) {
+            cacheWriter = new JobCacheWriter();
+            if(!cacheWriter->begin(path, 0, 0)) { delete cacheWriter; cacheWriter = nullptr; } // header is patched in close()
+        }
+    }
+    DirIndex::invalidate(path);
+    if(!file) failed = true;
+}
+
+void UploadWriter::writeBlock(const Block &b) {
+    if(failed) return;
+    const uint8_t *data = blocks + b.idx*blockSize;
+    SDScheduler::run(SDScheduler::BULK, [&]() {
+        if(file.write(data, b.len) != b.len) { failed = true; return; }
+        if(cacheWriter!=nullptr) cacheWriter->feed(data, b.len);
+    });
+    if(failed) return;
+    size += b.len;
+    crc = crc32_le(crc, data, b.len);
+}
+
+void UploadWriter::close(bool ok) {
+    SDScheduler::run(SDScheduler::BULK, [&]() {
+        file.close();
+        if(cacheWriter==nullptr) return;
+        if(ok && !failed) {
+            // cache is checked against size and time of the source, known only now
+            File src = SD.open(path);
+            cached = src && cacheWriter->finish(src.size(), src.getLastWrite() );
+            if(src) src.close();
+        } else cacheWriter->abort();
+    });
+    if(cacheWriter!=nullptr) {
+        delete cacheWriter;
+        cacheWriter = nullptr;
+    }
+    written = ok && !failed;
+    DirIndex::invalidate(path); // size has changed
+    UW_DEBUGF("UploadWriter: %s %s, %d bytes, crc %08x, cached %d\n", path.c_str(), ok && !failed ? "written" : "aborted", size, crc, cached);
+}
+
+void UploadWriter::taskFunc(void* arg) {
+    UploadWriter *w = static_cast<UploadWriter*>(arg);
+    Block b;
+    while(1) {
+        if(xQueueReceive(w->fullQueue, &b, portMAX_DELAY) != pdTRUE) continue;
+        if(b.op==OPEN_FILE) {
+            w->openFile();
+        } else if(b.op==DATA) {
+            w->writeBlock(b);
+            xQueueSend(w->freeQueue, &b.idx, 0);
+        } else {
+            w->close(b.op==FINISH);
+            xSemaphoreGive(w->done);
+        }
+    }
+}
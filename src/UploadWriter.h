@@ -0,0 +1,125 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SD.h>
+#include <atomic>
+
+#include "JobCache.h"
+#include "SDScheduler.h"
+#include "DirIndex.h"
+#include "MemoryPool.h"
+
+#define UW_DEBUGF(...) // { Serial.printf(__VA_ARGS__); }
+
+
+/**
+ * Write-behind buffer for files uploaded over network.
+ *
+ * Network callback copies data into a ring of blocks; full blocks are written to SD
+ * in whole pieces (a multiple of SD sector) by a separate task (pinned to cpu0),
+ * at bulk SDScheduler priority.
+ * Producer is the network task, nothing here makes it wait for SD: opening, closing and building
+ * the cache are done by the writer task as well, `finish()` and `abort()` only queue them.
+ * The producer should take no more than `freeSpace()`, e.g. by closing TCP window; if every block
+ * is still waiting for SD, `write()` waits for one at most WRITE_TIMEOUT.
+ *
+ * While they stream in, the writer also computes CRC32 of data and optionally builds job cache.
+ *
+ * Number and size of blocks come from MemoryBudget; the ring is taken from MemoryPool in `begin()` and kept.
+ *
+ * Only one producer task is allowed; `open()`, `write()`, `finish()`, `abort()` and `isClosed()` must be called from it.
+ */
+class UploadWriter {
+public:
+
+    static const uint32_t WRITE_TIMEOUT = 1000; ///< ms, to wait for a free block; well below the 5 s watchdog of async_tcp
+
+    UploadWriter(): task(nullptr), blocks(nullptr), state(CLOSED) {}
+
+    /** Creates writer task and block ring. Should be called once, after MemoryPool::begin(), before any file is opened. */
+    void begin();
+
+    /**
+     * Replaces or creates the file, in the writer task. If buildCache is set, job cache is built for it as well.
+     * False if the last file isn't closed yet. A file that can't be created fails the first `write()`.
+     */
+    bool open(const String &path, bool buildCache);
+
+    bool isOpen() const { return state==OPEN; }
+
+    /** Bytes `write()` takes without waiting */
+    size_t freeSpace() const;
+
+    /** Bytes of the whole ring */
+    size_t capacity() const { return blocks==nullptr ? 0 : nBlocks*blockSize; }
+
+    /** Returns false if data could not be buffered or SD write failed; the upload is aborted then. */
+    bool write(const uint8_t* data, size_t len);
+
+    /** Queues what's left and closing of file; `isClosed()` tells when it's done. */
+    bool finish();
+
+    /** Queues closing of file, the cache is dropped */
+    void abort();
+
+    /** True once the writer has closed the last file; results below are valid then */
+    bool isClosed();
+
+    /** True if the last file was finished and written whole */
+    bool isWritten() const { return written; }
+
+    size_t getSize() const { return size; }
+
+    uint32_t getCrc() const { return crc; }
+
+    /** True if job cache was built for the last finished file */
+    bool isCached() const { return cached; }
+
+private:
+
+    struct Block {
+        uint8_t idx;
+        uint8_t op;
+        uint16_t len;
+    };
+
+    enum Op { OPEN_FILE, DATA, FINISH, ABORT };
+
+    enum State { CLOSED, OPEN, CLOSING };
+
+    TaskHandle_t task;
+    QueueHandle_t freeQueue;   ///< indices of blocks free to fill
+    QueueHandle_t fullQueue;   ///< blocks and ops for the writer task
+    SemaphoreHandle_t done;    ///< given by the writer on finish or abort
+
+    uint8_t *blocks;
+    size_t nBlocks;
+    size_t blockSize;
+    State state;
+
+    // producer side
+    int fillIdx;
+    size_t fillLen;
+
+    // writer side
+    String path;
+    bool buildCache;
+    File file;
+    JobCacheWriter *cacheWriter;
+    std::atomic<bool> failed;
+    size_t size;
+    uint32_t crc;
+    bool cached;
+    bool written;
+
+    bool send(uint8_t op);
+
+    void openFile();
+
+    void writeBlock(const Block &b);
+
+    void close(bool ok);
+
+    static void taskFunc(void* arg);
+
+};
@@ -1,7 +1,5 @@
 #include "GCodeDevice.h"
-
-#define XOFF  0x13
-#define XON   0x11
+#include "../MotionEstimator.h"
 
 #define MAX(a,b)  ( (a)>(b) ? (a) : (b) )
 static char deviceBuffer[MAX(sizeof(MarlinDevice), sizeof(GrblDevice))];
@@ -13,102 +11,100 @@ uint32_t DeviceDetector::serialBaud = 0;
 void DeviceDetector::sendProbe(uint8_t i, Stream &serial) {
     switch(i) {
         case 0: 
-            serial.print("\n$I\n");
+            serial.print("$I\n");
             break;
         case 1:
-            serial.print("\nM115\n");
+            serial.print("M115\n");
             break;
     }
 }
 
-GCodeDevice* DeviceDetector::checkProbe(uint8_t i, String v, Stream &serial) {
-    if(i==0) {
-        if(v.indexOf("[VER:")!=-1 ) {
-            GD_DEBUGS("Detected GRBL device");
-            //devices.grbl = GrblDevice(&serial);
-            return new (deviceBuffer) GrblDevice(&serial);
-            //return (GCodeDevice*)deviceBuffer;
-        }
-    }
-    if(i==1) {
-        if(v.indexOf("MACHINE_TYPE") != -1) {
-            GD_DEBUGS("Detected Marlin device");
-            //devices.marlin = MarlinDevice(&serial);
-            return new (deviceBuffer) MarlinDevice(&serial);
-            //return (GCodeDevice*)deviceBuffer;
-        }
-    }
+int DeviceDetector::checkProbe(const char* line) {
+    if(strstr(line, "[VER:")!=nullptr) return 0;
+    // MACHINE_TYPE may be past the end of a long FIRMWARE_NAME line
+    if(strstr(line, "FIRMWARE_NAME:")!=nullptr || strstr(line, "MACHINE_TYPE")!=nullptr) return 1;
+    return -1;
+}
 
-    return nullptr;
+GCodeDevice* DeviceDetector::create(int type, Stream &serial) {
+    if(type==0) {
+        GD_DEBUGS("Detected GRBL device");
+        return new (deviceBuffer) GrblDevice(&serial);
+    }
+    GD_DEBUGS("Detected Marlin device");
+    return new (deviceBuffer) MarlinDevice(&serial);
+}
 
-    //return false;
+void DeviceDetector::drain(Stream &serial) {
+    uint32_t last = millis();
+    while(millis()-last < QUIET_TIME) {
+        if(serial.available()>0) { serial.read(); last = millis(); }
+        else vTaskDelay(1);
+    }
 }
 
-GCodeDevice* DeviceDetector::detectPrinterAttempt(HardwareSerial &printerSerial, uint32_t speed, uint8_t type) {
+int DeviceDetector::probe(HardwareSerial &printerSerial, uint32_t speed, uint8_t typeMask) {
+    GD_DEBUGF("probing speed %d, types %x\n", speed, typeMask);
     serialBaud = speed;
-    for(uint8_t retry=0; retry<2; retry++) {
-        GD_DEBUGF("attempt %d, speed %d, type %d\n", retry, speed, type);
-        //PrinterSerial.end();
-        //PrinterSerial.begin(speed);
-        printerSerial.updateBaudRate(speed);
-        while(printerSerial.available()) printerSerial.read();
-        DeviceDetector::sendProbe(type, printerSerial);
-        //String v = readStringUntil(printerSerial, '\n', 1000); v.trim();
-        String v = readString(printerSerial, 1000);
-        GD_DEBUGF("Got response '%s'\n", v.c_str() );
-        if(v) {
-            //int t = v.indexOf('\n');
-            GCodeDevice * dev = DeviceDetector::checkProbe(type, v, printerSerial);
-            if(dev!=nullptr) return dev;
-        }
+    printerSerial.updateBaudRate(speed);
+    while(printerSerial.available()) printerSerial.read();
+    printerSerial.print("\n");
+    for(uint8_t t=0; t<N_TYPES; t++) if(typeMask & (1<<t)) sendProbe(t, printerSerial);
+
+    char line[200];
+    size_t len = 0;
+    size_t garbage = 0;
+    uint32_t start = millis();
+    while(millis()-start < PROBE_TIMEOUT) {
+        if(printerSerial.available()==0) { vTaskDelay(1); continue; }
+        uint8_t c = printerSerial.read();
+        if(c=='\n' || c=='\r') {
+            line[len] = 0;
+            int type = len>0 ? checkProbe(line) : -1;
+            if(len>0) GD_DEBUGF("Got response '%s'\n", line);
+            len = 0;
+            if(type>=0) {
+                drain(printerSerial); // replies to the other probe
+                return type;
+            }
+        } else if( (c<0x20 && c!='\t') || c>=0x7F ) {
+            if(++garbage > MAX_GARBAGE) { GD_DEBUGS("garbage received, wrong baud"); return -1; }
+        } else if(len<sizeof(line)-1) line[len++] = c;
     }
-    return nullptr;
+    return -1;
 }
 
 
 GCodeDevice* DeviceDetector::detectPrinter(HardwareSerial &printerSerial) {
-    while(true) {
+    Preferences prefs;
+    prefs.begin(PREFS_NAMESPACE, true);
+    uint32_t lastBaud = prefs.getUInt("baud", 0);
+    uint8_t lastType = prefs.getUChar("type", N_TYPES);
+    prefs.end();
+
+    int type = -1;
+    if(lastBaud!=0 && lastType<N_TYPES) type = probe(printerSerial, lastBaud, 1<<lastType);
+    while(type<0) {
+        // last baud goes first in every round, device may still be booting
+        if(lastBaud!=0) type = probe(printerSerial, lastBaud, ALL_TYPES);
         for(uint32_t speed: serialBauds) {
-            for(int type=0; type<DeviceDetector::N_TYPES; type++) {
-                GCodeDevice *dev = detectPrinterAttempt(printerSerial, speed, type);
-                if(dev!=nullptr) return dev;
-            }
+            if(type>=0) break;
+            if(speed!=lastBaud) type = probe(printerSerial, speed, ALL_TYPES);
         }
-    }    
-    
-}
-
-String readStringUntil(Stream &serial, char terminator, size_t timeout) {
-    String ret;
-    timeout += millis();
-    char c;
-    int len = serial.readBytes(&c, 1);
-    while(len>0 && c != terminator && millis()<timeout) {
-        ret += (char) c;
-        len = serial.readBytes(&c, 1);
     }
-    return ret;
-}
 
-String readString(Stream &serial, size_t timeout, size_t earlyTimeout) {
-    String ret; ret.reserve(40);
-    timeout += millis();
-    earlyTimeout += millis();
-    while(millis()<timeout) {
-        if(serial.available()>0) {
-            ret += (char)serial.read();
-        }
-        if(millis()>earlyTimeout && ret.length()>0 ) break; // break early if something was read at all
+    if(serialBaud!=lastBaud || type!=lastType) {
+        prefs.begin(PREFS_NAMESPACE, false);
+        prefs.putUInt("baud", serialBaud);
+        prefs.putUChar("type", type);
+        prefs.end();
     }
-    return ret;
+    return create(type, printerSerial);
 }
 
 
 
 
-
-
-
 GCodeDevice *GCodeDevice::inst = nullptr;
 
 GCodeDevice *GCodeDevice::getDevice() {
@@ -121,83 +117,74 @@ void GCodeDevice::setDevice(GCodeDevice *dev) {
 */
 
 
-void GCodeDevice::sendCommands() {
-
-    if(panic) return;
-    //bool loadedNewCmd=false;
-
-    if(xoffEnabled && xoff) return;
-
+void GCodeDevice::frameLine(const char* cmd, size_t len, LineFrame &f) {
     #ifdef ADD_LINECOMMENTS
-    static size_t nline=0;
+        f.suffixLen = snprintf(f.suffix, sizeof(f.suffix), " ;%d", sentLines);
     #endif
-
-    if(curUnsentPriorityCmdLen == 0) {
-        #ifdef ADD_LINECOMMENTS
-            char tmp[MAX_GCODE_LINE+1];
-            curUnsentPriorityCmdLen = xMessageBufferReceive(buf0, tmp, MAX_GCODE_LINE, 0);
-            if(curUnsentPriorityCmdLen!=0) {
-                tmp[curUnsentPriorityCmdLen] = 0;
-                snprintf(curUnsentPriorityCmd, MAX_GCODE_LINE, "%s ;%d", tmp, nline++);
-                curUnsentPriorityCmdLen = strlen(curUnsentPriorityCmd);
-            }
-        #else
-            curUnsentPriorityCmdLen = xMessageBufferReceive(buf0, curUnsentPriorityCmd, MAX_GCODE_LINE, 0);
-            curUnsentPriorityCmd[curUnsentPriorityCmdLen]=0;
-        #endif
-    }
-
-    if(curUnsentPriorityCmdLen==0 && curUnsentCmdLen==0) {
-        #ifdef ADD_LINECOMMENTS
-            char tmp[MAX_GCODE_LINE+1];
-            curUnsentCmdLen = xMessageBufferReceive(buf1, tmp, MAX_GCODE_LINE, 0);
-            if(curUnsentCmdLen!=0) {
-                tmp[curUnsentCmdLen] = 0;
-                snprintf(curUnsentCmd, MAX_GCODE_LINE, "%s ;%d", tmp, nline++);
-                curUnsentCmdLen = strlen(curUnsentCmd);
-            }
-        #else
-            curUnsentCmdLen = xMessageBufferReceive(buf1, curUnsentCmd, MAX_GCODE_LINE, 0);
-            curUnsentCmd[curUnsentCmdLen] = 0; 
-        #endif
-        //loadedNewCmd = true;
-    }
-
-    if(curUnsentCmdLen==0 && curUnsentPriorityCmdLen==0) return;
-
-    trySendCommand();
-
 }
 
 
-void GCodeDevice::receiveResponses() {
+void GCodeDevice::fillSnapshot(DeviceSnapshot &s) {
+    s.type = typeStr.length()>0 ? typeStr.charAt(0) : '?';
+    s.connected = connected;
+    s.panic = panic;
+    s.canJog = canJog();
+    s.x = x; s.y = y; s.z = z;
+    s.sentQueue = getSentQueueLength();
+    s.queue = getQueueLength();
+}
 
+uint32_t GCodeDevice::getStatusInterval(uint32_t now) {
+    uint32_t interval = 0;
+    bool jogging = false;
+    for(int w=0; w<N_WATCHERS; w++) {
+        uint32_t wi = watchInterval[w], until = watchUntil[w];
+        if(wi==0) continue;
+        if(until!=0 && (int32_t)(until-now) <= 0) continue; // expired
+        if(interval==0 || wi<interval) interval = wi;
+        if(w==WATCH_JOG) jogging = true;
+    }
+    if(interval==0) return 0;
+    // status requests would only slow down a job, unless somebody is jogging
+    if(buf1.getUnsentLines()>0 && !jogging && interval<STREAMING_STATUS_INTERVAL) 
+        interval = STREAMING_STATUS_INTERVAL;
+    return interval<minStatusInterval ? minStatusInterval : interval;
+}
 
-    static const size_t MAX_LINE = 200; // M115 is far longer than 100
-    static char resp[MAX_LINE+1];
-    static size_t respLen;
+void GCodeDevice::pollStatus() {
+    uint32_t now = millis();
+    uint32_t interval = getStatusInterval(now);
+    if(interval==0) { nextStatusRequestTime = 0; return; }
 
-    while (printerSerial->available()) {
-        char ch = (char)printerSerial->read();
-        switch(ch) {
-            case '\n':
-            case '\r': break;
-            case XOFF: if(xoffEnabled) { xoff=true; break; }
-            case XON: if(xoffEnabled) {xoff=false; break; }
-            default: if(respLen<MAX_LINE) resp[respLen++] = ch;
-        }
-        if(ch=='\n') {
-            resp[respLen]=0;
-            for(const auto &r: receivedLineHandlers) if(r) r(resp, respLen);
-            tryParseResponse(resp, respLen);
-            respLen = 0;
-        }
+    if(statusRequestPending && now-lastStatusRequestTime < STATUS_REQUEST_TIMEOUT) {
+        nextStatusRequestTime = 0; // woken up by the response
+        return;
     }
-    
+    if(now-lastStatusRequestTime >= interval) {
+        statusRequestPending = true;
+        lastStatusRequestTime = now;
+        requestStatusUpdate();
+    }
+    nextStatusRequestTime = lastStatusRequestTime + interval;
+    if(nextStatusRequestTime==0) nextStatusRequestTime = 1;
 }
 
+void GCodeDevice::waitForEvent() {
+    if(printerSerial->available()>0) return;
 
+    // HardwareSerial has no RX notification, so poll it often while a response is expected
+    // and rarely when idle. Scheduled commands wake the task immediately.
+    uint32_t timeout = sentCounter->size()>0 ? RX_POLL_INTERVAL : IDLE_RX_POLL_INTERVAL;
+    if(nextStatusRequestTime!=0) {
+        uint32_t now = millis();
+        uint32_t untilStatus = nextStatusRequestTime>now ? nextStatusRequestTime-now : 0;
+        if(untilStatus<timeout) timeout = untilStatus;
+    }
+    if(timeout==0) return;
 
+    TickType_t ticks = pdMS_TO_TICKS(timeout);
+    ulTaskNotifyTake(pdTRUE, ticks>0 ? ticks : 1);
+}
 
 
 #define TEMP_COMMAND      "M105"
@@ -209,65 +196,166 @@ bool startsWith(const char *str, const char *pre) {
     return strncmp(pre, str, strlen(pre)) == 0;
 }
 
+bool MarlinDevice::lineNumbers = false;
+
+void MarlinDevice::config(JsonObjectConst cfg) {
+    if(cfg.containsKey("lineNumbers")) lineNumbers = cfg["lineNumbers"].as<bool>();
+}
+
+void MarlinDevice::fillSnapshot(DeviceSnapshot &s) {
+    GCodeDevice::fillSnapshot(s);
+    strncpy(s.lastResponse, lastResponse.c_str(), sizeof(s.lastResponse)-1);
+    s.toolTemp = toolTemperatures[0].actual;
+    s.toolTarget = toolTemperatures[0].target;
+    s.bedTemp = bedTemperature.actual;
+    s.bedTarget = bedTemperature.target;
+    s.overrides[OV_FEED] = ovPercent[0];
+    s.overrides[OV_FLOW] = ovPercent[1];
+}
+
+void MarlinDevice::requestStatusUpdate() {
+    if(!autoreportTempEnabled) schedulePriorityCommand(TEMP_COMMAND);
+    schedulePriorityCommand("M114");
+}
+
 void MarlinDevice::trySendCommand() {
-    char* cmd  = curUnsentPriorityCmdLen!=0 ? &curUnsentPriorityCmd[0] :  &curUnsentCmd[0]; 
-    size_t * len = curUnsentPriorityCmdLen!=0 ? &curUnsentPriorityCmdLen : &curUnsentCmdLen ;
+    if( sendLine() ) armRxTimeout();
+}
+
+void MarlinDevice::sendCommands() {
+    if(!isResending()) { StreamEngine::sendCommands(); return; }
+    if(panic || (xoffEnabled && xoff) ) return;
+
+    // replayed lines go before anything new, and keep their numbers
+    const char* line;
+    size_t len = history.get(resendN, line);
+    if(len==0) { startResend(resendN); return; } // lost meanwhile, fails
+    if( writeLine(line, len, nullptr) ) armRxTimeout();
+}
+
+bool MarlinDevice::adjustOverride(DeviceOverride o, int delta) {
+    int i = overrideSlot(o);
+    if(i<0) return false;
+    int p = ovPercent[i] + delta;
+    if(p<MIN_OVERRIDE) p = MIN_OVERRIDE;
+    if(p>MAX_OVERRIDE) p = MAX_OVERRIDE;
+    ovPercent[i] = p;
+    ovPending[i] = p;
+    wakeUp();
+    return true;
+}
 
-    if( sentCounter->canPush(*len) ) {
-        sentCounter->push( cmd, *len );
-        printerSerial->write(cmd, *len);  
-        printerSerial->print('\n');
+void MarlinDevice::writeRealtime() {
+    StreamEngine::writeRealtime();
+    if(panic || isResending() || (xoffEnabled && xoff) ) return;
+    for(int i=0; i<2; i++) {
+        int p = ovPending[i];
+        if(p<0) continue;
+        // a line still in flight from this slot is only matched by its command, which stays the same
+        size_t len = snprintf(ovCmd[i], sizeof(ovCmd[i]), "%s S%d", i==0 ? "M220" : "M221", p);
+        if( !writeLine(ovCmd[i], len, nullptr) ) return; // window is full, next iteration
+        ovPending[i].compare_exchange_strong(p, -1); // keep a value set meanwhile
         armRxTimeout();
-        GD_DEBUGF("<  (f%3d,%3d) '%s' (%d)\n", sentCounter->getFreeLines(), sentCounter->getFreeBytes(), cmd, *len );
-        *len = 0;
-    } else {
-        //if(loadedNewCmd) GD_DEBUGF("<  Not sent, free lines: %d, free space: %d\n", sentQueue.getFreeLines() , sentQueue.getFreeBytes()  );
+        post(DEV_STATUS);
+    }
+}
+
+void MarlinDevice::frameLine(const char* cmd, size_t len, LineFrame &f) {
+    if(!history.isValid()) { GCodeDevice::frameLine(cmd, len, f); return; }
+    
+    uint32_t n = isResending() ? resendN : nextLineN;
+    f.prefixLen = snprintf(f.prefix, sizeof(f.prefix), "N%u ", n);
+    uint8_t checksum = 0;
+    for(size_t i=0; i<f.prefixLen; i++) checksum ^= f.prefix[i];
+    for(size_t i=0; i<len; i++) checksum ^= cmd[i];
+    f.suffixLen = snprintf(f.suffix, sizeof(f.suffix), "*%u", checksum);
+}
+
+void MarlinDevice::lineSent(const char* cmd, size_t len) {
+    GCodeDevice::lineSent(cmd, len);
+    if(!history.isValid()) return;
+    if(isResending()) { resendN++; return; }
+    history.store(nextLineN, cmd, len);
+    resendN = ++nextLineN;
+}
+
+void MarlinDevice::startResend(uint32_t n) {
+    const char* line;
+    if(n >= nextLineN || history.get(n, line)==0) {
+        GD_DEBUGF("Resend of line %d failed\n", n);
+        lastResponse = "Resend failed";
+        cleanupQueue();
+        resendN = nextLineN;
+        panic = true;
+        post(DEV_ERROR); 
+        return;
     }
+    // each line sent after the bad one is rejected with its own Resend request for the same line
+    ignoreResends = resendN>n ? resendN-n-1 : 0;
+    resendN = n;
+    GD_DEBUGF("Resending from line %d, ignoring %d requests\n", n, ignoreResends);
+    wakeUp();
 }
 
 void MarlinDevice::tryParseResponse( char* resp, size_t len ) {
 
-    char tmp = 0;
-    char* curCmd;
+    const char* curCmd;
     size_t curCmdLen = sentQueue.peek(curCmd);
-    if(curCmdLen==0) curCmd = &tmp;
+    if(curCmdLen==0) curCmd = "";
 
     //GD_DEBUGF(" > '%s'; current cmd %s\n", resp, curCmd );
 
     if ( startsWith(resp, "ok") ) {
 
         if (startsWith(curCmd, TEMP_COMMAND))
-            parseTemperatures(String(resp) );
+            parseTemperatures(resp);
         else if (fwAutoreportTempCap && startsWith(curCmd, AUTOTEMP_COMMAND))
             autoreportTempEnabled = (curCmd[6] != '0');
+        else if(jogLines>0 && startsWith(curCmd, "G0 F")) {
+            jogLines--; // relative jog, position comes from M114
+        }
         else if(startsWith(curCmd, "G0") || startsWith(curCmd, "G1")) {
             parseG0G1(curCmd); // artificial position from G0/G1 command
         }
+        else if(startsWith(curCmd, "M114")) statusReceived();
+        else if(startsWith(curCmd, "M115") && fwAutoreportTempCap) 
+            schedulePriorityCommand(AUTOTEMP_COMMAND "1"); // temperatures are sent every second then
         
         //sentQueue.markAcknowledged();     // Go on with next command
         sentQueue.pop();
+
+        if(fwAdvancedOkCap) parseAdvancedOk(resp);
         
         //curCmdLen = 0; // need to fetch another sent command from queue
 
         connected = true;
     } else {
-        if (connected) {
-            if(startsWith(curCmd,"M115") ) {
-                parseM115(String(resp) ); 
-            } else if (parseTemperatures(String(resp) ) ) {
+        if(startsWith(curCmd,"M115") ) {
+            parseM115(resp); // M115 is the first command sent, its response comes before any ok
+        } else if (connected) {
+            if (parseTemperatures(resp) ) {
                 // do nothing
                 //sprintf(responseDetail, "autotemp");
             } else if (parsePosition(resp) ) {
                 // do nothing
                 //sprintf(responseDetail, "position");
-            /*} else if (startsWith(resp, "Resend: ")) {
-                nline = (int)extractFloat(resp, "Resend:");
-                sprintf(responseDetail, "sync line=%d", nline);
-            }*/
+            } else if (startsWith(curCmd, "M503") && parseSettings(resp) ) {
+                // do nothing
+            } else if (startsWith(resp, "Resend:")) {
+                if(!history.isValid()) {
+                    lastResponse = resp;
+                } else if(ignoreResends>0) {
+                    ignoreResends--;
+                } else {
+                    startResend( atol(resp+7) );
+                }
             } else if (startsWith(resp, "echo: cold extrusion prevented")) {
                 // To do: Pause sending gcode, or do something similar
                 lastResponse = "cold extrusion prevented";
-                notify_observers(DeviceStatusEvent{1}); 
+                post(DEV_ERROR); 
+            }
+            else if (startsWith(resp, "Error:") && history.isValid() && strstr(resp, "Last Line")!=nullptr ) {
+                // line number or checksum error, Resend: follows
             }
             else if (startsWith(resp, "Error:") ) {
                 lastResponse = resp;
@@ -276,7 +364,7 @@ void MarlinDevice::tryParseResponse( char* resp, size_t len ) {
                 panic = true;
 
                 
-                notify_observers(DeviceStatusEvent{1}); 
+                post(DEV_ERROR); 
             } else {
                 //incompleteResponse = true;
             }
@@ -298,68 +386,90 @@ void MarlinDevice::tryParseResponse( char* resp, size_t len ) {
 
 // Parse temperatures from printer responses like
 // ok T:32.8 /0.0 B:31.8 /0.0 T0:32.8 /0.0 @:0 B@:0
-bool MarlinDevice::parseTemperatures(const String &response) {
-    bool ret;
-
-    if (fwExtruders == 1)
-        ret = parseTemp(response, "T", &toolTemperatures[0]);
-    else {
-        ret = false;
-        for (int t = 0; t < fwExtruders; t++)
-            ret |= parseTemp(response, "T" + String(t), &toolTemperatures[t]);
+// or from prusa firmare (sent when heating)
+// ok T:32.8 E:0 B:31.8
+bool MarlinDevice::parseTemperatures(const char *response) {
+    Temperature tools[MAX_SUPPORTED_EXTRUDERS];
+    Temperature bed;
+    uint8_t toolsFound = 0; // bit mask
+    bool bedFound = false;
+    float heatingTool = NAN, heatingBed = NAN; 
+    int heatingExtruder = -1;
+
+    const char *p = response, *key, *val;
+    size_t keyLen;
+    while( nextKeyValue(p, key, keyLen, val) ) {
+        char *end;
+        float actual = strtof(val, &end);
+        if(end==val) continue;
+        while(*end==' ') end++;
+        bool hasTarget = *end=='/';
+        float target = hasTarget ? strtof(end+1, nullptr) : NAN;
+
+        if(key[0]=='T' && keyLen<=2) {
+            int t = keyLen==1 ? -1 : key[1]-'0';
+            if(t==-1) heatingTool = actual;
+            if(!hasTarget) continue;
+            if(fwExtruders==1 && t==-1) t = 0; 
+            else if(fwExtruders==1 || t<0) continue; // with several extruders, plain T is the active one
+            if(t >= fwExtruders) continue; // fwExtruders is never above MAX_SUPPORTED_EXTRUDERS
+            tools[t] = Temperature{actual, target};
+            toolsFound |= 1<<t;
+        } else if(keyLen==1 && key[0]=='B') {
+            heatingBed = actual;
+            if(!hasTarget) continue;
+            bed = Temperature{actual, target};
+            bedFound = true;
+        } else if(keyLen==1 && key[0]=='E') {
+            heatingExtruder = (int)actual;
+        }
     }
-    ret |= parseTemp(response, "B", &bedTemperature);
-    if (!ret) {
-        // Parse Prusa heating temperatures
-        int e = extractPrusaHeatingExtruder(response);
-        ret = e >= 0 && e < MAX_SUPPORTED_EXTRUDERS && extractPrusaHeatingTemp(response, "T", toolTemperatures[e].actual);
-        ret |= extractPrusaHeatingTemp(response, "B", bedTemperature.actual);
+
+    bool ret = toolsFound!=0 || bedFound;
+    if(ret) {
+        for(int t=0; t<MAX_SUPPORTED_EXTRUDERS; t++) if(toolsFound & (1<<t) ) toolTemperatures[t] = tools[t];
+        if(bedFound) bedTemperature = bed;
+    } else {
+        if( heatingExtruder>=0 && heatingExtruder<MAX_SUPPORTED_EXTRUDERS && !isnan(heatingTool) ) {
+            toolTemperatures[heatingExtruder].actual = heatingTool;
+            ret = true;
+        }
+        if( !isnan(heatingBed) ) { bedTemperature.actual = heatingBed; ret = true; }
     }
 
-    if(ret) GD_DEBUGF("Parsed temp E:%d->%d  B:%d->%d\n", 
+    if(!ret) return false;
+
+    GD_DEBUGF("Parsed temp E:%d->%d  B:%d->%d\n", 
         (int)toolTemperatures[0].actual, (int)toolTemperatures[0].target,  
         (int)bedTemperature.actual, (int)bedTemperature.target );
 
-    notify_observers(DeviceStatusEvent{0});
-
-    return ret;
-}
-
-// parses line T:aaa.aa /ttt.tt
-bool MarlinDevice::parseTemp(const String &response, const String whichTemp, Temperature *temperature) {
-    int tpos = response.indexOf(whichTemp + ":");
-    if (tpos != -1) { // This response contains a temperature
-        int slashpos = response.indexOf(" /", tpos);
-        int spacepos = response.indexOf(" ", slashpos + 1);
-        // if match mask T:xxx.xx /xxx.xx
-        if (slashpos != -1 && spacepos != -1) {
-            String actual = response.substring(tpos + whichTemp.length() + 1, slashpos);
-            String target = response.substring(slashpos + 2, spacepos);
-            if (isFloat(actual) && isFloat(target)) {
-                temperature->actual = actual.toFloat();
-                temperature->target = target.toFloat();
-
-                return true;
-            }
-        }
-    }
+    post(DEV_TEMPERATURE);
 
-    return false;
+    return true;
 }
 
 // Parse position responses from printer like
 // X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000
 bool MarlinDevice::parsePosition(const char * str) {
-    float t = extractFloat(str, "X:");
-    if(!isnan(t) ) x = t; else return false;
-    t = extractFloat(str, "Y:");
-    if(!isnan(t) ) y = t; else return false;
-    t = extractFloat(str, "Z:");
-    if(!isnan(t) ) z = t; else return false;
-    t = extractFloat(str, "E:");
-    if(!isnan(t) ) ePos = t; else return false;
+    float pos[4];
+    uint8_t found = 0;
+    const char *p = str, *key, *val;
+    size_t keyLen;
+    while( nextKeyValue(p, key, keyLen, val) ) {
+        if(keyLen!=1) continue;
+        const char* axis = strchr("XYZE", key[0]);
+        if(axis==nullptr || *axis==0) continue;
+        int i = axis-"XYZE";
+        if(found & (1<<i)) break; // stepper counts after "Count" 
+        char *end;
+        pos[i] = strtof(val, &end);
+        if(end==val) return false;
+        found |= 1<<i;
+    }
+    if(found != 0x0F) return false;
+    x = pos[0]; y = pos[1]; z = pos[2]; ePos = pos[3];
     GD_DEBUGF("Parsed pos: X: %f, Y: %f, Z: %f, E: %f\n", x,y,z,ePos);
-    notify_observers(DeviceStatusEvent{0});
+    post(DEV_POSITION);
     return true;
 }
 
@@ -375,88 +485,122 @@ bool MarlinDevice::parseG0G1(const char *str) {
     t = extractFloat(str, "E");
     if(!isnan(t) ) ePos = t; else return false;
     GD_DEBUGF("Parsed pos: X: %f, Y: %f, Z: %f, E: %f\n", x,y,z,ePos);
-    notify_observers(DeviceStatusEvent{0});
+    post(DEV_POSITION);
     return true;
 }
 
-bool MarlinDevice::parseM115(const String &str) {
-    desc = extractM115String(str, "FIRMWARE_NAME") + " " + extractM115String(str, "MACHINE_TYPE");
-    String value = extractM115String(str, "EXTRUDER_COUNT");
-    fwExtruders = value == "" ? 1 : min(value.toInt(), (long)MAX_SUPPORTED_EXTRUDERS);
-    fwAutoreportTempCap = extractM115Bool(str, "Cap:AUTOREPORT_TEMP");
-    fwProgressCap = extractM115Bool(str, "Cap:PROGRESS");
-    fwBuildPercentCap = extractM115Bool(str, "Cap:BUILD_PERCENT");
-    GD_DEBUGF("Parsed M115: desc=%s, extruders:%d, autotemp:%d, progress:%d, buildPercent:%d\n", 
-        desc.c_str(), fwExtruders, fwAutoreportTempCap, fwProgressCap, fwBuildPercentCap );
-    notify_observers(DeviceStatusEvent{0});
+// M503 response lines like
+// echo:  M201 X3000.00 Y3000.00 Z100.00 E10000.00
+// echo:  M203 X300.00 Y300.00 Z5.00 E25.00
+// echo:  M204 P3000.00 R3000.00 T3000.00
+// M204 P, print acceleration, comes after M201 and is what moves actually use
+bool MarlinDevice::parseSettings(const char *str) {
+    float v;
+    if(strstr(str, "M201 ")!=nullptr) {
+        v = extractFloat(str, "X");
+        if(!isnan(v)) MotionEstimator::setAccel(v);
+    } else if(strstr(str, "M203 ")!=nullptr) {
+        v = extractFloat(str, "X");
+        if(!isnan(v)) MotionEstimator::setRapidFeed(v*60); // mm/s
+    } else if(strstr(str, "M204 ")!=nullptr) {
+        v = extractFloat(str, "P");
+        if(!isnan(v)) MotionEstimator::setAccel(v);
+    } else return false;
+    GD_DEBUGF("Parsed setting '%s'\n", str);
     return true;
 }
 
-
-bool MarlinDevice::isFloat(const String value) {
-    for (int i = 0; i < value.length(); i++) {
-        char ch = value[i];
-        if (ch != ' ' && ch != '.' && ch != '-' && !isDigit(ch)) return false;
-    }
+// M115 response comes as several lines: FIRMWARE_NAME:... line, then one Cap:XXX:1 line per capability
+bool MarlinDevice::parseM115(const char *str) {
+    if(startsWith(str, "Cap:")) {
+        const char *name = str+4;
+        const char *colon = strchr(name, ':');
+        if(colon==nullptr) return false;
+        size_t len = colon-name;
+        bool v = colon[1]=='1';
+        if(keyIs(name, len, "AUTOREPORT_TEMP")) fwAutoreportTempCap = v;
+        else if(keyIs(name, len, "PROGRESS")) fwProgressCap = v;
+        else if(keyIs(name, len, "BUILD_PERCENT")) fwBuildPercentCap = v;
+        else if(keyIs(name, len, "ADVANCED_OK")) fwAdvancedOkCap = v;
+    } else if(strstr(str, "FIRMWARE_NAME:")!=nullptr) {
+        const char *v;
+        char buf[64];
+        size_t len = extractM115Value(str, "FIRMWARE_NAME", v);
+        size_t n = snprintf(buf, sizeof(buf), "%.*s ", (int)len, v);
+        len = extractM115Value(str, "MACHINE_TYPE", v);
+        if(n<sizeof(buf)) snprintf(buf+n, sizeof(buf)-n, "%.*s", (int)len, v);
+        desc = buf;
+        len = extractM115Value(str, "EXTRUDER_COUNT", v);
+        fwExtruders = len==0 ? 1 : constrain(atoi(v), 1, MAX_SUPPORTED_EXTRUDERS);
+    } else return false;
+    GD_DEBUGF("Parsed M115: desc=%s, extruders:%d, autotemp:%d, progress:%d, buildPercent:%d, advancedOk:%d\n", 
+        desc.c_str(), fwExtruders, fwAutoreportTempCap, fwProgressCap, fwBuildPercentCap, fwAdvancedOkCap );
+    post(DEV_INFO);
     return true;
 }
 
-inline float MarlinDevice::extractFloat(const char *str, const char * key) {
-    char* s = strstr(str, key);
-    if(s==NULL) return NAN; 
-    s += strlen(key);
-    return atof(s);
+
+// B is free slots in the command buffer. Lines taken into the buffer have left the serial RX buffer, 
+// so they free the byte window even before their own ok arrives.
+void MarlinDevice::parseAdvancedOk(const char *str) {
+    const char *b = strstr(str, " B");
+    const char *p = strstr(str, " P");
+    if(b==nullptr || !isDigit(b[2]) || p==nullptr || !isDigit(p[2])) return;
+    plannerFree = atoi(p+2);
+    if(plannerFree > maxFreePlanner) maxFreePlanner = plannerFree;
+    int freeSlots = atoi(b+2);
+    if(freeSlots > maxFreeCmdSlots) maxFreeCmdSlots = freeSlots;
+    // oldest in-flight lines are those already in the command buffer
+    sentQueue.setDrained( maxFreeCmdSlots - freeSlots );
 }
 
-inline float MarlinDevice::extractFloat(const String &str, const String key) {
-    int s = str.indexOf(key);
-    if(s==-1) return NAN; 
-    s += key.length();
-    int e = str.indexOf(' ', s);
-    if(e==-1) e=str.length();
-    return str.substring(s,e).toFloat();
+
+bool MarlinDevice::canJogSegment() {
+    int queued = jogLines;
+    // ok is sent once a move is planned, so P of ADVANCED_OK is the only way to see the planner
+    if(plannerFree>=0) queued += maxFreePlanner - plannerFree;
+    return queued < MAX_JOG_SEGMENTS;
 }
 
-// Parse temperatures from prusa firmare (sent when heating)
-// ok T:32.8 E:0 B:31.8
-bool MarlinDevice::extractPrusaHeatingTemp(const String &response, const String whichTemp, float &temperature) {
-    int tpos = response.indexOf(whichTemp + ":");
-    if (tpos != -1) { // This response contains a temperature
-        int spacepos = response.indexOf(" ", tpos);
-        if (spacepos == -1)
-        spacepos = response.length();
-        String actual = response.substring(tpos + whichTemp.length() + 1, spacepos);
-        if (isFloat(actual)) {
-            temperature = actual.toFloat();
-            return true;
-        }
+bool MarlinDevice::nextKeyValue(const char* &p, const char* &key, size_t &keyLen, const char* &val) {
+    while(*p!=0) {
+        while(*p==' ') p++;
+        const char *start = p;
+        while(*p!=0 && *p!=' ' && *p!=':') p++;
+        if(*p!=':') { while(*p!=0 && *p!=' ') p++; continue; } // no value in this token
+        key = start;
+        keyLen = p-start;
+        val = ++p;
+        while(*p!=0 && *p!=' ') p++;
+        return true;
     }
-
     return false;
 }
 
-
-inline int MarlinDevice::extractPrusaHeatingExtruder(const String &response) {
-    float tmp;
-    return extractPrusaHeatingTemp(response, "E", tmp) ? (int)tmp : -1;
+inline bool MarlinDevice::keyIs(const char* key, size_t len, const char* name) {
+    return strncmp(key, name, len)==0 && name[len]==0;
 }
 
-String MarlinDevice::extractM115String(const String &response, const String key) {
-    int spos = response.indexOf(key + ":");
-    if (spos != -1) {
-        spos += key.length() + 1;
-        int epos = response.indexOf(':', spos);
-        if (epos == -1) return response.substring(spos);
-        else {
-            while (epos >= spos && response[epos] != ' ' && response[epos] != '\n') --epos;
-            return response.substring(spos, epos);
-        }
-    }
-
-    return "";
+inline float MarlinDevice::extractFloat(const char *str, const char * key) {
+    const char* s = strstr(str, key);
+    if(s==NULL) return NAN; 
+    s += strlen(key);
+    return atof(s);
 }
 
-inline bool MarlinDevice::extractM115Bool(const String &response, const String key, const bool onErrorValue) {
-    String result = extractM115String(response, key);
-    return result == "" ? onErrorValue : (result == "1" ? true : false);
+// Value of M115 field runs until the last space before the next field, e.g.
+// FIRMWARE_NAME:Marlin 2.0.9 (Github) SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin
+size_t MarlinDevice::extractM115Value(const char *response, const char *key, const char* &value) {
+    size_t keyLen = strlen(key);
+    const char *s = response;
+    while( (s = strstr(s, key)) != nullptr ) {
+        if(s[keyLen]==':' && (s==response || s[-1]==' ') ) break;
+        s += keyLen;
+    }
+    if(s==nullptr) return 0;
+    value = s+keyLen+1;
+    const char *e = strchr(value, ':');
+    if(e==nullptr) return strlen(value);
+    while(e>value && *e!=' ') e--;
+    return e-value;
 }
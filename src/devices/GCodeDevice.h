@@ -1,10 +1,13 @@
 #pragma once
 
 #include <Arduino.h>
-#include <etl/observer.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
 //#include <etl/queue.h>
 #include "CommandQueue.h"
-#include <message_buffer.h>
+#include "../Seqlock.h"
+#include "../EventBus.h"
+#include "../Stats.h"
 
 //#define ADD_LINECOMMENTS
 
@@ -12,36 +15,82 @@
 #define GD_DEBUGS(s)   // { Serial.println(s); }
 #define GD_DEBUGLN GD_DEBUGS
 
+#define XOFF  0x13
+#define XON   0x11
+
 #define KEEPALIVE_INTERVAL 5000    // Marlin defaults to 2 seconds, get a little of margin
 
-#define STATUS_REQUEST_INTERVAL  500
+#define STATUS_REQUEST_INTERVAL    500   // ms, DRO refresh
+#define FAST_STATUS_INTERVAL       100   // ms, while jogging or a web client is watching
+#define STREAMING_STATUS_INTERVAL  2000  // ms, at most this often while a job is streaming
+#define STATUS_REQUEST_TIMEOUT     1000  // ms, to give up waiting for a status response
+#define WEB_WATCH_HOLD             5000  // ms, status is polled fast this long after a web request
+#define JOG_WATCH_HOLD             1000  // ms, same after a jog
+
+#define RX_POLL_INTERVAL      1    // ms, while waiting for a response
+#define IDLE_RX_POLL_INTERVAL 10   // ms, for unsolicited messages; UART RX FIFO holds 20+ ms at 115200
 
 
 const int MAX_DEVICE_OBSERVERS = 3;
-struct DeviceStatusEvent { int statusField; };
+/** Fields of DeviceStatusEvent, errors are delivered without rate limit */
+enum DeviceField : uint32_t {
+    DEV_ERROR       = 1<<0,  ///< panic, timeout, or a message worth showing
+    DEV_POSITION    = 1<<1,
+    DEV_STATUS      = 1<<2,  ///< machine state, offsets, feed, spindle
+    DEV_TEMPERATURE = 1<<3,
+    DEV_INFO        = 1<<4,  ///< firmware description and capabilities
+};
+struct DeviceStatusEvent { 
+    uint32_t fields;  ///< DeviceField bits changed since the last notification
+    DeviceStatusEvent(uint32_t f): fields(f) {}
+};
 using DeviceObserver = etl::observer<const DeviceStatusEvent&> ;
 
-using ReceivedLineHandler = std::function< void(const char* str, size_t len) >;
+/** Overrides of the running motion. Grbl has feed, rapid and spindle; Marlin feed (M220) and flow (M221) */
+enum DeviceOverride { OV_FEED, OV_RAPID, OV_SPINDLE, OV_FLOW, N_OVERRIDES };
+
+/** 
+ * Receives every line read from the device, in device task. Defined by the application, 
+ * so the set of receivers is fixed at build time and there is no indirect call per line.
+ */
+void deviceLineReceived(const char* line, size_t len);
 
-class GCodeDevice : public etl::observable<DeviceObserver, MAX_DEVICE_OBSERVERS> {
+/** Device state published by the device task for UI, see GCodeDevice::getSnapshot() */
+struct DeviceSnapshot {
+    char type;              ///< first letter of device type, 0 if there is no device
+    bool connected;
+    bool panic;
+    bool canJog;
+    float x, y, z;          ///< machine position
+    float ofs[3];           ///< WPos = MPos - ofs
+    uint32_t feed, spindle;
+    char state[12];
+    char lastResponse[32];
+    uint32_t sentQueue, queue;  ///< bytes sent but not acknowledged, scheduled but not sent
+    uint16_t overrides[N_OVERRIDES]; ///< percent, 0 if the device has no such override
+    float toolTemp, toolTarget; ///< first extruder, Marlin only
+    float bedTemp, bedTarget;
+};
+
+class GCodeDevice : public EventBus<DeviceStatusEvent, MAX_DEVICE_OBSERVERS> {
 public:
 
     static GCodeDevice *getDevice();
     //static void setDevice(GCodeDevice *dev);
 
-    GCodeDevice(Stream * s, size_t priorityBufSize=0, size_t bufSize=0): printerSerial(s), connected(false)  {
-        if(priorityBufSize!=0) buf0 = xMessageBufferCreate(priorityBufSize);
-        if(bufSize!=0) buf1 = xMessageBufferCreate(bufSize);
-        buf0Len = bufSize;
-        buf1Len = priorityBufSize;
+    GCodeDevice(Stream * s, size_t priorityBufSize=0, size_t bufSize=0): EventBus(DEV_ERROR), printerSerial(s), connected(false),
+            curUnsentCmdLen(0), curUnsentPriorityCmdLen(0)  {
+        if(priorityBufSize!=0) buf0.begin(priorityBufSize);
+        if(bufSize!=0) buf1.begin(bufSize);
 
         assert(inst==nullptr);
         inst = this;
     }
-    GCodeDevice() : printerSerial(nullptr), connected(false) {}
-    virtual ~GCodeDevice() { clear_observers(); }
+    GCodeDevice() : EventBus(DEV_ERROR), printerSerial(nullptr), connected(false), curUnsentCmdLen(0), curUnsentPriorityCmdLen(0) {}
+    virtual ~GCodeDevice() { clear_observers(); if(inst==this) inst = nullptr; }
 
     virtual void begin() { 
+        loopTask = xTaskGetCurrentTaskHandle();
         while(printerSerial->available()>0) printerSerial->read(); 
         connected=true; 
     };
@@ -51,42 +100,87 @@ public:
     };
     virtual bool scheduleCommand(const char* cmd, size_t len) {
         if(panic) return false;
-        if(!buf1) return false;
-        if(len==0) return false;
-        return xMessageBufferSend(buf1, cmd, len, 0) != 0;
+        if(!buf1.push(cmd, len)) return false;
+        wakeUp();
+        return true;
     };
     virtual bool schedulePriorityCommand(String cmd) { 
         return schedulePriorityCommand(cmd.c_str(), cmd.length() );
     };
     virtual bool schedulePriorityCommand( const char* cmd, size_t len) {
         //if(panic) return false;
-        if(!buf0) return false;
-        if(len==0) return false;
-        return xMessageBufferSend(buf0, cmd, len, 0) != 0;
+        if(!buf0.push(cmd, len)) return false;
+        wakeUp();
+        return true;
+    }
+    /** All lines or none; nothing from the other queue gets sent between them */
+    bool schedulePriorityCommands(const char* const cmds[], size_t n) {
+        size_t lens[4];
+        if(n>4) return false;
+        for(size_t i=0; i<n; i++) lens[i] = strlen(cmds[i]);
+        if(!buf0.push(cmds, lens, n)) return false;
+        wakeUp();
+        return true;
+    }
+    /** Characters acted on by firmware as soon as received, they're sent bypassing queues */
+    virtual bool isRealtimeChar(char c) { return false; }
+
+    /** 
+     * Writes bytes to the device on the next device task iteration, ahead of both queues. 
+     * For realtime characters only, firmware doesn't acknowledge them. May be called from any task.
+     */
+    bool sendRealtime(const uint8_t* b, size_t n) {
+        if(!realtime.push(b, n)) return false;
+        wakeUp();
+        return true;
+    }
+
+    /** 
+     * Changes an override by delta percent. It goes around the command queues, so it applies to the motion 
+     * running now, not after the queued lines. Returns false if the device has no such override.
+     * May be called from any task.
+     */
+    virtual bool adjustOverride(DeviceOverride o, int delta) { return false; }
+
+    /** Back to 100% */
+    virtual bool resetOverride(DeviceOverride o) { return false; }
+
+    /** Sets an override to percent, relative to the last published value */
+    bool setOverride(DeviceOverride o, int percent) {
+        if(percent==100) return resetOverride(o);
+        int cur = getSnapshot().overrides[o];
+        if(cur==0) return false;
+        return percent==cur || adjustOverride(o, percent-cur);
     }
+
     virtual bool canSchedule(size_t len) { 
         if(panic) return false;
-        if(!buf1) return false; 
-        if(len==0) return false;
-        return xMessageBufferSpaceAvailable(buf1) > len + 2; 
+        return buf1.canPush(len); 
     }
 
+    /** Schedules a relative jog segment through the priority queue */
     virtual bool jog(uint8_t axis, float dist, int feed=100)=0;
 
     virtual bool canJog() { return true; }
 
-    virtual void loop() {
-        sendCommands();
-        receiveResponses();
-        checkTimeout();
+    /** False while MAX_JOG_SEGMENTS jog segments are queued or planned, so jogging stops shortly after the wheel */
+    virtual bool canJogSegment() { return true; }
 
-        if(nextStatusRequestTime!=0 && millis() > nextStatusRequestTime) {
-            requestStatusUpdate();
-            nextStatusRequestTime = millis() + STATUS_REQUEST_INTERVAL;
-        }
-    }
-    virtual void sendCommands();
-    virtual void receiveResponses();
+    /** Ends continuous jogging, cancelling the motion left if the device can */
+    virtual void jogStop() {}
+
+    static const int MAX_JOG_SEGMENTS = 2;
+
+    /** One iteration of the device task; StreamEngine::run() is the same without virtual calls */
+    virtual void loop() = 0;
+    virtual void sendCommands() = 0;
+    virtual void receiveResponses() = 0;
+
+    /** 
+     * Blocks device task until there is something to do: a command was scheduled, 
+     * a response may have arrived or a status update is due. 
+     */
+    void waitForEvent();
 
     float getX() { return x; }
     float getY() { return y; }
@@ -98,9 +192,19 @@ public:
 
     bool isInPanic() { return panic; }
 
-    virtual void enableStatusUpdates(bool v=true) {
-        if(v) nextStatusRequestTime = millis();
-        else nextStatusRequestTime = 0;
+    enum StatusWatcher { WATCH_UI, WATCH_WEB, WATCH_JOG, N_WATCHERS };
+
+    /** 
+     * Asks for status updates every intervalMs (0 stops watching) for holdMs, or until changed if holdMs is 0.
+     * Watchers are merged into one poll at the shortest interval; it backs off while a job is streaming. 
+     * May be called from any task.
+     */
+    void watchStatus(StatusWatcher w, uint32_t intervalMs, uint32_t holdMs=0) {
+        uint32_t until = holdMs==0 ? 0 : millis()+holdMs;
+        bool faster = intervalMs!=0 && (watchInterval[w]==0 || intervalMs<watchInterval[w]);
+        watchUntil[w] = until;
+        watchInterval[w] = intervalMs;
+        if(faster) wakeUp();
     }
 
     String getType() { return typeStr; }
@@ -108,17 +212,18 @@ public:
     String getDescrption() { return desc; }
 
     size_t getQueueLength() {  
-        return (  buf0Len - xMessageBufferSpaceAvailable(buf0)  ) + 
-            (  buf1Len - xMessageBufferSpaceAvailable(buf1)  ); 
+        return buf0.getUnsentBytes() + buf1.getUnsentBytes(); 
     }
 
     size_t getSentQueueLength()  {
         return sentCounter->bytes();
     }
 
+    /** Requests status once, regardless of watchers */
     virtual void requestStatusUpdate() = 0;
 
-    void addReceivedLineHandler( ReceivedLineHandler h) { receivedLineHandlers.push_back(h); }
+    /** Consistent copy of device state, may be read from any task */
+    DeviceSnapshot getSnapshot() const { return snapshot.read(); }
 
 protected:
     Stream * printerSerial;
@@ -127,24 +232,51 @@ protected:
     bool connected;
     String desc;
     String typeStr;
-    size_t buf0Len, buf1Len;
     bool canTimeout;
 
-    static const size_t MAX_GCODE_LINE = 96;
-    char curUnsentCmd[MAX_GCODE_LINE+1], curUnsentPriorityCmd[MAX_GCODE_LINE+1];
+    /// point to the next unsent line in buf1 / buf0
+    char *curUnsentCmd, *curUnsentPriorityCmd;
     size_t curUnsentCmdLen, curUnsentPriorityCmdLen;
 
     float x,y,z;
     bool panic = false;
-    uint32_t nextStatusRequestTime;
-    MessageBufferHandle_t  buf0;
-    MessageBufferHandle_t  buf1;
+    uint32_t nextStatusRequestTime = 0;
+    uint32_t lastStatusRequestTime = 0;
+    bool statusRequestPending = false;
+    uint32_t minStatusInterval = 0; ///< device specific limit of the poll rate
+    uint32_t watchInterval[N_WATCHERS] = {};
+    uint32_t watchUntil[N_WATCHERS] = {};
+    LineRing  buf0;
+    LineRing  buf1;
+    RealtimeQueue realtime;
 
     bool xoff;
     bool xoffEnabled = false;
 
     Counter * sentCounter;
 
+    TaskHandle_t loopTask = nullptr;
+
+    /** Size from MemoryBudget, or the device default if it's not configured */
+    static size_t budgetOr(size_t configured, size_t def) { return configured!=0 ? configured : def; }
+
+    /** Fills state specific to device type; base fills the common part */
+    virtual void fillSnapshot(DeviceSnapshot &s);
+
+    void publishSnapshot(const DeviceSnapshot &s) { snapshot.write(s); }
+
+    /** Sends status request when it's due and no other one is waiting for response */
+    void pollStatus();
+
+    /** Current poll interval, 0 if nobody watches */
+    uint32_t getStatusInterval(uint32_t now);
+
+    /** Should be called by devices when a polled status response has arrived */
+    void statusReceived() { statusRequestPending = false; }
+
+    /** Wakes device task from waitForEvent() */
+    void wakeUp() { if(loopTask!=nullptr) xTaskNotifyGive(loopTask); }
+
     void armRxTimeout() {
         if(!canTimeout) return;
         //GD_DEBUGLN(enable ? "GCodeDevice::resetRxTimeout enable" : "GCodeDevice::resetRxTimeout disable");
@@ -167,17 +299,35 @@ protected:
             connected = false; 
             cleanupQueue();
             disarmRxTimeout(); 
-            notify_observers(DeviceStatusEvent{1});
+            post(DEV_ERROR);
         }
     }
 
     void cleanupQueue() { 
-        if(buf1) xMessageBufferReset(buf1); 
-        if(buf0) xMessageBufferReset(buf0); 
+        buf1.clear(); 
+        buf0.clear(); 
+        realtime.clear();
         sentCounter->clear();
         curUnsentCmdLen = 0;
+        curUnsentPriorityCmdLen = 0;
     }
 
+    /** Text sent around a line, it is counted against the sent window as well */
+    struct LineFrame {
+        char prefix[12];
+        char suffix[12];
+        size_t prefixLen = 0;
+        size_t suffixLen = 0;
+    };
+
+    /** Adds line number, checksum or a debug comment to a line that's about to be sent */
+    virtual void frameLine(const char* cmd, size_t len, LineFrame &f);
+
+    /** Called after a line has been written out */
+    virtual void lineSent(const char* cmd, size_t len) { sentLines++; }
+
+    uint32_t sentLines = 0;
+
     virtual void trySendCommand() = 0;
 
     virtual void tryParseResponse( char* cmd, size_t len ) = 0;
@@ -185,22 +335,152 @@ protected:
 private:
     static GCodeDevice *inst;
 
-    etl::vector<ReceivedLineHandler, 3> receivedLineHandlers;
+    Seqlock<DeviceSnapshot> snapshot;
+
     //friend void loop();
 
 };
 
 
 
-class GrblDevice : public GCodeDevice {
+/**
+ * Send and receive loop of a device, compiled for one device class D (CRTP).
+ *
+ * D is final, so calls into it from here (trySendCommand(), tryParseResponse(), line framing) are 
+ * direct, and the sent window is used as `D::sentQueue`, its concrete type, instead of Counter. 
+ * Device task calls run() once the device type is known; the virtual GCodeDevice interface 
+ * stays for UI, web server and Job, which don't run per line.
+ */
+template<class D>
+class StreamEngine : public GCodeDevice {
 public:
 
-    GrblDevice(Stream * s): GCodeDevice(s, 20, 100) { 
+    StreamEngine(Stream * s, size_t priorityBufSize, size_t bufSize): GCodeDevice(s, priorityBufSize, bufSize) {}
+    StreamEngine() : GCodeDevice() {}
+
+    void loop() override { run(); }
+
+    inline void run() {
+        self().writeRealtime();
+        { STATS_SCOPE(SEND); self().sendCommands(); }
+        { STATS_SCOPE(RECEIVE); receiveResponses(); }
+        checkTimeout();
+
+        STATS_LEVEL(JOB_QUEUE, buf1.bytes());
+        STATS_LEVEL(PRIORITY_QUEUE, buf0.bytes());
+        STATS_LEVEL(SENT_LINES, self().sentQueue.size());
+        STATS_LEVEL(SENT_BYTES, self().sentQueue.bytes());
+
+        pollStatus();
+
+        DeviceSnapshot s = {};
+        self().fillSnapshot(s);
+        publishSnapshot(s);
+
+        dispatch();
+    }
+
+    void sendCommands() override {
+        if(panic) return;
+        if(xoffEnabled && xoff) return;
+
+        if(curUnsentPriorityCmdLen == 0) {
+            curUnsentPriorityCmdLen = buf0.peekUnsent(curUnsentPriorityCmd);
+        }
+        if(curUnsentPriorityCmdLen==0 && curUnsentCmdLen==0) {
+            curUnsentCmdLen = buf1.peekUnsent(curUnsentCmd);
+        }
+        if(curUnsentCmdLen==0 && curUnsentPriorityCmdLen==0) return;
+
+        STATS_SCOPE(TRY_SEND);
+        self().trySendCommand();
+    }
+
+    void receiveResponses() override {
+        while (printerSerial->available()) {
+            char ch = (char)printerSerial->read();
+            switch(ch) {
+                case '\n':
+                case '\r': break;
+                case XOFF: if(xoffEnabled) { xoff=true; break; }
+                case XON: if(xoffEnabled) {xoff=false; break; }
+                default: if(respLen<MAX_RESPONSE) resp[respLen++] = ch;
+            }
+            if(ch=='\n') {
+                resp[respLen]=0;
+                deviceLineReceived(resp, respLen);
+                self().tryParseResponse(resp, respLen);
+                respLen = 0;
+            }
+        }
+    }
+
+protected:
+
+    /** Writes out realtime bytes. Devices may add their own urgent lines, before anything queued */
+    void writeRealtime() {
+        uint8_t b[RealtimeQueue::SIZE];
+        size_t n = realtime.pop(b, sizeof(b));
+        if(n!=0) printerSerial->write(b, n);
+    }
+
+    /** Sends current unsent line (priority one first) if it fits into the sent window. Returns false if it doesn't. */
+    bool sendLine() {
+        bool priority = curUnsentPriorityCmdLen!=0;
+        LineRing &ring = priority ? buf0 : buf1;
+        char* cmd  = priority ? curUnsentPriorityCmd : curUnsentCmd; 
+        size_t * len = priority ? &curUnsentPriorityCmdLen : &curUnsentCmdLen ;
+
+        if( !writeLine(cmd, *len, &ring) ) return false;
+        ring.markSent();
+        *len = 0;
+        return true;
+    }
+
+    /** Writes a line with its frame and pushes it to the sent window. ring is nullptr for a line not held in a ring */
+    bool writeLine(const char* cmd, size_t len, LineRing* ring) {
+        LineFrame f;
+        self().frameLine(cmd, len, f);
+        size_t framedLen = f.prefixLen + len + f.suffixLen;
+
+        if( !self().sentQueue.canPush(framedLen) ) return false;
+
+        self().sentQueue.push( cmd, framedLen, ring );
+        if(f.prefixLen!=0) printerSerial->write(f.prefix, f.prefixLen);
+        printerSerial->write(cmd, len);  
+        if(f.suffixLen!=0) printerSerial->write(f.suffix, f.suffixLen);
+        printerSerial->print('\n');
+        GD_DEBUGF("<  (f%3d,%3d) '%s' (%d)\n", self().sentQueue.getFreeLines(), self().sentQueue.getFreeBytes(), cmd, len );
+        self().lineSent(cmd, len);
+        return true;
+    }
+
+private:
+
+    static const size_t MAX_RESPONSE = 200; // M115 is far longer than 100
+    char resp[MAX_RESPONSE+1];
+    size_t respLen = 0;
+
+    D& self() { return *static_cast<D*>(this); }
+
+};
+
+
+
+class GrblDevice final : public StreamEngine<GrblDevice> {
+    friend class StreamEngine<GrblDevice>;
+public:
+
+    // lines stay in the queue until acknowledged, so it should hold the sent window as well
+    GrblDevice(Stream * s): StreamEngine(s, budgetOr(MemoryPool::budget().devicePriorityQueue, 64), 
+            budgetOr(MemoryPool::budget().deviceQueue, 256+MAX_RX_WINDOW+16*LineRing::OVERHEAD)) { 
         typeStr = "grbl";
+        sentQueue.begin( budgetOr(MemoryPool::budget().sentLines, MAX_SENT_LINES) );
         sentCounter = &sentQueue; 
         canTimeout = false;
+        setRxBufferSize(DEFAULT_RX_BUFFER);
     };
-    GrblDevice() : GCodeDevice() {typeStr = "grbl"; sentCounter = &sentQueue; }
+    GrblDevice() : StreamEngine() {typeStr = "grbl"; sentCounter = &sentQueue; }
 
     virtual ~GrblDevice() {}
 
@@ -208,15 +488,28 @@ public:
 
     bool canJog() override;
 
+    bool canJogSegment() override;
+
+    void jogStop() override;
+
+    bool isRealtimeChar(char c) override;
+
+    /** Feed and spindle go in 10% and 1% steps; rapid has only 25, 50 and 100% */
+    bool adjustOverride(DeviceOverride o, int delta) override;
+
+    bool resetOverride(DeviceOverride o) override;
+
     virtual void begin() {
         GCodeDevice::begin();
         schedulePriorityCommand("$I");
         schedulePriorityCommand("?");
+        schedulePriorityCommand("$$"); // max rate and acceleration, for job time estimate
     }
 
     virtual void reset() {
         panic = false;
         cleanupQueue();
+        jogLines = 0;
         char c = 0x18;
         schedulePriorityCommand(&c, 1);
     }
@@ -225,33 +518,73 @@ public:
         schedulePriorityCommand("?");
     }
 
+    /** Fields of the last status report. Fields missing in a report keep their previous value, unless noted. */
+    struct StatusReport {
+        char state[12];          ///< Idle, Run, Hold:0, Jog, Alarm, Door:1, Check, Home, Sleep
+        float wco[3];            ///< WPos = MPos - WCO
+        uint32_t feed;
+        uint32_t spindle;
+        int16_t plannerFree;     ///< Bf:, free planner blocks; -1 if never reported
+        int16_t rxFree;          ///< Bf:, free bytes in RX buffer; -1 if never reported
+        int32_t lineNumber;      ///< Ln:, -1 if not in this report
+        uint8_t ovFeed, ovRapid, ovSpindle; ///< Ov:, percent
+        char pins[12];           ///< Pn:, active input pins, empty if not in this report
+        char accessories[8];     ///< A:, spindle/coolant state, empty if not in this report
+    };
+
     /// WPos = MPos - WCO
-    float getXOfs() { return ofsX; } 
-    float getYOfs() { return ofsY; }
-    float getZOfs() { return ofsZ; }
-    uint getSpindleVal() { return spindleVal; }
-    uint getFeed() { return feed; }
-    String & getStatus() { return status; }
+    float getXOfs() { return report.wco[0]; } 
+    float getYOfs() { return report.wco[1]; }
+    float getZOfs() { return report.wco[2]; }
+    uint getSpindleVal() { return report.spindle; }
+    uint getFeed() { return report.feed; }
+
+    const StatusReport & getStatusReport() const { return report; }
+
+    /** RX buffer size and planner block count, as reported in [OPT:] of $I */
+    size_t getRxBufferSize() { return rxBufferSize; }
+    size_t getPlannerBlocks() { return plannerBlocks; }
+
+    /** Reads "rxMargin" - bytes of GRBL RX buffer left unused by character counting */
+    static void config(JsonObjectConst cfg);
+
+    const char* getStatus() { return report.state; }
     String & getLastResponse() { return lastResponse; }
 
 protected:
     void trySendCommand() override;
 
     void tryParseResponse( char* cmd, size_t len ) override;
+
+    void fillSnapshot(DeviceSnapshot &s) override;
     
 private:
+
+    static const size_t DEFAULT_RX_BUFFER = 128; ///< stock 328p GRBL
+    static const size_t MAX_RX_WINDOW = 1024;  ///< grblHAL default
+    static const size_t MAX_SENT_LINES = 128;  ///< default, MemoryBudget::sentLines
+
+    static size_t rxMargin;
     
-    SimpleCounter<15,128> sentQueue;
+    SimpleCounter<MAX_RX_WINDOW> sentQueue;
+
+    size_t rxBufferSize;
+    size_t plannerBlocks = 15;
+
+    int jogLines = 0; ///< jog lines scheduled, but not acknowledged yet
     
     String lastResponse;
 
-    String status;
+    StatusReport report = { "", {0,0,0}, 0, 0, -1, -1, -1, 100, 100, 100, "", "" };
+
+    void parseGrblStatus(const char* v);
 
-    //WPos = MPos - WCO
-    float ofsX,ofsY,ofsZ;
-    uint feed, spindleVal;
+    void parseOptions(const char* v);
 
-    void parseGrblStatus(char* v);
+    /** `$110=..` X max rate and `$120=..` X acceleration lines of `$$` */
+    void parseSetting(const char* v);
+
+    void setRxBufferSize(size_t size);
 
     bool isCmdRealtime(char* data, size_t len);
 
@@ -260,55 +593,86 @@ private:
 
 
 
-class MarlinDevice: public GCodeDevice {
+class MarlinDevice final : public StreamEngine<MarlinDevice> {
+    friend class StreamEngine<MarlinDevice>;
 
 public:
 
-    MarlinDevice(Stream * s): GCodeDevice(s, 100, 200) { 
+    MarlinDevice(Stream * s): StreamEngine(s, budgetOr(MemoryPool::budget().devicePriorityQueue, 100+MAX_SENT_BYTES), 
+            budgetOr(MemoryPool::budget().deviceQueue, 200+MAX_SENT_BYTES+16*LineRing::OVERHEAD)) { 
         typeStr = "marlin";
+        sentQueue.begin( budgetOr(MemoryPool::budget().sentLines, MAX_SENT_LINES) );
         sentCounter = &sentQueue;
         canTimeout = true;
+        minStatusInterval = 250; // M114 and M105 go through the command queue
+        if(lineNumbers && history.begin(RESEND_LINES) ) {
+            sentQueue.setLimits(RESEND_LINES, MAX_SENT_BYTES); // every line in flight should be kept for resend
+        }
+        clearOverrides();
     }
-    MarlinDevice() : GCodeDevice() {typeStr = "marlin";; sentCounter = &sentQueue;}
+    MarlinDevice() : StreamEngine() {typeStr = "marlin";; sentCounter = &sentQueue; clearOverrides(); }
 
     virtual ~MarlinDevice() {}
 
+    /** 
+     * Every segment is wrapped in G91/G90, pushed together so job lines are never sent in relative mode. 
+     * There is no jog cancel, jogging stops when the last segment ends.
+     */
     virtual bool jog(uint8_t axis, float dist, int feed) override {
         constexpr const char AXIS[] = {'X', 'Y', 'Z', 'E'};
-        char msg[81]; snprintf(msg, 81, "G0 F%d %c%04f", feed, AXIS[axis], dist);
-        if(  xMessageBufferSpacesAvailable(buf1)>strlen(msg)+3+3+6 ) return false;
-        schedulePriorityCommand("G91");
-        schedulePriorityCommand(msg);
-        schedulePriorityCommand("G90");
+        char msg[81]; snprintf(msg, 81, "G0 F%d %c%.3f", feed, AXIS[axis], dist);
+        const char* cmds[] = { "G91", msg, "G90" };
+        if( !schedulePriorityCommands(cmds, 3) ) return false;
+        jogLines++;
         return true;
     }
 
+    bool canJogSegment() override;
+
     virtual void begin() {
         GCodeDevice::begin();
+        if(history.isValid() ) schedulePriorityCommand("M110 N0");
         if(! schedulePriorityCommand("M115") ) GD_DEBUGS("could not schedule M115");
         if(! schedulePriorityCommand("M114") ) GD_DEBUGS("could not schedule M114");
         if(! schedulePriorityCommand("M105") ) GD_DEBUGS("could not schedule M105");
+        if(! schedulePriorityCommand("M503") ) GD_DEBUGS("could not schedule M503"); // limits for job time estimate
     }
 
     virtual void reset() {        
         cleanupQueue();
+        jogLines = 0;
         panic = false;
         schedulePriorityCommand("M112");
         //schedulePriorityCommand("M999");
+        if(history.isValid() ) {
+            // firmware may restart and forget line numbers; M110 is accepted with any number
+            history.clear();
+            nextLineN = resendN = 0;
+            ignoreResends = 0;
+            schedulePriorityCommand("M110 N0");
+        }
+        clearOverrides(); // firmware restarts at 100%
     }
 
     //virtual void receiveResponses() ;
 
-    void requestStatusUpdate() override {
-        schedulePriorityCommand("M114"); // temp
-        schedulePriorityCommand("M105"); // pos
-    }
+    void requestStatusUpdate() override;
 
     struct Temperature {
         float actual;
         float target;
     };
 
+    /** Reads "lineNumbers" - send lines with N and checksum, and replay them on Resend */
+    static void config(JsonObjectConst cfg);
+
+    void sendCommands() override;
+
+    /** Feed (M220) and flow (M221), sent ahead of queued lines; only the last value is sent if several come in meanwhile */
+    bool adjustOverride(DeviceOverride o, int delta) override;
+
+    bool resetOverride(DeviceOverride o) override { return adjustOverride(o, 100-getOverride(o)); }
+
     const Temperature & getBedTemp() const { return bedTemperature; }
     const Temperature & getExtruderTemp(uint8_t e) const { return toolTemperatures[e]; }
     uint8_t getExtruderCount() const { return fwExtruders; }
@@ -319,58 +683,102 @@ protected:
 
     void tryParseResponse( char* cmd, size_t len ) override;
 
+    void frameLine(const char* cmd, size_t len, LineFrame &f) override;
+
+    void lineSent(const char* cmd, size_t len) override;
+
+    void fillSnapshot(DeviceSnapshot &s) override;
+
 private:
 
     static const int MAX_SUPPORTED_EXTRUDERS = 3;
 
-    static const size_t MAX_SENT_BYTES = 128;
-    static const size_t MAX_SENT_LINES = 400;
+    static bool lineNumbers;
+    static const size_t RESEND_LINES = 32;
+
+    LineHistory history;          ///< allocated only if lineNumbers is on
+    uint32_t nextLineN = 0;       ///< number of the next new line
+    uint32_t resendN = 0;         ///< next line to replay; equals nextLineN unless resending
+    size_t ignoreResends = 0;     ///< Resend requests still expected for lines sent after the requested one
+
+    bool isResending() const { return resendN < nextLineN; }
 
-    SizedQueue<MAX_SENT_LINES, MAX_SENT_BYTES, MAX_GCODE_LINE> sentQueue;
+    void startResend(uint32_t n);
+
+    static const int MIN_OVERRIDE = 10;
+    static const int MAX_OVERRIDE = 999;
+    std::atomic<int> ovPercent[2];  ///< feed, flow; what has been asked for
+    std::atomic<int> ovPending[2];  ///< value not sent yet, -1 if none
+    char ovCmd[2][12];              ///< sent lines are kept here until acknowledged
+
+    void clearOverrides() { for(int i=0; i<2; i++) { ovPercent[i] = 100; ovPending[i] = -1; } }
+
+    static int overrideSlot(DeviceOverride o) { return o==OV_FEED ? 0 : o==OV_FLOW ? 1 : -1; }
+
+    int getOverride(DeviceOverride o) const { int i = overrideSlot(o); return i<0 ? 0 : ovPercent[i].load(); }
+
+    /** Realtime bytes, then pending override lines */
+    void writeRealtime();
+
+    static const size_t MAX_SENT_BYTES = 127; // Marlin RX ring is 128 bytes, one is always left empty
+    static const size_t MAX_SENT_LINES = 64;  ///< default, MemoryBudget::sentLines
+
+    SimpleCounter<MAX_SENT_BYTES> sentQueue;
 
     int fwExtruders = 1;
-    bool fwAutoreportTempCap, fwProgressCap, fwBuildPercentCap;
-    bool autoreportTempEnabled;
+    bool fwAutoreportTempCap = false, fwProgressCap = false, fwBuildPercentCap = false;
+    bool fwAdvancedOkCap = false;
+    bool autoreportTempEnabled = false;
+
+    int maxFreeCmdSlots = 0;  ///< largest B value seen in ADVANCED_OK, i.e. free command buffer slots when idle
+    int maxFreePlanner = 0;   ///< same for P, planner blocks
+    int plannerFree = -1;     ///< P of the last ADVANCED_OK, -1 is unknown
+
+    int jogLines = 0;         ///< jog segments scheduled, but not acknowledged yet
 
     Temperature toolTemperatures[MAX_SUPPORTED_EXTRUDERS];
     Temperature bedTemperature;
     String lastResponse;
     float ePos; ///< extruder pos
 
-    bool parseTemperatures(const String &response);
-
     // Parse temperatures from printer responses like
     // ok T:32.8 /0.0 B:31.8 /0.0 T0:32.8 /0.0 @:0 B@:0
-    bool parseTemp(const String &response, const String whichTemp, Temperature *temperature);
+    bool parseTemperatures(const char *response);
     
     // Parse position responses from printer like
     // X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000
     bool parsePosition(const char *str);
 
-    bool parseM115(const String &str);
-    bool parseG0G1(const char * str);
+    bool parseM115(const char *str);
 
+    /** M201/M203/M204 lines of M503 response, for MotionEstimator */
+    bool parseSettings(const char *str);
 
-    static float extractFloat(const String &str, const String key) ;
-    static float extractFloat(const char * str, const char* key) ;
-    
-    static bool isFloat(const String value);
+    bool parseG0G1(const char * str);
 
-    // Parse temperatures from prusa firmare (sent when heating)
-    // ok T:32.8 E:0 B:31.8
-    static bool extractPrusaHeatingTemp(const String &response, const String whichTemp, float &temperature) ;
+    // Parse ADVANCED_OK response like
+    // ok N123 P15 B3
+    void parseAdvancedOk(const char *str);
 
-    static int extractPrusaHeatingExtruder(const String &response) ;
+    /** Scans space-separated `key:value` tokens, skipping tokens without a value. No heap use. */
+    static bool nextKeyValue(const char* &p, const char* &key, size_t &keyLen, const char* &val);
 
-    static String extractM115String(const String &response, const String field) ;
+    static bool keyIs(const char* key, size_t len, const char* name);
 
-    static bool extractM115Bool(const String &response, const String field, const bool onErrorValue = false);
+    static float extractFloat(const char * str, const char* key) ;
 
-};
+    /** Finds `key:` field of M115 line, returns length of its value */
+    static size_t extractM115Value(const char *response, const char *key, const char* &value);
 
-String readStringUntil(Stream &PrinterSerial, char terminator, size_t timeout);
-String readString(Stream &PrinterSerial, size_t timeout, size_t timeout2=100);
+};
 
+/**
+ * Finds firmware and baud of the device.
+ *
+ * Probes of both firmwares (`$I` and `M115`) are sent at once and replies are classified line by line
+ * as they come, so a probe ends as soon as the device has identified itself, or when garbage says
+ * the baud is wrong. Baud and type that worked last time are kept in NVS and tried first.
+ */
 class DeviceDetector {
 public:
 
@@ -380,16 +788,32 @@ public:
 
     static const uint32_t serialBauds[];   // Marlin valid bauds (removed very low bauds; roughly ordered by popularity to speed things up)
 
+    /** Returns when a device has answered */
     static GCodeDevice* detectPrinter(HardwareSerial &PrinterSerial);
 
-    static GCodeDevice* detectPrinterAttempt(HardwareSerial &PrinterSerial, uint32_t speed, uint8_t type);
-
     static uint32_t serialBaud;    
 
 private:
+
+    static constexpr const char* PREFS_NAMESPACE = "device";
+
+    constexpr static uint8_t ALL_TYPES = (1<<N_TYPES)-1;
+    constexpr static uint32_t PROBE_TIMEOUT = 300;  ///< ms to wait for an identifying reply
+    constexpr static uint32_t QUIET_TIME = 20;      ///< ms of silence after which the rest of replies is over
+    constexpr static size_t MAX_GARBAGE = 8;        ///< non-text bytes that mean a wrong baud
+
+    /** Sends probes of types in the mask together. Returns type of the device, or -1 */
+    static int probe(HardwareSerial &PrinterSerial, uint32_t speed, uint8_t typeMask);
+
     static void sendProbe(uint8_t i, Stream &serial);
 
-    static GCodeDevice* checkProbe(uint8_t i, String v, Stream &serial) ;
+    /** Type a reply line identifies, or -1 */
+    static int checkProbe(const char* line);
+
+    static GCodeDevice* create(int type, Stream &serial);
+
+    /** Skips input until the device is quiet */
+    static void drain(Stream &serial);
 
 };
 
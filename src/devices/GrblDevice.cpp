@@ -1,20 +1,113 @@
 #include "GCodeDevice.h"
+#include "../MotionEstimator.h"
+
+    size_t GrblDevice::rxMargin = 0;
+
+    void GrblDevice::config(JsonObjectConst cfg) {
+        if(cfg.containsKey("rxMargin")) rxMargin = cfg["rxMargin"].as<size_t>();
+    }
+
+    void GrblDevice::setRxBufferSize(size_t size) {
+        rxBufferSize = size;
+        size_t window = size>rxMargin ? size-rxMargin : 0;
+        if(window>MAX_RX_WINDOW) window = MAX_RX_WINDOW;
+        sentQueue.setLimits(sentQueue.getCapacity(), window);
+        GD_DEBUGF("RX buffer %d, sent window %d bytes, planner blocks %d\n", rxBufferSize, window, plannerBlocks);
+    }
+
+    void GrblDevice::parseOptions(const char* v) {
+        // [OPT:V,15,128] or grblHAL's [OPT:VNMZL,35,1024,3,0]: codes, planner blocks, rx buffer size
+        const char* p = strchr(v, ',');
+        if(p==nullptr) return;
+        int blocks = atoi(p+1);
+        p = strchr(p+1, ',');
+        if(p==nullptr) return;
+        int rx = atoi(p+1);
+        if(blocks>0) plannerBlocks = blocks;
+        if(rx>0) setRxBufferSize(rx);
+    }
+
+
+    void GrblDevice::parseSetting(const char* v) {
+        // $110=500.000 (x max rate, mm/min), $120=10.000 (x accel, mm/sec^2)
+        if(startsWith(v, "$110=")) MotionEstimator::setRapidFeed(atof(v+5));
+        else if(startsWith(v, "$120=")) MotionEstimator::setAccel(atof(v+5));
+    }
 
 
     bool GrblDevice::jog(uint8_t axis, float dist, int feed) {
         constexpr static char AXIS[] = {'X', 'Y', 'Z'};
         char msg[81]; snprintf(msg, 81, "$J=G91 F%d %c%.3f", feed, AXIS[axis], dist);
-        return scheduleCommand(msg, strlen(msg) );
+        // priority queue, so jogging doesn't wait behind queued lines
+        if( !schedulePriorityCommand(msg, strlen(msg) ) ) return false;
+        jogLines++;
+        return true;
     }
         
     bool GrblDevice::canJog() {        
-        return status=="Idle" || status=="Jog";
+        return strcmp(report.state, "Idle")==0 || strcmp(report.state, "Jog")==0;
         
     }
 
+    bool GrblDevice::canJogSegment() {
+        int queued = jogLines;
+        // acknowledged segments are in the planner; Bf tells how many blocks are there
+        if(report.plannerFree>=0 && (int)plannerBlocks > report.plannerFree) queued += plannerBlocks - report.plannerFree;
+        return queued < MAX_JOG_SEGMENTS;
+    }
+
+    void GrblDevice::fillSnapshot(DeviceSnapshot &s) {
+        GCodeDevice::fillSnapshot(s);
+        memcpy(s.ofs, report.wco, sizeof(s.ofs));
+        s.feed = report.feed;
+        s.spindle = report.spindle;
+        memcpy(s.state, report.state, sizeof(s.state));
+        strncpy(s.lastResponse, lastResponse.c_str(), sizeof(s.lastResponse)-1);
+        s.overrides[OV_FEED] = report.ovFeed;
+        s.overrides[OV_RAPID] = report.ovRapid;
+        s.overrides[OV_SPINDLE] = report.ovSpindle;
+    }
+
+    bool GrblDevice::adjustOverride(DeviceOverride o, int delta) {
+        uint8_t b[RealtimeQueue::SIZE];
+        size_t n = 0;
+        if(o==OV_RAPID) {
+            // 0x95 100%, 0x96 50%, 0x97 25%
+            if(delta==0) return true;
+            int cur = report.ovRapid;
+            int target = delta>0 ? (cur<50 ? 50 : 100) : (cur>50 ? 50 : 25);
+            b[n++] = target==100 ? 0x95 : target==50 ? 0x96 : 0x97;
+        } else if(o==OV_FEED || o==OV_SPINDLE) {
+            // base+1 +10%, base+2 -10%, base+3 +1%, base+4 -1%
+            uint8_t base = o==OV_FEED ? 0x90 : 0x99;
+            int tens = delta/10, ones = delta%10;
+            for(; tens!=0 && n<sizeof(b); tens += tens>0 ? -1 : 1) b[n++] = base + (tens>0 ? 1 : 2);
+            for(; ones!=0 && n<sizeof(b); ones += ones>0 ? -1 : 1) b[n++] = base + (ones>0 ? 3 : 4);
+        } else return false;
+        return n==0 || sendRealtime(b, n);
+    }
+
+    bool GrblDevice::resetOverride(DeviceOverride o) {
+        uint8_t c;
+        switch(o) {
+            case OV_FEED: c = 0x90; break;
+            case OV_RAPID: c = 0x95; break;
+            case OV_SPINDLE: c = 0x99; break;
+            default: return false;
+        }
+        return sendRealtime(&c, 1);
+    }
+
+    void GrblDevice::jogStop() {
+        char c = 0x85; // jog cancel, flushes jog motions from the planner 
+        schedulePriorityCommand(&c, 1);
+    }
+
     bool GrblDevice::isCmdRealtime(char* data, size_t len) {
-        if (len != 1) return false;
-        char c = data[0];
+        return len==1 && isRealtimeChar(data[0]);
+    }
+
+    bool GrblDevice::isRealtimeChar(char c) {
         switch(c) {
             case '?': // status
             case '~': // cycle start/stop
@@ -38,26 +131,20 @@
         if(isCmdRealtime(curUnsentPriorityCmd, curUnsentPriorityCmdLen) ) {
             printerSerial->write(curUnsentPriorityCmd, curUnsentPriorityCmdLen);  
             GD_DEBUGF("<  (f%3d,%3d) '%c' RT\n", sentCounter->getFreeLines(), sentCounter->getFreeBytes(), curUnsentPriorityCmd[0] );
+            buf0.markSent(true); // no response expected
             curUnsentPriorityCmdLen = 0;
             return;
         }
 
-        char* cmd  = curUnsentPriorityCmdLen!=0 ? &curUnsentPriorityCmd[0] :  &curUnsentCmd[0]; 
-        size_t * len = curUnsentPriorityCmdLen!=0 ? &curUnsentPriorityCmdLen : &curUnsentCmdLen ;
-
-        if( sentCounter->canPush(*len) ) {
-            sentCounter->push( cmd, *len );
-            printerSerial->write(cmd, *len);  
-            printerSerial->print('\n');
-            GD_DEBUGF("<  (f%3d,%3d) '%s' (%d)\n", sentCounter->getFreeLines(), sentCounter->getFreeBytes(), cmd, *len );
-            *len = 0;
-        } else {
-            //if(loadedNewCmd) GD_DEBUGF("<  Not sent, free lines: %d, free space: %d\n", sentQueue.getFreeLines() , sentQueue.getFreeBytes()  );
-        }
+        sendLine();
 
     }
 
     void GrblDevice::tryParseResponse( char* resp, size_t len ) {
+        const char* curCmd;
+        if( (startsWith(resp, "ok") || startsWith(resp, "error")) && jogLines>0 
+                && sentQueue.peek(curCmd)!=0 && startsWith(curCmd, "$J=") ) jogLines--;
+
         if (startsWith(resp, "ok")) {
             sentQueue.pop();
             //responseDetail = "ok";
@@ -68,12 +155,18 @@
             sentQueue.pop();
             panic = true;
             GD_DEBUGF("ERR '%s'\n", resp ); 
-            notify_observers(DeviceStatusEvent{1}); 
+            post(DEV_ERROR); 
             lastResponse = resp;
         } else
         if ( startsWith(resp, "<") ) {
             parseGrblStatus(resp+1);
         } else 
+        if(startsWith(resp, "[OPT:")) {
+            parseOptions(resp+5);
+        } else 
+        if(startsWith(resp, "$")) {
+            parseSetting(resp);
+        } else 
         if(startsWith(resp, "[MSG:")) {
             GD_DEBUGF("Msg '%s'\n", resp ); 
             lastResponse = resp;
@@ -82,68 +175,83 @@
         GD_DEBUGF(" > (f%3d,%3d) '%s' \n", sentQueue.getFreeLines(), sentQueue.getFreeBytes(),resp );
     }
 
-    void mystrcpy(char* dst, const char* start, const char* end) {
-        while(start!=end) {
-            *(dst++) = *(start++);
+    // copies a field of a status report, which is not NUL-terminated
+    static void copyField(char* dst, size_t size, const char* src, size_t len) {
+        if(len>=size) len = size-1;
+        memcpy(dst, src, len);
+        dst[len] = 0;
+    }
+
+    // parses up to n comma-separated numbers, returns count parsed
+    template<typename T>
+    static int parseList(const char* s, T* out, int n) {
+        int i = 0;
+        while(i<n) {
+            char *end;
+            float v = strtof(s, &end);
+            if(end==s) break;
+            out[i++] = (T)v;
+            if(*end!=',') break;
+            s = end+1;
         }
-        *dst=0;
+        return i;
     }
 
-    void GrblDevice::parseGrblStatus(char* v) {
+    void GrblDevice::parseGrblStatus(const char* v) {
         //<Idle|MPos:9.800,0.000,0.000|FS:0,0|WCO:0.000,0.000,0.000>
-        //<Idle|MPos:9.800,0.000,0.000|FS:0,0|Ov:100,100,100>
-        //GD_DEBUGF("parsing %s\n", v.c_str() );
-        
-        char buf[10];
-        bool mpos;
-        char cpy[100];
-        strncpy(cpy, v, 100);
-        v=cpy;
+        //<Hold:0|WPos:1.000,2.000,0.000|Bf:15,128|Ln:99|FS:0,0|Pn:XZ|Ov:100,100,100|A:SF>
+        //GD_DEBUGF("parsing %s\n", v );
 
-        // idle/jogging
-        char* pch = strtok(v, "|");
-        if(pch==nullptr) return;
-        status = pch; 
-        //GD_DEBUGF("Parsed Status: %s\n", status.c_str() );
-
-        // MPos:0.000,0.000,0.000
-        pch = strtok(nullptr, "|"); 
-        if(pch==nullptr) return;
-        
-        char *st, *fi;
-        st=pch+5;fi = strchr(st, ',');   mystrcpy(buf, st, fi);  x = atof(buf);
-        st=fi+1; fi = strchr(st, ',');   mystrcpy(buf, st, fi);  y = atof(buf);
-        st=fi+1;                                                 z = atof(st);
-        mpos = startsWith(pch, "MPos");
-        //GD_DEBUGF("Parsed Pos: %f %f %f\n", x,y,z);
-
-        // FS:500,8000 or F:500    
-        pch = strtok(nullptr, "|"); 
-        while(pch!=nullptr) {
-        
-            if( startsWith(pch, "FS:") || startsWith(pch, "F:")) {
-                if(pch[1] == 'S') {
-                    st=pch+3; fi = strchr(st, ','); mystrcpy(buf, st, fi);  feed = atoi(buf);
-                    st=fi+1;  spindleVal = atoi(st);
-                } else {
-                    feed = atoi(pch+2);
-                }
-            } else 
-            if(startsWith(pch, "WCO:")) {
-                st=pch+4;fi = strchr(st, ',');   mystrcpy(buf, st, fi);  ofsX = atof(buf);
-                st=fi+1; fi = strchr(st, ',');   mystrcpy(buf, st, fi);  ofsY = atof(buf);
-                st=fi+1;                                                 ofsZ = atof(st);
-                //GD_DEBUGF("Parsed WCO: %f %f %f\n", ofsX, ofsY, ofsZ);
-            }
+        StatusReport r = report; 
+        r.lineNumber = -1;
+        r.pins[0] = 0;
+        r.accessories[0] = 0;
+        float pos[3] = {x, y, z};
+        bool wpos = false;
 
-            pch = strtok(nullptr, "|"); 
+        // idle/jogging
+        const char *f = v;
+        size_t n = strcspn(f, "|>");
+        if(n==0) return;
+        copyField(r.state, sizeof(r.state), f, n);
+        f += n;
 
+        while(*f=='|') {
+            f++;
+            n = strcspn(f, "|>");
+            long t[3];
+            if(startsWith(f, "MPos:")) { 
+                parseList(f+5, pos, 3); 
+            } else if(startsWith(f, "WPos:")) { 
+                parseList(f+5, pos, 3); 
+                wpos = true; 
+            } else if(startsWith(f, "WCO:")) {
+                parseList(f+4, r.wco, 3);
+            } else if(startsWith(f, "FS:")) { // FS:500,8000
+                if(parseList(f+3, t, 2)==2) { r.feed = t[0]; r.spindle = t[1]; }
+            } else if(startsWith(f, "F:")) {  // F:500
+                if(parseList(f+2, t, 1)==1) r.feed = t[0];
+            } else if(startsWith(f, "Bf:")) {
+                if(parseList(f+3, t, 2)==2) { r.plannerFree = t[0]; r.rxFree = t[1]; }
+            } else if(startsWith(f, "Ln:")) {
+                if(parseList(f+3, t, 1)==1) r.lineNumber = t[0];
+            } else if(startsWith(f, "Ov:")) {
+                if(parseList(f+3, t, 3)==3) { r.ovFeed = t[0]; r.ovRapid = t[1]; r.ovSpindle = t[2]; }
+            } else if(startsWith(f, "Pn:")) {
+                copyField(r.pins, sizeof(r.pins), f+3, n-3);
+            } else if(startsWith(f, "A:")) {
+                copyField(r.accessories, sizeof(r.accessories), f+2, n-2);
+            }
+            f += n;
         }
-        
-        if(!mpos) {
-            x -= ofsX; y -= ofsY; z -= ofsZ;
+
+        // x,y,z are kept in machine coordinates
+        if(wpos) {
+            for(int i=0; i<3; i++) pos[i] += r.wco[i];
         }
+        x = pos[0]; y = pos[1]; z = pos[2];
+        report = r;
+        statusReceived();
         
-        notify_observers(DeviceStatusEvent{0});
+        post(DEV_POSITION | DEV_STATUS);
     }
-
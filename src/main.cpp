@@ -3,9 +3,15 @@
 #include <SPI.h>
 #include <SD.h>
 #include <U8g2lib.h>
+#include <driver/pcnt.h>
 
 #include "devices/GCodeDevice.h"
 #include "Job.h"
+#include "JobQueue.h"
+#include "SDScheduler.h"
+#include "DirIndex.h"
+#include "MemoryPool.h"
+#include "Stats.h"
 #include "ui/FileChooser.h"
 #include "ui/DRO.h"
 #include "ui/GrblDRO.h"
@@ -30,6 +36,12 @@ HardwareSerial PrinterSerial(2);
 #define PIN_ENC1 26
 #define PIN_ENC2 27
 
+#define ENC_PCNT_UNIT      PCNT_UNIT_0
+#define ENC_PCNT_FILTER    1023  // APB clocks, ~12.8us; the widest glitch filter PCNT has
+#define BUTTON_DEBOUNCE    10    // ms
+
+#define UI_NOTIFY_INTERVAL 100  // ms, display is marked dirty at most this often, errors are shown at once
+
 #define PIN_CE_SD  5
 #define PIN_CE_LCD  4
 #define PIN_RST_LCD 22
@@ -56,24 +68,32 @@ DRO *dro;
 Mode cMode = Mode::DRO;
 
 
-void encISR();
-void bt1ISR();
-void bt2ISR();
-void bt3ISR();
-
-bool detectPrinterAttempt(uint32_t speed, uint8_t type);
-void detectPrinter();
+void encoderBegin();
+void readPots();
+void readEncoder();
+void readButtons();
 
 void deviceLoop(void* );
 TaskHandle_t deviceTask;
 
+template<class D> void runDevice(D *d);
+
 void wifiLoop(void * );
 TaskHandle_t wifiTask;
 
+void uiLoop(void * );
+TaskHandle_t uiTask;
+
+/** File selected in UI task, started by the loop that feeds the job */
+char pendingJobFile[128];
+bool pendingJob = false;
+portMUX_TYPE pendingJobMux = portMUX_INITIALIZER_UNLOCKED;
+
 
 void setup() {
 
     Serial.begin(115200);
+    Stats::reset();
 
     pinMode(PIN_BT1, INPUT_PULLUP);
     pinMode(PIN_BT2, INPUT_PULLUP);
@@ -82,10 +102,7 @@ void setup() {
     pinMode(PIN_ENC1, INPUT_PULLUP);
     pinMode(PIN_ENC2, INPUT_PULLUP);
 
-    attachInterrupt(PIN_ENC1, encISR, CHANGE);
-    attachInterrupt(PIN_BT1, bt1ISR, CHANGE);
-    attachInterrupt(PIN_BT2, bt2ISR, CHANGE);
-    attachInterrupt(PIN_BT3, bt3ISR, CHANGE);
+    encoderBegin();
 
     u8g2_.begin();
     u8g2_.setBusClock(600000);
@@ -105,13 +122,21 @@ void setup() {
         while (1);
     }
     Serial.println("initialization done.");
+    SDScheduler::begin();
+    DirIndex::begin();
+    JobQueue::begin(); // before web server may edit it
 
-    DynamicJsonDocument cfg(512);
+    DynamicJsonDocument cfg(1536);
     File file = SD.open("/config.json");
     DeserializationError error = deserializeJson(cfg, file);
     if (error)  Serial.println(F("Failed to read file, using default configuration"));
  
+    MemoryPool::config( cfg["memory"].as<JsonObjectConst>() );
+    MemoryPool::begin(); // before devices, job and web server take their buffers
     server.config( cfg["web"].as<JsonObjectConst>() );
+    GrblDevice::config( cfg["device"]["grbl"].as<JsonObjectConst>() );
+    MarlinDevice::config( cfg["device"]["marlin"].as<JsonObjectConst>() );
+    Display::config( cfg["ui"].as<JsonObjectConst>() );
     server.add_observer(display);
 
 
@@ -123,7 +148,9 @@ void setup() {
     
     
     job = Job::getJob();
-    job->add_observer( display );
+    job->begin();
+    job->add_observer( display, Job::ALL_FIELDS, UI_NOTIFY_INTERVAL );
+    job->add_observer( server, Job::ALL_FIELDS, PUSH_INTERVAL );
 
     //dro.config(cfg["menu"].as<JsonObjectConst>() );
 
@@ -131,8 +158,10 @@ void setup() {
     fileChooser.setCallback( [&](bool res, String path){
         if(res) {
             DEBUGF("Starting job %s\n", path.c_str() );
-            job->setFile(path);            
-            job->start();
+            portENTER_CRITICAL(&pendingJobMux);
+            strncpy(pendingJobFile, path.c_str(), sizeof(pendingJobFile)-1);
+            pendingJob = true;
+            portEXIT_CRITICAL(&pendingJobMux);
             
             Display::getDisplay()->setScreen(dro); // select file
         } else {
@@ -142,6 +171,8 @@ void setup() {
 
     file.close();
 
+    xTaskCreatePinnedToCore(uiLoop, "UiTask", 
+        4096, nullptr, 1, &uiTask, 0); // cpu0, below BlockReader; keeps LCD transfers off the job feeding loop
     
 }
 
@@ -149,17 +180,14 @@ void setup() {
 void deviceLoop(void* pvParams) {
     PrinterSerial.begin(115200);
     PrinterSerial.setTimeout(1000);
-    dev = DeviceDetector::detectPrinterAttempt(PrinterSerial, 115200, 1); 
-    if(dev==nullptr ) {
-        dev = DeviceDetector::detectPrinter(PrinterSerial);
-    }
+    dev = DeviceDetector::detectPrinter(PrinterSerial);
     
     //GCodeDevice::setDevice(dev);
-    dev->add_observer( *job );
-    dev->add_observer(display);
+    dev->add_observer( *job, DEV_ERROR );
+    dev->add_observer(display, GCodeDevice::ALL_FIELDS, UI_NOTIFY_INTERVAL);
+    dev->add_observer(server, GCodeDevice::ALL_FIELDS, PUSH_INTERVAL);
     //dev->add_observer(dro);  // dro.setDevice(dev);
     //dev->add_observer(fileChooser);
-    dev->addReceivedLineHandler( [](const char* d, size_t l) {server.resendDeviceResponse(d,l);} );
     dev->begin();
 
     if(dev->getType() == "grbl") {
@@ -168,15 +196,41 @@ void deviceLoop(void* pvParams) {
     dro->begin( );
 
     display.setScreen(dro);
-   
+
+    // type is fixed from now on, the loop is compiled for it
+    if(dev->getType() == "grbl") runDevice( static_cast<GrblDevice*>(dev) );
+    else runDevice( static_cast<MarlinDevice*>(dev) );
+    vTaskDelete( NULL );
+}
+
+template<class D> void runDevice(D *d) {
     while(1) {
-        dev->loop();
+        { STATS_SCOPE(DEVICE_TASK); d->run(); }
+        d->waitForEvent();
     }
-    vTaskDelete( NULL );
+}
+
+void deviceLineReceived(const char* line, size_t len) {
+    server.resendDeviceResponse(line, len);
 }
 
 void wifiLoop(void* args) {
     server.begin();
+    server.pushLoop();
+    vTaskDelete( NULL );
+}
+
+/** Input and rendering; draws from device and job snapshots, frame rate is capped by Display */
+void uiLoop(void* args) {
+    while(1) {
+        readPots();    
+        readEncoder();
+        readButtons();
+
+        { STATS_SCOPE(UI_TASK); display.loop(); }
+
+        vTaskDelay( pdMS_TO_TICKS(10) );
+    }
     vTaskDelete( NULL );
 }
 
@@ -186,11 +240,22 @@ void readPots() {
 }
 
 void loop() {
-    readPots();    
-
-    job->loop();
+    if(pendingJob) {
+        char path[sizeof(pendingJobFile)];
+        portENTER_CRITICAL(&pendingJobMux);
+        memcpy(path, pendingJobFile, sizeof(path));
+        pendingJob = false;
+        portEXIT_CRITICAL(&pendingJobMux);
+        if(job->isRunning()) { 
+            JobQueue::add(path); // runs right after the current one
+            JobQueue::start();
+        } else {
+            job->setFile(path);            
+            job->start();
+        }
+    }
 
-    display.loop();
+    { STATS_SCOPE(JOB_TASK); job->loop(); JobQueue::loop(); }
 
     if(dev==nullptr) return;
 
@@ -208,46 +273,53 @@ void loop() {
 }
 
 
-IRAM_ATTR void encISR() {
-    static int lastV1=0;
-    static unsigned int lastISRTime = millis();
-    if(millis()<lastISRTime+2) return;
-
-    int v1 = digitalRead(PIN_ENC1);
-    int v2 = digitalRead(PIN_ENC2);
-    if(v1==HIGH && lastV1==LOW) {
-        if(v2==HIGH) Display::encVal++; else Display::encVal--;
-    }
-    if(v1==LOW && lastV1==HIGH) {
-        if(v2==LOW) Display::encVal++; else Display::encVal--;
-    }
-    //log_printf("%d, %d\n", v1,v2);
-    //log_printf("%d, %d,  %3d\n", v1,v2,Display::encVal);
-    lastV1 = v1;
-}
-
-
-IRAM_ATTR void btChanged(uint8_t button, uint8_t val) {
-    Display::buttonPressed[button] = val==LOW;
+/**
+ * Encoder is decoded by PCNT: ENC1 edges are counted, ENC2 level gives direction.
+ * Same counting as the former ISR: both edges of ENC1, so 2 counts per encoder cycle.
+ */
+void encoderBegin() {
+    pcnt_config_t cfg = {};
+    cfg.pulse_gpio_num = PIN_ENC1;
+    cfg.ctrl_gpio_num = PIN_ENC2;
+    cfg.pos_mode = PCNT_COUNT_INC;      // rising edge of ENC1
+    cfg.neg_mode = PCNT_COUNT_DEC;      // falling edge
+    cfg.hctrl_mode = PCNT_MODE_KEEP;    
+    cfg.lctrl_mode = PCNT_MODE_REVERSE; // ENC2 low: opposite direction
+    cfg.counter_h_lim = INT16_MAX;
+    cfg.counter_l_lim = INT16_MIN;
+    cfg.unit = ENC_PCNT_UNIT;
+    cfg.channel = PCNT_CHANNEL_0;
+    pcnt_unit_config(&cfg);
+
+    pcnt_set_filter_value(ENC_PCNT_UNIT, ENC_PCNT_FILTER);
+    pcnt_filter_enable(ENC_PCNT_UNIT);
+
+    pcnt_counter_pause(ENC_PCNT_UNIT);
+    pcnt_counter_clear(ENC_PCNT_UNIT);
+    pcnt_counter_resume(ENC_PCNT_UNIT);
 }
 
-IRAM_ATTR void bt1ISR() {
-    static long lastChangeTime = millis();
-    if(millis() < lastChangeTime+10) return;
-    lastChangeTime = millis();
-    btChanged(0, digitalRead(PIN_BT1) );
-}
-
-IRAM_ATTR void bt2ISR() {
-    static long lastChangeTime = millis();
-    if(millis() < lastChangeTime+10) return;
-    lastChangeTime = millis();
-    btChanged(1, digitalRead(PIN_BT2) );
+void readEncoder() {
+    static int16_t last = 0;
+    int16_t v;
+    if(pcnt_get_counter_value(ENC_PCNT_UNIT, &v) != ESP_OK) return;
+    Display::encVal += (int16_t)(v - last);
+    last = v;
+    // keep away from the limit, where the counter resets. Counts between read and clear are lost, it's a few us
+    if(v > 16000 || v < -16000) {
+        pcnt_counter_clear(ENC_PCNT_UNIT);
+        last = 0;
+    }
 }
 
-IRAM_ATTR void bt3ISR() {
-    static long lastChangeTime = millis();
-    if(millis() < lastChangeTime+10) return;
-    lastChangeTime = millis();
-    btChanged(2, digitalRead(PIN_BT3) );
+void readButtons() {
+    static const uint8_t PINS[] = {PIN_BT1, PIN_BT2, PIN_BT3};
+    static bool lastRaw[3];
+    static uint32_t changeTime[3];
+    uint32_t now = millis();
+    for(int i=0; i<3; i++) {
+        bool raw = digitalRead(PINS[i])==LOW;
+        if(raw != lastRaw[i]) { lastRaw[i] = raw; changeTime[i] = now; continue; }
+        if(now-changeTime[i] >= BUTTON_DEBOUNCE) Display::buttonPressed[i] = raw;
+    }
 }
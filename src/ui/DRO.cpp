@@ -5,8 +5,8 @@
         const int LEN = 20;
         char str[LEN];
 
-        GCodeDevice *dev = GCodeDevice::getDevice();
-        if(dev==nullptr) return;
+        const DeviceSnapshot &dev = Display::getDisplay()->deviceState();
+        if(dev.type==0) return;
 
         U8G2 &u8g2 = Display::u8g2;
 
@@ -20,12 +20,13 @@
 
         u8g2.setDrawColor(2);
 
-        drawAxis('X', dev->getX(), y); y+=h;
-        drawAxis('Y', dev->getY(), y); y+=h;
-        drawAxis('Z', dev->getZ(), y); y+=h;        
+        drawAxis('X', dev.x, y); y+=h;
+        drawAxis('Y', dev.y, y); y+=h;
+        drawAxis('Z', dev.z, y); y+=h;        
 
         y+=5;
         u8g2.setFont( u8g2_font_nokiafc22_tr   );
+        if(overrideMode) { drawOverrides(y); return; }
         float m = distVal(cDist);
         snprintf(str, LEN, m<1 ? "x%.1f" : "x%.0f", m );
         u8g2.drawStr(0, y, str);
@@ -53,7 +54,7 @@
         int rangeH = rangeL + l + 2*d;
         if(v<rangeL && var>0    ) { var--; ch=true; }
         if(v>rangeH && var<p.N-1) { var++; ch=true; }
-        if(ch && pot==0) lastJogTime=0;
+        if(ch) { jogTicks = 0; ovTicks = 0; } // ticks were for another axis or multiplier
          if(ch) {
             //S_DEBUGF("changed pot: axis:%d dist:%d, pot%d=%d\n", (int)cAxis, (int)cDist, pot, v);
             setDirty();
@@ -70,18 +71,72 @@
         switch(bt) {
             case Button::ENC_UP:
             case Button::ENC_DOWN: {
+                if(overrideMode) { ovTicks += arg; break; }
                 if(! dev->canJog() ) return;
-                float f=0;
-                float d = distVal(cDist)*arg;
-                if( lastJogTime!=0) { f = d / (millis()-lastJogTime) * 1000*60; };
-                if(f<500) f=500;
-                //S_DEBUGF("jog af %d, dt=%d ms, delta=%d\n", (int)f, millis()-lastJog, arg);
-                bool r = dev->jog( (int)cAxis, d, (int)f );
-                lastJogTime = millis();
-                if(!r) S_DEBUGF("Could not schedule jog\n");
-                setDirty();
+                if(jogTicks==0) jogWindowStart = millis();
+                jogTicks += arg;
+                lastTickTime = millis();
                 break;
             }
             default: break;
         }
     };
+
+    void DRO::processOverride() {
+        GCodeDevice *dev = GCodeDevice::getDevice();
+        if(dev==nullptr || ovTicks==0) return;
+        DeviceOverride o = overrideAt(cAxis, Display::getDisplay()->deviceState().type);
+        if(o!=N_OVERRIDES) dev->adjustOverride(o, ovTicks*overrideStep(cDist) );
+        ovTicks = 0;
+        dev->watchStatus(GCodeDevice::WATCH_JOG, FAST_STATUS_INTERVAL, JOG_WATCH_HOLD); // to show the new value
+        setDirty();
+    }
+
+    void DRO::drawOverrides(int y) {
+        static const char NAMES[N_OVERRIDES] = {'F', 'R', 'S', 'E'};
+        const DeviceSnapshot &dev = Display::getDisplay()->deviceState();
+        U8G2 &u8g2 = Display::u8g2;
+        DeviceOverride sel = overrideAt(cAxis, dev.type);
+        const int LEN = 8;
+        char str[LEN];
+        int x = 0;
+        for(int o=0; o<N_OVERRIDES; o++) {
+            if(dev.overrides[o]==0) continue;
+            snprintf(str, LEN, "%c%d", NAMES[o], dev.overrides[o]);
+            int w = u8g2.getStrWidth(str);
+            u8g2.drawStr(x+1, y, str);
+            if(o==sel) u8g2.drawFrame(x, y-1, w+2, u8g2.getAscent()-u8g2.getDescent()+2);
+            x += w+4;
+        }
+        snprintf(str, LEN, "%+d%%", overrideStep(cDist) );
+        u8g2.drawStr(x+1, y, str);
+    }
+
+    void DRO::processJog() {
+        GCodeDevice *dev = GCodeDevice::getDevice();
+        if(dev==nullptr) return;
+        uint32_t now = millis();
+
+        if(jogTicks!=0 && now-jogWindowStart >= JOG_WINDOW && dev->canJogSegment() ) {
+            // feed is chosen so the segment takes about as long as its ticks took to come
+            float d = distVal(cDist)*jogTicks;
+            float f = fabs(d) * 60000 / (now-jogWindowStart);
+            if(f<JOG_MIN_FEED) f = JOG_MIN_FEED;
+            if(f>JOG_MAX_FEED) f = JOG_MAX_FEED;
+            float maxD = (float)JOG_MAX_FEED * JOG_MAX_SEGMENT / 60000;
+            if(d>maxD) d = maxD;
+            if(d<-maxD) d = -maxD;
+            //S_DEBUGF("jog %d ticks, d=%.3f f=%d\n", jogTicks, d, (int)f);
+            if( dev->jog( (int)cAxis, d, (int)f ) ) {
+                jogTicks = 0;
+                jogging = true;
+                dev->watchStatus(GCodeDevice::WATCH_JOG, FAST_STATUS_INTERVAL, JOG_WATCH_HOLD);
+                setDirty();
+            } else S_DEBUGF("Could not schedule jog\n");
+        }
+
+        if(jogging && jogTicks==0 && now-lastTickTime > JOG_STOP_TIMEOUT) {
+            dev->jogStop();
+            jogging = false;
+        }
+    }
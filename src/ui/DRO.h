@@ -25,7 +25,7 @@ using JogDist = int;
 class DRO: public Screen {
 public:
 
-    DRO(): nextRefresh(1) {}
+    DRO(): refresh(false), jogTicks(0), jogging(false), overrideMode(false), ovTicks(0) {}
     
     void begin() override {
         /*
@@ -33,23 +33,27 @@ public:
         menuItems.push_back("xReset");
         menuItems.push_back("uUpdate");
         */
+        enableRefresh(true);
+        // handwheel adjusts the override picked by the axis selector instead of jogging
+        menuItems.push_back(MenuItem{6, '%', true, false, nullptr,
+          [this](MenuItem&){ jogTicks = 0; overrideMode = true; setDirty(); },
+          [this](MenuItem&){ ovTicks = 0; overrideMode = false; setDirty(); }
+        } );
     };
 
+    /** Status is polled by the device, DRO only registers as a watcher */
+    void enableRefresh(bool r) { 
+        refresh = r;
+        GCodeDevice *dev = GCodeDevice::getDevice();
+        if (dev!=nullptr) dev->watchStatus(GCodeDevice::WATCH_UI, r ? STATUS_REQUEST_INTERVAL : 0);
+    }
+    bool isRefreshEnabled() { return refresh; }
+
     void loop() override {
         Screen::loop();
-        if(nextRefresh!=0 && millis()>nextRefresh) {
-            nextRefresh = millis() + 500;
-            GCodeDevice *dev = GCodeDevice::getDevice();
-            if (dev!=nullptr) {
-                dev->requestStatusUpdate();
-                //setDirty();
-            }
-        }
+        if(overrideMode) processOverride(); else processJog();
     }
 
-    void enableRefresh(bool r) { nextRefresh = r?millis() : 0;  }
-    bool isRefreshEnabled() { return nextRefresh!=0; }
-
 /*
     void config(JsonObjectConst cfg) {
         for (JsonPairConst kv : cfg) {
@@ -90,8 +94,38 @@ protected:
 
     JogAxis cAxis;
     JogDist cDist;
-    uint32_t nextRefresh;
-    uint32_t lastJogTime;
+    static const uint32_t JOG_WINDOW = 50;          ///< ms, encoder ticks are coalesced into one segment this long
+    static const uint32_t JOG_STOP_TIMEOUT = 300;   ///< ms without ticks to cancel the jog
+    static const uint32_t JOG_MAX_SEGMENT = 200;    ///< ms, longest segment at max feed; ticks above it are dropped
+    static const int JOG_MIN_FEED = 500;
+    static const int JOG_MAX_FEED = 3000;
+
+    bool refresh;
+
+    int jogTicks;           ///< encoder ticks not sent yet
+    uint32_t jogWindowStart;
+    uint32_t lastTickTime;
+    bool jogging;
+
+    bool overrideMode;
+    int ovTicks;            ///< encoder ticks not applied yet
+
+    void processJog();
+
+    void processOverride();
+
+    /** Override adjusted in override mode, by axis selector position; N_OVERRIDES if there is none */
+    static DeviceOverride overrideAt(const JogAxis &a, char devType) {
+        static const DeviceOverride GRBL[] = {OV_FEED, OV_RAPID, OV_SPINDLE};
+        static const DeviceOverride MARLIN[] = {OV_FEED, OV_FLOW, N_OVERRIDES};
+        return devType=='g' ? GRBL[a] : MARLIN[a];
+    }
+
+    /** Percent per encoder tick, by multiplier selector position */
+    static int overrideStep(const JogDist &d) { return d==0 ? 1 : d==1 ? 5 : 10; }
+
+    /** Override values with the selected one in a frame */
+    void drawOverrides(int y);
 
     
     static char axisChar(const JogAxis &a) {
@@ -1,6 +1,8 @@
 #include "Display.h"
 
 #include "Screen.h"
+#include "StatsScreen.h"
+#include "../SDScheduler.h"
 
 #define D_DEBUGF(...)  { Serial.printf(__VA_ARGS__); }
 #define D_DEBUGFI(...)  { log_printf(__VA_ARGS__); }
@@ -8,6 +10,10 @@
 
 Display * Display::inst = nullptr;
 
+#ifdef STATS_ENABLED
+static StatsScreen statsScreen;
+#endif
+
 
 bool Display::buttonPressed[3] = {false};
 int Display::potVal[2] = {0};
@@ -16,6 +22,10 @@ int Display::encVal = 0;
 
     Display* Display::getDisplay() { return inst; }
 
+    void Display::config(JsonObjectConst cfg) {
+        if(inst!=nullptr && !cfg["fps"].isNull()) inst->setFrameRate( cfg["fps"].as<uint32_t>() );
+    }
+
     void Display::setScreen(Screen *screen) { 
         if(cScreen != nullptr) cScreen->onHide();
         cScreen = screen; 
@@ -26,6 +36,10 @@ int Display::encVal = 0;
 
 
     void Display::loop() {
+        GCodeDevice *dev = GCodeDevice::getDevice();
+        if(dev!=nullptr) devState = dev->getSnapshot(); else devState.type = 0;
+        jobSnapshot = Job::getJob()->getSnapshot();
+
         processInput();
         if(cScreen!=nullptr) cScreen->loop();
         draw();
@@ -63,6 +77,15 @@ int Display::encVal = 0;
         static bool lastButtPressed[3];
         static const Button buttons[] = {Button::BT1, Button::BT2, Button::BT3};
         if (cScreen == nullptr) return;
+#ifdef STATS_ENABLED
+        // BT1+BT3 together toggle the stats screen
+        if(buttonPressed[0] && buttonPressed[2] && !(lastButtPressed[0] && lastButtPressed[2]) ) {
+            if(cScreen==&statsScreen) setScreen(statsReturn);
+            else { statsReturn = cScreen; setScreen(&statsScreen); }
+            for(int bt=0; bt<3; bt++) lastButtPressed[bt] = buttonPressed[bt];
+            return;
+        }
+#endif
         for(int bt=0; bt<3; bt++) {
             bool p = buttonPressed[bt];
             if(lastButtPressed[bt] != p) {
@@ -103,6 +126,11 @@ int Display::encVal = 0;
 
     void Display::draw() {
         if(!dirty) return;
+        uint32_t now = millis();
+        if(now-lastDrawTime < frameInterval) return; // stays dirty till the next frame
+        lastDrawTime = now;
+        STATS_SCOPE(DRAW);
+
         u8g2.clearBuffer();
         if(cScreen!=nullptr) cScreen->drawContents();
         drawStatusBar();
@@ -112,10 +140,43 @@ int Display::encVal = 0;
         //char str[15]; sprintf(str, "%4d %4d", potVal[0], potVal[1] ); u8g2.drawStr(5,110, str);
         char str[15]; sprintf(str, "%d", encVal ); u8g2.drawStr(5,110, str);
 
-        u8g2.sendBuffer();
+        sendChangedTiles();
         dirty = false;
     }
 
+    void Display::sendChangedTiles() {
+        uint8_t *buf = u8g2.getBufferPtr();
+        const int tw = u8g2.getBufferTileWidth(), th = u8g2.getBufferTileHeight();
+        const size_t size = tw*th*8;
+
+        // LCD and SD card share the SPI bus, transfers are kept short so job reads aren't held up
+        if(shadowBuffer==nullptr) {
+            { SDScheduler::BusLock bus; u8g2.sendBuffer(); }
+            shadowBuffer = (uint8_t*)malloc(size);
+            if(shadowBuffer!=nullptr) memcpy(shadowBuffer, buf, size);
+            return;
+        }
+
+        // ST7920 buffer is horizontal: a row of 8 pixels per byte, tile row r, line l, tile tx is at (r*8+l)*tw+tx.
+        // Tiles are in display orientation, so rotation doesn't matter here.
+        for(int r=0; r<th; r++) {
+            int x0=-1, x1=-1;
+            for(int tx=0; tx<tw; tx++) {
+                for(int l=0; l<8; l++) {
+                    size_t i = (r*8+l)*tw + tx;
+                    if(buf[i] != shadowBuffer[i]) { if(x0<0) x0 = tx; x1 = tx; break; }
+                }
+            }
+            if(x0<0) continue;
+            // ST7920 is addressed in 16 pixel words
+            x0 &= ~1;
+            int w = ((x1+2) & ~1) - x0;
+            SDScheduler::BusLock bus;
+            u8g2.updateDisplayArea(x0, r, w, 1);
+        }
+        memcpy(shadowBuffer, buf, size);
+    }
+
     void Display::drawStatusBar() {
 
         u8g2.setFont(u8g2_font_5x8_tr);
@@ -123,23 +184,23 @@ int Display::encVal = 0;
 
         char c;
         // device status
-        GCodeDevice *dev = GCodeDevice::getDevice();
-        if(dev==nullptr) c='?';
+        const DeviceSnapshot &dev = deviceState();
+        if(dev.type==0) c='?';
         else {
-            c = dev->getType().charAt(0);
-            if(dev->isConnected() ) c=toupper(c); else c=tolower(c);
-            if(dev->isInPanic() ) c='!';            
+            c = dev.type;
+            if(dev.connected ) c=toupper(c); else c=tolower(c);
+            if(dev.panic ) c='!';            
         }
         u8g2.drawGlyph(0,0, c);
 
         // job status
-        Job *job = Job::getJob();
+        const JobSnapshot &job = jobState();
         char str[20];
-        if(job->isValid() ) {
-            float p = job->getCompletion()*100;
+        if(job.valid ) {
+            float p = job.completion*100;
             if(p<10) snprintf(str, 20, " %.1f%%", p );
             else snprintf(str, 20, " %d%%", (int)p );
-            if(job->isPaused() ) str[0] = '|';
+            if(job.paused ) str[0] = '|';
         } else strncpy(str, " ---%", 20);
         int w = u8g2.getStrWidth(str);
         u8g2.drawStr(u8g2.getWidth()-w, 0, str);
@@ -40,6 +40,7 @@ public:
     static int encVal;
     static int potVal[2];
     static const int STATUS_BAR_HEIGHT = 9;
+    static const uint32_t DEFAULT_FPS = 10;
 
     Display() { 
         assert(inst==nullptr);
@@ -48,7 +49,7 @@ public:
 
     void setDirty(bool fdirty=true) { dirty=fdirty; }
 
-    void notification(JobStatusEvent e) override {
+    void notification(const JobStatusEvent &e) override {
         setDirty();
     }
     void notification(const DeviceStatusEvent &e) override {
@@ -68,6 +69,15 @@ public:
 
     static Display *getDisplay();
 
+    /** Reads "fps" - frame rate ceiling */
+    static void config(JsonObjectConst cfg);
+
+    void setFrameRate(uint32_t fps) { frameInterval = fps>0 ? 1000/fps : 0; }
+
+    /** Device and job state captured at the start of the current frame */
+    const DeviceSnapshot & deviceState() const { return devState; }
+    const JobSnapshot & jobState() const { return jobSnapshot; }
+
 
 private:
 
@@ -79,6 +89,16 @@ private:
 
     int selMenuItem=0;
 
+    uint32_t lastDrawTime = 0;
+    uint32_t frameInterval = 1000/DEFAULT_FPS; ///< ms, frame rate cap
+
+    DeviceSnapshot devState = {};
+    JobSnapshot jobSnapshot = {};
+    uint8_t *shadowBuffer = nullptr; ///< what's on the LCD now, to send only changed tiles
+    Screen *statsReturn = nullptr;   ///< screen to go back to from the stats screen
+
+    void sendChangedTiles();
+
     void processInput();
 
     void processEnc();
@@ -1,61 +1,42 @@
 #include "FileChooser.h"
 
 
-    bool FileChooser::isGCode(const String &s) {
-        int p = s.lastIndexOf('.');
-        if(p==-1) return true; // files without extension can be printed
-        String ext = s.substring(p+1); ext.toLowerCase();
-        return (ext=="gcode" || ext=="nc" || ext=="gc" || ext=="gco");
-    }
-
-    void FileChooser::loadDirContents(File newDir, int startingIndex) {
-        if(!newDir) return;
-        //FC_DEBUGF("loadDirContents dir %s\n", newDir.name() );
-        if( !cDir || strcmp(cDir.name(), newDir.name())!=0 ) {
-            cDir = newDir;
-            //FC_DEBUGF("loadDirContents opening new dir %s\n", cDir.name() );
-        }
+    void FileChooser::loadDirContents(const String &dir) {
+        if(dir!=cDir) { selLine = 0; cDir = dir; }
         topLine = 0;
-        File file;
-        files.clear();
-        cDir.rewindDirectory();
-        int i=0;
-        while ( file = cDir.openNextFile() ) {
-            if(i>=startingIndex && i<startingIndex+MAX_FILES) {
-                String name = file.name();
-                int p = name.lastIndexOf('/');  if(p>=0) name = name.substring(p+1);
-
-                if(file.isDirectory() ) { 
-                    name += "/"; 
-                    files.push_back(name);
-                } else {
-                    if(isGCode(name) ) { files.push_back(name); }
-                }
-                
-                //if(i==MAX_FILES) break;
-                S_DEBUGF("loadDirContents: file %s\n", name.c_str() );
-            }
-            i++;
-            file.close();
-        }
-
-        S_DEBUGF("loadDirContents: file count %d\n", files.size() );
+        fileCount = DirIndex::list(cDir, DirIndex::GCODE, 0, 0, [](const DirIndex::Item&){});
+        if(selLine>=(int)fileCount) selLine = fileCount>0 ? fileCount-1 : 0;
+        while(selLine >= topLine+(int)VISIBLE_FILES) topLine += VISIBLE_FILES-1;
+        pageTop = -1;
+        S_DEBUGF("loadDirContents: %s, file count %d\n", cDir.c_str(), fileCount );
         setDirty();
     }
 
+    void FileChooser::loadPage() {
+        page.clear();
+        DirIndex::list(cDir, DirIndex::GCODE, topLine, VISIBLE_FILES, [this](const DirIndex::Item &it) {
+            String name = it.name;
+            if(it.isDir) name += "/";
+            page.push_back(name);
+        });
+        pageTop = topLine;
+    }
+
     void FileChooser::drawContents() {
 
         U8G2 &u8g2 = Display::u8g2;
         u8g2.setDrawColor(1);
         u8g2.setFont(u8g2_font_5x8_tr);
 
-        const char* t = cDir.name();
+        if(pageTop!=topLine) loadPage();
+
+        const char* t = cDir.c_str();
         int y = Display::STATUS_BAR_HEIGHT, h=10;
         u8g2.drawStr(1, y, t ); 
         u8g2.drawHLine(0, y+9, u8g2.getWidth() );
         y += h;
 
-        const int visibleLines = min(VISIBLE_FILES, files.size()-topLine);
+        const int visibleLines = page.size();
         for(int i=0; i<visibleLines; i++) {
             if(i+topLine == selLine) {
                 u8g2.setDrawColor( 1 );
@@ -63,7 +44,7 @@
                 u8g2.setDrawColor( 0 );
             } else u8g2.setDrawColor( 1 );
             
-            u8g2.drawStr(1, y, files[topLine+i].c_str() ); 
+            u8g2.drawStr(1, y, page[i].c_str() ); 
             y += h;
         }
         //DEBUGF("FileChooser::drawContents, topLine:%d, selLine:%d\n", topLine, selLine);
@@ -80,14 +61,14 @@
                 }
                 break;
             case Button::ENC_DOWN:
-                if(selLine<files.size()-1) {
+                if(selLine+1 < (int)fileCount) {
                     selLine++;
                     if(selLine >= topLine+VISIBLE_FILES) topLine += VISIBLE_FILES-1;
                     setDirty();
                 }
                 break;
             case Button::BT1: {
-                String newPath = cDir.name();
+                String newPath = cDir;
                 if(newPath=="/") {
                     S_DEBUGF("FileChooser::onButtonPressed(BT2): quit\n" );
                     if(returnCallback) returnCallback(false, "");
@@ -95,25 +76,25 @@
                     S_DEBUGF("FileChooser::onButtonPressed(BT2): moving up from %s\n", newPath.c_str() );
                     int p = newPath.lastIndexOf("/");
                     if(p==0) newPath="/"; else newPath = newPath.substring(0, p);
-                    selLine = 0;
-                    loadDirContents(SD.open(newPath) );
+                    loadDirContents(newPath);
                 }
                 break;
             }
             case Button::BT2: {
-                String file = files[selLine];
-                S_DEBUGF("FileChooser::onButtonPressed(BT1): dir='%s'  file='%s'\n", cDir.name(), file.c_str() );
+                if(pageTop!=topLine) loadPage();
+                if(selLine-topLine >= (int)page.size()) break; // empty directory
+                String file = page[selLine-topLine];
+                S_DEBUGF("FileChooser::onButtonPressed(BT1): dir='%s'  file='%s'\n", cDir.c_str(), file.c_str() );
                 bool isDir = file.charAt(file.length()-1) == '/';
                 if(isDir) {
                     file = file.substring(0, file.length()-1 );
                 }
-                String cDirName = cDir.name(); 
+                String cDirName = cDir; 
                 if(cDirName.charAt(cDirName.length()-1) != '/' ) cDirName+="/";
                 String newPath = cDirName+file;
                 if(isDir) {
-                    S_DEBUGF("cdir is %s, file is %s\n", cDir.name(), file.c_str() );
-                    selLine = 0;
-                    loadDirContents(SD.open(newPath), 0);
+                    S_DEBUGF("cdir is %s, file is %s\n", cDir.c_str(), file.c_str() );
+                    loadDirContents(newPath);
                 } else {
                     if(returnCallback) returnCallback(true, newPath); else  DEBUGF("no  ret callback\n");
                 }
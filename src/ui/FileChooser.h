@@ -6,6 +6,8 @@
 #include <functional>
 #include <etl/vector.h>
 
+#include "../DirIndex.h"
+
 
 class FileChooser: public Screen {
 public:
@@ -13,7 +15,7 @@ public:
     void begin() override {
         //const char* t = cDir.name();
         //FC_DEBUGF("loadDirContents: cdir is %s\n", t);
-        loadDirContents(SD.open("/") );
+        loadDirContents("/");
 
         //menuItems.push_back("xClose");
         //menuItems.push_back("yOpen");
@@ -32,20 +34,23 @@ private:
     
     int selLine;
     int topLine;
-    File cDir;
-    static const size_t MAX_FILES = 50;
+    String cDir;
+    size_t fileCount;
     static const size_t VISIBLE_FILES = 11;
-    //String files[MAX_FILES];
-    etl::vector<String, MAX_FILES> files;
+    etl::vector<String, VISIBLE_FILES> page;  ///< names from topLine, directories end with '/'
+    int pageTop;
 
-    void loadDirContents(File newDir, int startingIndex=0) ;
+    void loadDirContents(const String &dir);
 
-    bool isGCode(const String &s);
+    /** Reads visible names from DirIndex */
+    void loadPage();
 
 protected:
 
     void drawContents() override;
 
+    void onShow() override { loadDirContents(cDir); } // listing may have changed meanwhile
+
     void onButtonPressed(Button bt, int8_t arg) override;
 
 };
\ No newline at end of file
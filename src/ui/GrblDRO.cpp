@@ -6,7 +6,6 @@
 extern FileChooser fileChooser;
 
     void GrblDRO::begin() {
-        DRO::begin();
         menuItems.push_back( MenuItem::simpleItem(0, 'o', [](MenuItem&){  Display::getDisplay()->setScreen(&fileChooser); }) );
         menuItems.push_back( MenuItem::simpleItem(0, 'p', [this](MenuItem& m){   
             Job *job = Job::getJob();
@@ -28,6 +27,7 @@ extern FileChooser fileChooser;
           [](MenuItem&){  GCodeDevice::getDevice()->scheduleCommand("M3 S1"); },
           [](MenuItem&){  GCodeDevice::getDevice()->scheduleCommand("M5"); } 
         } );
+        DRO::begin(); // adds override mode after the items above
     };
 
 
@@ -35,8 +35,8 @@ extern FileChooser fileChooser;
         const int LEN = 20;
         char str[LEN];
 
-        GrblDevice *dev = static_cast<GrblDevice*>( GCodeDevice::getDevice() );
-        if(dev==nullptr) return;
+        const DeviceSnapshot &dev = Display::getDisplay()->deviceState();
+        if(dev.type==0) return;
 
         U8G2 &u8g2 = Display::u8g2;
 
@@ -47,33 +47,34 @@ extern FileChooser fileChooser;
 
         u8g2.setDrawColor(1);
         
-        if(dev->canJog())
+        if(dev.canJog)
             u8g2.drawBox(0, y+h*(int)cAxis-1, 8, h);
         else
             u8g2.drawFrame(0, y+h*(int)cAxis-1, 8, h);
 
         u8g2.setDrawColor(2);
 
-        drawAxis('X', dev->getX()-dev->getXOfs(), y); y+=h;
-        drawAxis('Y', dev->getY()-dev->getYOfs(), y); y+=h;
-        drawAxis('Z', dev->getZ()-dev->getZOfs(), y); y+=h;
+        drawAxis('X', dev.x-dev.ofs[0], y); y+=h;
+        drawAxis('Y', dev.y-dev.ofs[1], y); y+=h;
+        drawAxis('Z', dev.z-dev.ofs[2], y); y+=h;
 
         u8g2.drawHLine(0, y-1, u8g2.getWidth() );
-        if(dev->getXOfs()!=0 || dev->getYOfs()!=0 || dev->getZOfs()!=0 ) {
-            drawAxis('x', dev->getX(), y); y+=h;
-            drawAxis('y', dev->getY(), y); y+=h;
-            drawAxis('z', dev->getZ(), y); y+=h; 
+        if(dev.ofs[0]!=0 || dev.ofs[1]!=0 || dev.ofs[2]!=0 ) {
+            drawAxis('x', dev.x, y); y+=h;
+            drawAxis('y', dev.y, y); y+=h;
+            drawAxis('z', dev.z, y); y+=h; 
         } else { y += 3*h; }
 
         u8g2.drawHLine(0, y-1, u8g2.getWidth() );
 
         u8g2.setFont( u8g2_font_5x8_tr  );
 
-        snprintf(str, LEN, "F%4d S%4d", dev->getFeed(), dev->getSpindleVal() );
+        snprintf(str, LEN, "F%4d S%4d", (int)dev.feed, (int)dev.spindle );
         u8g2.drawStr(0, y, str);  y+=7;
         
+        if(overrideMode) { drawOverrides(y); return; }
         float m = distVal(cDist);
-        const char* stat = dev->isInPanic() ? dev->getLastResponse().c_str() : dev->getStatus().c_str();
+        const char* stat = dev.panic ? dev.lastResponse : dev.state;
         
         snprintf(str, LEN, m<1 ? "%c x%.1f %s" : "%c x%.0f %s", axisChar(cAxis), m, stat );
         u8g2.drawStr(0, y, str);  
@@ -0,0 +1,33 @@
+#include "StatsScreen.h"
+
+
+    void StatsScreen::drawContents() {
+        U8G2 &u8g2 = Display::u8g2;
+        const int LEN = 32;
+        char str[LEN];
+
+        u8g2.setFont( u8g2_font_5x8_tr );
+        const int h = 8;
+        int y = Display::STATUS_BAR_HEIGHT+1;
+
+        if(!Stats::isEnabled()) {
+            u8g2.drawStr(0, y, "Built without STATS_ENABLED");
+            return;
+        }
+
+        // stage, max us, load %
+        for(int i=0; i<Stats::N_STAGES; i++) {
+            Stats::Stage s = Stats::Stage(i);
+            uint32_t l = Stats::load(s);
+            snprintf(str, LEN, "%-10s%7u %3u.%u", Stats::stageName(s), (uint32_t)Stats::toUs(Stats::stage(s).maxCycles), l/10, l%10 );
+            u8g2.drawStr(0, y, str); y+=h;
+        }
+        y+=2;
+        snprintf(str, LEN, "Q %u/%u  sent %u/%u", Stats::highWater(Stats::JOB_QUEUE), Stats::highWater(Stats::PRIORITY_QUEUE),
+            Stats::highWater(Stats::SENT_LINES), Stats::highWater(Stats::SENT_BYTES) );
+        u8g2.drawStr(0, y, str); y+=h;
+        uint32_t streaming = Stats::getStreamingMs();
+        uint32_t starved = streaming!=0 ? (uint64_t)Stats::getStarvedMs()*100/streaming : 0;
+        snprintf(str, LEN, "starved %u%% of %us", starved, streaming/1000 );
+        u8g2.drawStr(0, y, str);
+    }
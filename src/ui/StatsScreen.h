@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Screen.h"
+
+#include "../Stats.h"
+
+
+/** Hidden screen with pipeline Stats, toggled by BT1+BT3. BT2 resets the counters */
+class StatsScreen: public Screen {
+public:
+
+    static const uint32_t REFRESH_INTERVAL = 500; ///< ms
+
+    StatsScreen(): lastRefresh(0) {}
+
+    void loop() override {
+        if(millis()-lastRefresh >= REFRESH_INTERVAL) { lastRefresh = millis(); setDirty(); }
+    }
+
+protected:
+
+    void drawContents() override;
+
+    void onButtonPressed(Button bt, int8_t arg) override {
+        if(bt==Button::BT2) { Stats::reset(); setDirty(); }
+    }
+
+private:
+
+    uint32_t lastRefresh;
+
+};
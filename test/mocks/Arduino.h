@@ -0,0 +1,211 @@
+#pragma once
+
+/**
+ * Arduino core of the native build, just what the streaming pipeline uses.
+ * millis()/micros() read the virtual clock of MockClock.h.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <assert.h>
+#include <string>
+#include <algorithm>
+
+#include "MockClock.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+inline uint32_t millis() { return (uint32_t)(mock::clock().us/1000); }
+inline uint32_t micros() { return (uint32_t)mock::clock().us; }
+inline void delay(uint32_t ms) { vTaskDelay(ms); }
+inline void yield() {}
+
+inline uint32_t getCpuFrequencyMhz() { return 240; }
+
+inline bool isDigit(int c) { return isdigit(c)!=0; }
+inline bool isAlpha(int c) { return isalpha(c)!=0; }
+inline bool isSpace(int c) { return isspace(c)!=0; }
+
+template<typename T, typename L, typename H>
+inline T constrain(T v, L lo, H hi) { return v<lo ? lo : v>hi ? hi : v; }
+
+using std::min;
+using std::max;
+
+
+class String {
+public:
+    String(const char* s="") : s(s!=nullptr ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    explicit String(char c) : s(1, c) {}
+    explicit String(int v) : s(std::to_string(v)) {}
+    explicit String(unsigned v) : s(std::to_string(v)) {}
+    explicit String(long v) : s(std::to_string(v)) {}
+    explicit String(unsigned long v) : s(std::to_string(v)) {}
+    explicit String(double v, unsigned decimals=2) { char b[32]; snprintf(b, sizeof(b), "%.*f", decimals, v); s = b; }
+
+    const char* c_str() const { return s.c_str(); }
+    unsigned length() const { return s.length(); }
+    bool isEmpty() const { return s.empty(); }
+    void reserve(unsigned n) { s.reserve(n); }
+
+    char charAt(unsigned i) const { return i<s.length() ? s[i] : 0; }
+    char operator[](unsigned i) const { return charAt(i); }
+    char& operator[](unsigned i) { return s[i]; }
+
+    String& operator+=(const String &o) { s += o.s; return *this; }
+    String& operator+=(const char* o) { s += o; return *this; }
+    String& operator+=(char c) { s += c; return *this; }
+    String& operator+=(int v) { s += std::to_string(v); return *this; }
+    bool concat(const String &o) { s += o.s; return true; }
+    bool concat(const char* o) { s += o; return true; }
+    bool concat(char c) { s += c; return true; }
+
+    friend String operator+(const String &a, const String &b) { return String(a.s+b.s); }
+    friend String operator+(const String &a, const char* b) { return String(a.s+b); }
+    friend String operator+(const char* a, const String &b) { return String(a+b.s); }
+
+    bool operator==(const String &o) const { return s==o.s; }
+    bool operator==(const char* o) const { return s==o; }
+    bool operator!=(const String &o) const { return s!=o.s; }
+    bool operator!=(const char* o) const { return s!=o; }
+    bool operator<(const String &o) const { return s<o.s; }
+    bool equals(const String &o) const { return s==o.s; }
+
+    bool startsWith(const String &p) const { return s.compare(0, p.s.length(), p.s)==0; }
+    bool endsWith(const String &p) const {
+        return s.length()>=p.s.length() && s.compare(s.length()-p.s.length(), p.s.length(), p.s)==0;
+    }
+    int indexOf(char c, unsigned from=0) const { return pos(s.find(c, from)); }
+    int indexOf(const String &p, unsigned from=0) const { return pos(s.find(p.s, from)); }
+    int lastIndexOf(char c) const { return pos(s.rfind(c)); }
+    int lastIndexOf(const String &p) const { return pos(s.rfind(p.s)); }
+
+    String substring(unsigned from) const { return from<s.length() ? String(s.substr(from)) : String(); }
+    String substring(unsigned from, unsigned to) const {
+        if(from>to) std::swap(from, to);
+        return from<s.length() ? String(s.substr(from, to-from)) : String();
+    }
+
+    long toInt() const { return atol(s.c_str()); }
+    float toFloat() const { return atof(s.c_str()); }
+
+    void trim() {
+        size_t b = s.find_first_not_of(" \t\r\n");
+        size_t e = s.find_last_not_of(" \t\r\n");
+        s = b==std::string::npos ? std::string() : s.substr(b, e-b+1);
+    }
+    void toLowerCase() { for(char &c: s) c = tolower(c); }
+    void toUpperCase() { for(char &c: s) c = toupper(c); }
+    void replace(const String &from, const String &to) {
+        if(from.s.empty()) return;
+        for(size_t p = s.find(from.s); p!=std::string::npos; p = s.find(from.s, p+to.s.length())) s.replace(p, from.s.length(), to.s);
+    }
+    void remove(unsigned from) { if(from<s.length()) s.erase(from); }
+    void remove(unsigned from, unsigned n) { if(from<s.length()) s.erase(from, n); }
+
+private:
+    std::string s;
+
+    static int pos(size_t p) { return p==std::string::npos ? -1 : (int)p; }
+};
+
+
+class Print {
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* b, size_t n) {
+        size_t k = 0;
+        while(k<n && write(b[k])==1) k++;
+        return k;
+    }
+    size_t write(const char* b, size_t n) { return write((const uint8_t*)b, n); }
+    size_t write(const char* s) { return write(s, strlen(s)); }
+
+    size_t print(const char* s) { return write(s); }
+    size_t print(const String &s) { return write(s.c_str(), s.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v) { return printf("%d", v); }
+    size_t print(unsigned v) { return printf("%u", v); }
+    size_t print(long v) { return printf("%ld", v); }
+    size_t print(unsigned long v) { return printf("%lu", v); }
+    size_t print(double v, int decimals=2) { return printf("%.*f", decimals, v); }
+    template<typename T> size_t println(const T &v) { return print(v) + println(); }
+    size_t println() { return write("\r\n"); }
+
+    size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        char b[256];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(b, sizeof(b), fmt, args);
+        va_end(args);
+        if(n<0) return 0;
+        return write(b, (size_t)n<sizeof(b) ? n : sizeof(b)-1);
+    }
+};
+
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+
+    void setTimeout(unsigned long ms) { timeout = ms; }
+
+    size_t readBytes(uint8_t* b, size_t n) {
+        size_t k = 0;
+        for(; k<n && available()>0; k++) b[k] = read();
+        return k;
+    }
+    size_t readBytes(char* b, size_t n) { return readBytes((uint8_t*)b, n); }
+
+protected:
+    unsigned long timeout = 1000;
+};
+
+
+/** A UART; simulated firmware implements it, so it's what DeviceDetector probes */
+class HardwareSerial : public Stream {
+public:
+    virtual void begin(unsigned long baud) { this->baud = baud; }
+    virtual void updateBaudRate(unsigned long baud) { this->baud = baud; }
+    virtual void end() {}
+    unsigned long baudRate() const { return baud; }
+
+protected:
+    unsigned long baud = 115200;
+};
+
+
+/** Serial monitor: output goes to stdout, there is no input */
+class ConsoleSerial : public HardwareSerial {
+public:
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t b) override { return fwrite(&b, 1, 1, stdout); }
+    size_t write(const uint8_t* b, size_t n) override { return fwrite(b, 1, n, stdout); }
+    using Print::write;
+};
+
+static ConsoleSerial Serial;
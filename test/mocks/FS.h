@@ -0,0 +1,99 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <time.h>
+
+/** Files in RAM; a File is a handle to shared contents, like a file open on the card */
+namespace fs {
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+struct Node {
+    std::string data;
+    time_t lastWrite = 0;
+};
+
+class File : public Stream {
+public:
+    File() {}
+    File(const String &path, std::shared_ptr<Node> node, bool append): path(path), node(node), pos(append ? node->data.size() : 0) {}
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t* b, size_t n) override {
+        if(!node) return 0;
+        std::string &d = node->data;
+        if(pos+n > d.size()) d.resize(pos+n);
+        memcpy(&d[pos], b, n);
+        pos += n;
+        node->lastWrite = (time_t)(mock::clock().us/1000000);
+        return n;
+    }
+    using Print::write;
+
+    int available() override { return node ? (int)(node->data.size()-pos) : 0; }
+    int read() override { return available()>0 ? (uint8_t)node->data[pos++] : -1; }
+    int peek() override { return available()>0 ? (uint8_t)node->data[pos] : -1; }
+    size_t read(uint8_t* b, size_t n) {
+        size_t k = std::min(n, (size_t)available());
+        if(k!=0) memcpy(b, node->data.data()+pos, k);
+        pos += k;
+        return k;
+    }
+
+    bool seek(uint32_t p, SeekMode mode=SeekSet) {
+        if(!node) return false;
+        size_t base = mode==SeekSet ? 0 : mode==SeekCur ? pos : node->data.size();
+        if(base+p > node->data.size()) return false;
+        pos = base+p;
+        return true;
+    }
+    size_t position() const { return pos; }
+    size_t size() const { return node ? node->data.size() : 0; }
+    time_t getLastWrite() const { return node ? node->lastWrite : 0; }
+    const char* name() const { return path.c_str(); }
+    bool isDirectory() const { return false; }
+
+    void close() { node.reset(); pos = 0; }
+    operator bool() const { return (bool)node; }
+
+private:
+    String path;
+    std::shared_ptr<Node> node;
+    size_t pos = 0;
+};
+
+/** Flat namespace of paths, shared by every FS object */
+class FS {
+public:
+    File open(const String &path, const char* mode="r") {
+        auto i = files().find(path.c_str());
+        if(mode[0]=='r') return i==files().end() ? File() : File(path, i->second, false);
+        std::shared_ptr<Node> &n = files()[path.c_str()];
+        if(!n || mode[0]=='w') n = std::make_shared<Node>();
+        return File(path, n, mode[0]=='a');
+    }
+    bool exists(const String &path) { return files().count(path.c_str())!=0; }
+    bool remove(const String &path) { return files().erase(path.c_str())!=0; }
+    bool rename(const String &from, const String &to) {
+        auto i = files().find(from.c_str());
+        if(i==files().end()) return false;
+        files()[to.c_str()] = i->second;
+        files().erase(from.c_str());
+        return true;
+    }
+    bool mkdir(const String&) { return true; }
+
+private:
+    static std::map<std::string, std::shared_ptr<Node> >& files() { static std::map<std::string, std::shared_ptr<Node> > m; return m; }
+};
+
+}
+
+using fs::File;
+using fs::FS;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+
+
+/**
+ * Virtual time of the native build. Nothing runs by itself: time moves only when a task waits
+ * (vTaskDelay, ulTaskNotifyTake) or a test advances it, and on every step the world hook runs
+ * simulated firmware and the other "tasks" for that much time.
+ */
+namespace mock {
+
+struct Clock {
+    uint64_t us = 0;
+    uint32_t notified = 0;            ///< pending task notification, a single task is emulated
+    uint32_t stepUs = 50;             ///< resolution of waits; a byte takes 87 us at 115200
+    std::function<void(uint32_t)> world;
+};
+
+inline Clock& clock() { static Clock c; return c; }
+
+/** Lets the world run for us. If wakeOnNotify, returns early once the task is notified */
+inline void advance(uint64_t us, bool wakeOnNotify=false) {
+    Clock &c = clock();
+    uint64_t end = c.us + us;
+    while(c.us < end) {
+        if(wakeOnNotify && c.notified!=0) return;
+        uint32_t step = end-c.us < c.stepUs ? (uint32_t)(end-c.us) : c.stepUs;
+        c.us += step;
+        if(c.world) c.world(step);
+    }
+}
+
+/** Back to time 0, with no world attached */
+inline void reset() { clock() = Clock(); }
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+
+/** NVS in RAM, shared by every namespace and kept until the process ends */
+class Preferences {
+public:
+    bool begin(const char* name, bool readOnly=false) { ns = name; return true; }
+    void end() {}
+    bool clear() { for(auto i = store().begin(); i!=store().end(); ) i = i->first.compare(0, ns.size()+1, ns+"/")==0 ? store().erase(i) : ++i; return true; }
+
+    uint32_t getUInt(const char* key, uint32_t def=0) { return get(key, def); }
+    uint8_t getUChar(const char* key, uint8_t def=0) { return get(key, def); }
+    int32_t getInt(const char* key, int32_t def=0) { return get(key, def); }
+    bool getBool(const char* key, bool def=false) { return get(key, def); }
+    size_t putUInt(const char* key, uint32_t v) { return put(key, v, 4); }
+    size_t putUChar(const char* key, uint8_t v) { return put(key, v, 1); }
+    size_t putInt(const char* key, int32_t v) { return put(key, v, 4); }
+    size_t putBool(const char* key, bool v) { return put(key, v, 1); }
+
+private:
+    std::string ns;
+
+    static std::map<std::string, int64_t>& store() { static std::map<std::string, int64_t> m; return m; }
+
+    int64_t get(const char* key, int64_t def) {
+        auto i = store().find(ns+"/"+key);
+        return i==store().end() ? def : i->second;
+    }
+    size_t put(const char* key, int64_t v, size_t size) { store()[ns+"/"+key] = v; return size; }
+};
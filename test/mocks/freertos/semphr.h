@@ -0,0 +1,17 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/** Mutexes can't be contended with one task, they only count nesting */
+
+typedef int* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new int(0); }
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new int(0); }
+inline void vSemaphoreDelete(SemaphoreHandle_t s) { delete s; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t) { (*s)++; return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s) { (*s)--; return pdTRUE; }
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t) { (*s)++; return pdTRUE; }
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s) { (*s)--; return pdTRUE; }
+inline TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t s) { return *s>0 ? xTaskGetCurrentTaskHandle() : nullptr; }
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return (TaskHandle_t)&mock::clock(); }
+
+inline TickType_t xTaskGetTickCount() { return (TickType_t)(mock::clock().us/1000); }
+
+inline void vTaskDelay(TickType_t ticks) { mock::advance((uint64_t)ticks*1000); }
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { mock::clock().notified++; return pdPASS; }
+
+/** Waits for a notification, world runs meanwhile */
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+    mock::Clock &c = mock::clock();
+    if(c.notified==0) mock::advance((uint64_t)ticks*1000, true);
+    uint32_t n = c.notified;
+    if(n!=0) c.notified = clearOnExit ? 0 : n-1;
+    return n;
+}
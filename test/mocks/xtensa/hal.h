@@ -0,0 +1,6 @@
+#pragma once
+
+#include "../MockClock.h"
+
+/** Cycle counter of a 240 MHz core, from virtual time */
+inline uint32_t xthal_get_ccount() { return (uint32_t)(mock::clock().us*240); }
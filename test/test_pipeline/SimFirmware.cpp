@@ -0,0 +1,277 @@
+#include "SimFirmware.h"
+
+
+SimFirmware::SimFirmware(const Config &cfg) : cfg(cfg) {
+    baud = cfg.baud;
+}
+
+size_t SimFirmware::write(const uint8_t* b, size_t n) {
+    wire.insert(wire.end(), b, b+n);
+    stats.hostBytes += n;
+    stats.hostWrites++;
+    return n;
+}
+
+int SimFirmware::read() {
+    if(toHost.empty()) return -1;
+    uint8_t c = toHost.front();
+    toHost.pop_front();
+    return c;
+}
+
+bool SimFirmware::isIdle() const {
+    return wire.empty() && rx.empty() && commands.empty() && planner.empty() && tx.empty();
+}
+
+void SimFirmware::step(uint32_t us) {
+    // both ends have to run at the same baud, otherwise the firmware sees noise and says nothing
+    double bytes = us * (cfg.baud/10.0) / 1e6;
+    inCredit += bytes;
+    while(inCredit>=1 && !wire.empty()) {
+        uint8_t c = wire.front();
+        wire.pop_front();
+        inCredit -= 1;
+        if(baud==cfg.baud) receive(c);
+    }
+    if(wire.empty() && inCredit>1) inCredit = 1; // an idle line doesn't bank time
+
+    takeLines();
+    parse(us);
+    run(us);
+    transmit(us);
+}
+
+void SimFirmware::receive(uint8_t c) {
+    if(isRealtime(c)) { realtime(c); return; }
+    if(rx.size()>=cfg.rxBuffer) { stats.lostBytes++; return; }
+    rx.push_back(c);
+    if(rx.size()>stats.rxHighWater) stats.rxHighWater = rx.size();
+}
+
+void SimFirmware::takeLines() {
+    while(commands.size()<cfg.commandSlots) {
+        auto eol = std::find(rx.begin(), rx.end(), '\n');
+        if(eol==rx.end()) return;
+        std::string line(rx.begin(), eol);
+        rx.erase(rx.begin(), eol+1);
+        if(!line.empty() && line.back()=='\r') line.pop_back();
+        if(!line.empty()) commands.push_back(line);
+    }
+}
+
+void SimFirmware::parse(uint32_t us) {
+    for(;;) {
+        if(commands.empty()) return;
+        if(!parsing) { parsing = true; parseLeft = cfg.okLatencyUs; }
+        if(parseLeft>us) { parseLeft -= us; return; }
+        us -= parseLeft;
+        parseLeft = 0;
+        if(!execute(commands.front())) return; // blocked, e.g. planner is full; retried on the next step
+        executed.push_back(commands.front());
+        commands.pop_front();
+        stats.lines++;
+        parsing = false;
+        takeLines();
+    }
+}
+
+void SimFirmware::run(uint32_t us) {
+    if(hold) return;
+    while(us>0 && !planner.empty()) {
+        uint32_t &left = planner.front();
+        uint32_t t = left<us ? left : us;
+        left -= t;
+        us -= t;
+        stats.runUs += t;
+        if(left==0) planner.pop_front();
+    }
+    if(planned && planner.empty()) idleUs += us;
+}
+
+void SimFirmware::transmit(uint32_t us) {
+    outCredit += us * (cfg.baud/10.0) / 1e6;
+    while(outCredit>=1 && !tx.empty()) {
+        if(baud==cfg.baud) toHost.push_back(tx.front());
+        tx.pop_front();
+        outCredit -= 1;
+    }
+    if(tx.empty() && outCredit>1) outCredit = 1;
+}
+
+void SimFirmware::reply(const std::string &line) {
+    tx.insert(tx.end(), line.begin(), line.end());
+    tx.push_back('\r');
+    tx.push_back('\n');
+}
+
+void SimFirmware::replyf(const char* fmt, ...) {
+    char b[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(b, sizeof(b), fmt, args);
+    va_end(args);
+    reply(b);
+}
+
+void SimFirmware::flushAll() {
+    wire.clear();
+    rx.clear();
+    commands.clear();
+    planner.clear();
+    parsing = false;
+    hold = false;
+}
+
+bool SimFirmware::plan(const std::string &line, uint32_t dwellScale) {
+    float target[4] = { pos[0], pos[1], pos[2], pos[3] };
+    int g = -1;
+    bool axes = false;
+    bool setsPos = false;   // G92, or another non-motion G code taking axis words
+    float p = 0;
+    bool rel = relative;
+    const char* s = line.c_str();
+    while(*s!=0) {
+        char w = toupper(*s++);
+        if(!isalpha(w)) continue;
+        char* end;
+        float v = strtof(s, &end);
+        if(end==s) continue;
+        s = end;
+        const char* axis = strchr("XYZE", w);
+        if(axis!=nullptr) {
+            int i = axis-"XYZE";
+            target[i] = rel ? target[i]+v : v;
+            axes = true;
+        } else if(w=='G') {
+            int c = (int)v;
+            if(c<=4) g = c;
+            else if(c==90) rel = false;
+            else if(c==91) rel = true;
+            else if(c!=20 && c!=21 && (c<54 || c>59)) setsPos = true;
+        } else if(w=='F') feed = v;
+        else if(w=='P') p = v;
+    }
+    relative = rel;
+    if(g>=0 && g<=3) motion = g;
+
+    if(setsPos) {
+        if(strncmp(line.c_str(), "G92", 3)==0) memcpy(pos, target, sizeof(pos));
+        return true;
+    }
+
+    uint32_t us;
+    if(g==4) {
+        us = (uint32_t)(p*dwellScale);
+    } else if(axes) {
+        float d2 = 0;
+        for(int i=0; i<3; i++) d2 += (target[i]-pos[i])*(target[i]-pos[i]);
+        float len = d2>0 ? sqrtf(d2) : fabsf(target[3]-pos[3]); // retract is E only
+        float speed = motion==0 || feed==0 ? cfg.rapidFeed : feed;
+        us = (uint32_t)(len/speed*60e6);
+    } else return true;
+
+    if(plannerFree()==0) return false;
+    uint32_t minUs = 1000000/cfg.maxBlockRate;
+    planner.push_back(us>minUs ? us : minUs);
+    memcpy(pos, target, sizeof(pos));
+    stats.blocks++;
+    if(planned) stats.starvedUs += idleUs;
+    idleUs = 0;
+    planned = true;
+    return true;
+}
+
+
+
+bool SimGrbl::isRealtime(uint8_t c) const {
+    return c=='?' || c=='!' || c=='~' || c==0x18 || c>=0x80;
+}
+
+void SimGrbl::realtime(uint8_t c) {
+    switch(c) {
+        case '?':
+            replyf("<%s|MPos:%.3f,%.3f,%.3f|Bf:%u,%u|FS:%d,0>", hold ? "Hold:0" : isRunning() ? "Run" : "Idle",
+                pos[0], pos[1], pos[2], (unsigned)plannerFree(), (unsigned)rxFree(), (int)feed);
+            break;
+        case '!': hold = true; break;
+        case '~': hold = false; break;
+        case 0x18:
+            flushAll();
+            reply("Grbl 1.1h ['$' for help]");
+            break;
+        default: break; // overrides, jog cancel
+    }
+}
+
+bool SimGrbl::execute(const std::string &line) {
+    if(line=="$I") {
+        reply("[VER:1.1h.20190825:SIM]");
+        replyf("[OPT:V,%u,%u]", (unsigned)cfg.plannerBlocks, (unsigned)cfg.rxBuffer);
+    } else if(line=="$$") {
+        replyf("$110=%.3f", cfg.rapidFeed);
+        replyf("$120=%.3f", cfg.accel);
+    } else if(line.compare(0, 3, "$J=")==0) {
+        // G91 of a jog is not modal
+        bool rel = relative;
+        int m = motion;
+        float f = feed;
+        bool ok = plan("G1 " + line.substr(3), 0);
+        relative = rel; motion = m; feed = f;
+        if(!ok) return false;
+    } else if(line[0]=='$') {
+        // settings, homing, unlock
+    } else if(line[0]=='M' && atoi(line.c_str()+1)>9 && atoi(line.c_str()+1)!=30) {
+        reply("error:20"); // unsupported command, e.g. a Marlin probe
+        return true;
+    } else if(!plan(line, 1000000)) return false;
+    reply("ok");
+    return true;
+}
+
+
+
+void SimMarlin::ok() {
+    if(advancedOk) replyf("ok P%u B%u", (unsigned)plannerFree(), (unsigned)commandsFree());
+    else reply("ok");
+}
+
+bool SimMarlin::execute(const std::string &numbered) {
+    // N<n> .. *<checksum> is accepted without checking, nothing here corrupts lines
+    std::string line = numbered;
+    if(line[0]=='N') line.erase(0, line.find(' ')!=std::string::npos ? line.find(' ')+1 : line.size());
+    if(line.find('*')!=std::string::npos) line.erase(line.find('*'));
+    if(line.empty()) { ok(); return true; }
+    if(line[0]!='G' && line[0]!='M') {
+        replyf("echo:Unknown command: \"%s\"", line.c_str());
+        ok();
+        return true;
+    }
+    int code = atoi(line.c_str()+1);
+    if(line[0]=='G') {
+        if(code==28) { memset(pos, 0, sizeof(pos)); }
+        else if(!plan(line, 1000)) return false;
+        ok();
+        return true;
+    }
+    switch(code) {
+        case 105:
+            reply("ok T:210.00 /210.00 B:60.00 /60.00 @:0 B@:0"); // M105 sends its own ok
+            return true;
+        case 114:
+            replyf("X:%.2f Y:%.2f Z:%.2f E:%.2f Count X:0 Y:0 Z:0", pos[0], pos[1], pos[2], pos[3]);
+            break;
+        case 115:
+            reply("FIRMWARE_NAME:Marlin 2.0.9 (SIM) SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin PROTOCOL_VERSION:1.0 MACHINE_TYPE:Sim EXTRUDER_COUNT:1");
+            reply("Cap:AUTOREPORT_TEMP:0");
+            replyf("Cap:ADVANCED_OK:%d", advancedOk ? 1 : 0);
+            break;
+        case 503:
+            replyf("echo:  M201 X%.2f Y%.2f Z100.00 E10000.00", cfg.accel, cfg.accel);
+            replyf("echo:  M203 X%.2f Y%.2f Z5.00 E25.00", cfg.rapidFeed/60, cfg.rapidFeed/60);
+            replyf("echo:  M204 P%.2f R%.2f T%.2f", cfg.accel, cfg.accel, cfg.accel);
+            break;
+        default: break;
+    }
+    ok();
+    return true;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+
+/**
+ * Firmware at the other end of the UART, in virtual time.
+ *
+ * Bytes written by the host take 10 bit times each to arrive. They land in an RX buffer of
+ * cfg.rxBuffer bytes; a byte that arrives while it's full is lost and counted, which is how a
+ * streaming bug shows up on a real machine. Complete lines move from RX to a command buffer of
+ * cfg.commandSlots lines (1 is Grbl's line buffer, 4 is Marlin BUFSIZE). The parser takes each
+ * command for cfg.okLatencyUs; a move then waits for a free planner block, and only after that
+ * the ok is sent. Blocks run at their feed, but never faster than cfg.maxBlockRate per second.
+ *
+ * Arcs are planned as one straight block of their chord; firmware splits them into segments,
+ * which doesn't change what the host has to send.
+ */
+class SimFirmware : public HardwareSerial {
+public:
+
+    struct Config {
+        uint32_t baud = 115200;
+        size_t rxBuffer = 128;          ///< bytes
+        size_t commandSlots = 1;        ///< lines taken from RX ahead of the parser
+        size_t plannerBlocks = 15;
+        uint32_t okLatencyUs = 100;     ///< parsing of a line, before it's planned and acknowledged
+        uint32_t maxBlockRate = 1000;   ///< blocks per second the steppers can take, however short
+        float rapidFeed = 6000;         ///< mm/min, G0 and moves without F
+        float accel = 500;              ///< mm/s2, only reported in settings
+    };
+
+    struct Counters {
+        uint32_t lines = 0;             ///< lines executed, i.e. acknowledged
+        uint32_t blocks = 0;            ///< moves and dwells planned
+        uint32_t lostBytes = 0;         ///< arrived while RX buffer was full
+        size_t rxHighWater = 0;
+        uint32_t hostBytes = 0;         ///< written by the host, realtime bytes included
+        uint32_t hostWrites = 0;        ///< write() calls of the host
+        uint64_t runUs = 0;             ///< planner was executing a block
+        uint64_t starvedUs = 0;         ///< planner was empty between its first and its last block
+    };
+
+    explicit SimFirmware(const Config &cfg);
+
+    /** Runs firmware for us; it's the world hook of MockClock */
+    void step(uint32_t us);
+
+    /** Nothing is arriving, buffered or planned */
+    bool isIdle() const;
+
+    const Counters& counters() const { return stats; }
+
+    /** Lines in the order they were executed; realtime bytes are not there */
+    const std::vector<std::string>& log() const { return executed; }
+
+    const Config& config() const { return cfg; }
+
+    // host side of the UART
+    int available() override { return (int)toHost.size(); }
+    int read() override;
+    int peek() override { return toHost.empty() ? -1 : toHost.front(); }
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t* b, size_t n) override;
+    using Print::write;
+
+protected:
+
+    Config cfg;
+    float pos[4] = {0, 0, 0, 0};  ///< X, Y, Z, E
+    bool relative = false;
+    int motion = 0;               ///< modal G0..G3
+    float feed = 0;               ///< mm/min, 0 until the first F
+    bool hold = false;            ///< planner doesn't run
+
+    /** Bytes acted on as soon as they arrive, they never reach the RX buffer */
+    virtual bool isRealtime(uint8_t c) const { return false; }
+    virtual void realtime(uint8_t c) {}
+
+    /** Acts on a line. False if it can't be done yet (planner is full) and should be retried */
+    virtual bool execute(const std::string &line) = 0;
+
+    /** Queues a response line, line end is added */
+    void reply(const std::string &line);
+    void replyf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    /**
+     * Plans G0..G3 and G4 of a line; a line without motion is done at once. False if the planner is
+     * full. dwellScale is microseconds per P unit: seconds on Grbl, ms on Marlin.
+     */
+    bool plan(const std::string &line, uint32_t dwellScale);
+
+    /** Empties every buffer, as a reset does */
+    void flushAll();
+
+    size_t plannerFree() const { return cfg.plannerBlocks - planner.size(); }
+
+    /** Command slots free once the running command is done */
+    size_t commandsFree() const { return cfg.commandSlots - commands.size() + 1; }
+
+    size_t rxFree() const { return cfg.rxBuffer - rx.size(); }
+
+    bool isRunning() const { return !planner.empty() && !hold; }
+
+private:
+
+    std::deque<uint8_t> wire;      ///< written by the host, not arrived yet
+    std::deque<uint8_t> rx;
+    std::deque<std::string> commands;
+    std::deque<uint32_t> planner;  ///< us left of each block
+    std::deque<uint8_t> tx;        ///< responses not sent yet
+    std::deque<uint8_t> toHost;    ///< arrived at the host UART
+    double inCredit = 0, outCredit = 0;  ///< bytes the line may carry now
+    uint32_t parseLeft = 0;
+    bool parsing = false;
+    bool planned = false;          ///< first block has been planned
+    uint64_t idleUs = 0;           ///< planner empty since the last block, counted as starved once another comes
+
+    std::vector<std::string> executed;
+    Counters stats;
+
+    void receive(uint8_t c);
+    void takeLines();
+    void parse(uint32_t us);
+    void run(uint32_t us);
+    void transmit(uint32_t us);
+};
+
+
+/**
+ * Grbl 1.1: `ok` after a line is planned, `?` status with Bf:, `$I` with [OPT:]; realtime overrides
+ * are taken and ignored. Defaults are a stock 328p; grblHAL has a 1024 byte RX buffer and 35 blocks.
+ */
+class SimGrbl : public SimFirmware {
+public:
+    explicit SimGrbl(const Config &cfg = Config()) : SimFirmware(cfg) {}
+
+protected:
+    bool isRealtime(uint8_t c) const override;
+    void realtime(uint8_t c) override;
+    bool execute(const std::string &line) override;
+};
+
+
+/**
+ * Marlin 2 at 250000 baud: BUFSIZE 4, `ok` after a command is done and, with ADVANCED_OK, its `P` and `B` fields.
+ * Answers M105, M114, M115 and M503 like a printer does.
+ */
+class SimMarlin : public SimFirmware {
+public:
+    static Config defaults() { Config c; c.baud = 250000; c.commandSlots = 4; c.plannerBlocks = 16; c.rapidFeed = 9000; c.accel = 3000; return c; }
+
+    explicit SimMarlin(const Config &cfg = defaults(), bool advancedOk = false) : SimFirmware(cfg), advancedOk(advancedOk) {}
+
+protected:
+    bool execute(const std::string &line) override;
+
+private:
+    bool advancedOk;
+
+    void ok();
+};
@@ -0,0 +1,368 @@
+/**
+ * Streaming pipeline on the host: LineRing, SimpleCounter and the device loops of GrblDevice and
+ * MarlinDevice, run against simulated firmware in virtual time.
+ *
+ * `pio test -e native -v` prints one benchmark line per reference program:
+ * lines/s, planner starvation, bytes copied per line (into the device ring and out to the UART),
+ * UART writes per line and host CPU time of the device loop per line. All but the last are
+ * deterministic, so they can be compared between commits.
+ *
+ * Job is not built here, it needs SDScheduler and BlockReader tasks; the job task is modelled by
+ * scheduling lines of a program whenever the device queue has room, every JOB_POLL_US.
+ */
+#include <unity.h>
+#include <chrono>
+#include <set>
+
+#include "devices/GCodeDevice.h"
+#include "SimFirmware.h"
+
+
+static const uint32_t JOB_POLL_US = 1000;     ///< job task loop
+static const uint32_t TASK_US = 20;           ///< device task iteration on the ESP32
+static const uint64_t TIME_LIMIT_US = 600ULL*1000000;  ///< of virtual time per program
+
+static uint32_t linesReceived = 0;
+
+void deviceLineReceived(const char* line, size_t len) { linesReceived++; }
+
+
+typedef std::vector<std::string> Program;
+
+/** Photo engraving, bidirectional rows with a new power every 0.1 mm pixel */
+static Program laserRaster(size_t rows, size_t pixels, int feed) {
+    Program p = { "G21", "G90", "M4 S0" };
+    char b[64];
+    snprintf(b, sizeof(b), "G1 F%d", feed); p.push_back(b);
+    uint32_t seed = 1;
+    for(size_t r=0; r<rows; r++) {
+        bool back = r & 1;
+        snprintf(b, sizeof(b), "G0 X%.1f Y%.1f S0", back ? pixels*0.1 : 0.0, r*0.1); p.push_back(b);
+        for(size_t i=1; i<=pixels; i++) {
+            seed = seed*1103515245 + 12345;
+            int s = 128 + (int)((seed>>16) % 128) - (int)(i*128/pixels);
+            snprintf(b, sizeof(b), "G1 X%.1f S%d", (back ? pixels-i : i)*0.1, s<0 ? 0 : s); p.push_back(b);
+        }
+    }
+    p.push_back("M5");
+    return p;
+}
+
+/** Each layer has an outer perimeter of r=20 mm in 0.5 mm segments and a hole of r=3 mm in 0.1 mm ones, at 100 mm/s */
+static Program printPerimeters(size_t layers) {
+    Program p = { "G21", "M82", "G28", "G92 E0" }; // no G90, so jog wrapping can be told apart
+    char b[64];
+    float e = 0;
+    for(size_t l=0; l<layers; l++) {
+        snprintf(b, sizeof(b), "G0 Z%.2f F9000", 0.2f+l*0.2f); p.push_back(b);
+        const float radius[] = { 20, 3 };
+        const float segment[] = { 0.5f, 0.1f };
+        const int feed[] = { 3000, 6000 };
+        for(int k=0; k<2; k++) {
+            int n = (int)(2*M_PI*radius[k]/segment[k]);
+            float cx = 50+(k==0 ? 0 : 8), cy = 50;
+            snprintf(b, sizeof(b), "G0 X%.3f Y%.3f", cx+radius[k], cy); p.push_back(b);
+            snprintf(b, sizeof(b), "G1 F%d", feed[k]); p.push_back(b);
+            for(int i=1; i<=n; i++) {
+                float a = 2*M_PI*i/n;
+                e += segment[k]*0.033f;
+                snprintf(b, sizeof(b), "G1 X%.3f Y%.3f E%.5f", cx+radius[k]*cosf(a), cy+radius[k]*sinf(a), e); p.push_back(b);
+            }
+        }
+    }
+    return p;
+}
+
+
+struct Bench {
+    uint32_t lines = 0;          ///< program lines executed
+    double seconds = 0;          ///< from start until the firmware is idle
+    double starvedMs = 0;
+    double copiedPerLine = 0;
+    double writesPerLine = 0;
+    double hostNsPerLine = 0;
+    bool finished = false;
+};
+
+/** Every program line was executed once and in order; lines that aren't in the program may come between */
+static bool executedInOrder(const std::vector<std::string> &log, const Program &program) {
+    std::set<std::string> lines(program.begin(), program.end());
+    size_t j = 0;
+    for(const std::string &l: log) {
+        if(j<program.size() && l==program[j]) j++;
+        else if(lines.count(l)!=0) return false;
+    }
+    return j==program.size();
+}
+
+/** Streams program like Job does, calls during(ms) on every job loop */
+template<class D, class F>
+static Bench stream(const char* name, D &dev, SimFirmware &fw, const Program &program, F during) {
+    size_t next = 0;
+    uint64_t copied = 0, sinceJob = 0;
+    mock::reset();
+    mock::clock().world = [&](uint32_t us) {
+        fw.step(us);
+        sinceJob += us;
+        if(sinceJob < JOB_POLL_US) return;
+        sinceJob = 0;
+        during(millis());
+        while(next<program.size()) {
+            const std::string &l = program[next];
+            if(!dev.canSchedule(l.size()) || !dev.scheduleCommand(l.c_str(), l.size())) break;
+            copied += l.size();
+            next++;
+        }
+    };
+
+    dev.begin();
+    dev.watchStatus(GCodeDevice::WATCH_UI, STATUS_REQUEST_INTERVAL); // DRO screen is open
+    uint64_t hostNs = 0;
+    Bench b;
+    while(mock::clock().us < TIME_LIMIT_US) {
+        auto t0 = std::chrono::steady_clock::now();
+        dev.run();
+        hostNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count();
+        if(next==program.size() && dev.getQueueLength()==0 && dev.getSentQueueLength()==0 && fw.isIdle()) {
+            b.finished = true;
+            break;
+        }
+        dev.waitForEvent();
+        mock::advance(TASK_US);
+    }
+    mock::clock().world = nullptr;
+
+    const SimFirmware::Counters &c = fw.counters();
+    b.lines = next;
+    b.seconds = mock::clock().us/1e6;
+    b.starvedMs = c.starvedUs/1000.0;
+    b.copiedPerLine = (double)(copied + c.hostBytes)/program.size();
+    b.writesPerLine = (double)c.hostWrites/program.size();
+    b.hostNsPerLine = (double)hostNs/program.size();
+    printf("%-32s %6u lines %7.2f s %6.0f lines/s  starved %7.1f ms  %5.1f B copied/line  %4.2f writes/line  %5.0f ns/line  RX high %u/%u\n",
+        name, b.lines, b.seconds, b.lines/b.seconds, b.starvedMs, b.copiedPerLine, b.writesPerLine, b.hostNsPerLine,
+        (unsigned)c.rxHighWater, (unsigned)fw.config().rxBuffer);
+    return b;
+}
+
+template<class D>
+static Bench stream(const char* name, D &dev, SimFirmware &fw, const Program &program) {
+    return stream(name, dev, fw, program, [](uint32_t) {});
+}
+
+static void checkStreamed(const Bench &b, SimFirmware &fw, GCodeDevice &dev, const Program &program) {
+    TEST_ASSERT_TRUE(b.finished);
+    TEST_ASSERT_FALSE(dev.isInPanic());
+    TEST_ASSERT_EQUAL_UINT32(0, fw.counters().lostBytes);
+    TEST_ASSERT_TRUE(executedInOrder(fw.log(), program));
+}
+
+
+
+void setUp() { mock::reset(); }
+
+void tearDown() {}
+
+
+void test_line_ring_wraps() {
+    LineRing ring;
+    TEST_ASSERT_TRUE(ring.begin(40));
+    char line[16];
+    uint32_t pushed = 0, released = 0;
+    for(int i=0; i<200; i++) {
+        size_t len = snprintf(line, sizeof(line), "G1 X%d", i*37 % 1000);
+        while(!ring.push(line, len)) {
+            // device side: send the oldest unsent, release the oldest sent
+            char* msg;
+            size_t n = ring.peekUnsent(msg);
+            if(n!=0) ring.markSent();
+            else { ring.release(); released++; }
+        }
+        pushed++;
+        TEST_ASSERT_TRUE(ring.bytes()<=ring.getCapacity());
+    }
+    char* msg;
+    while(ring.peekUnsent(msg)!=0) ring.markSent();
+    while(released<pushed) { ring.release(); released++; }
+    TEST_ASSERT_EQUAL_UINT32(0, ring.bytes());
+    TEST_ASSERT_EQUAL_UINT32(0, ring.getUnsentBytes());
+}
+
+void test_line_ring_keeps_content() {
+    LineRing ring;
+    ring.begin(32);
+    const char* a = "G1 X1";
+    const char* b = "G1 X22";
+    TEST_ASSERT_TRUE(ring.push(a, 5));
+    TEST_ASSERT_TRUE(ring.push(b, 6));
+    char* msg;
+    TEST_ASSERT_EQUAL_UINT32(5, ring.peekUnsent(msg));
+    TEST_ASSERT_EQUAL_STRING(a, msg);
+    ring.markSent();
+    TEST_ASSERT_EQUAL_UINT32(6, ring.peekUnsent(msg));
+    TEST_ASSERT_EQUAL_STRING(b, msg);
+    ring.markSent();
+    ring.release();
+    // 22 bytes fit neither after the second line (15 left) nor before it (8 freed); an empty ring starts over
+    TEST_ASSERT_FALSE(ring.push("G1 X1.000 Y2.000 Z3", 19));
+    ring.release();
+    TEST_ASSERT_TRUE(ring.push("G1 X1.000 Y2.000 Z3", 19));
+    TEST_ASSERT_EQUAL_UINT32(19, ring.peekUnsent(msg));
+    TEST_ASSERT_EQUAL_STRING("G1 X1.000 Y2.000 Z3", msg);
+}
+
+void test_line_ring_pushes_all_or_nothing() {
+    LineRing ring;
+    ring.begin(32);
+    TEST_ASSERT_TRUE(ring.push("G1 X1", 5)); // G91 and the jog line would still fit after it
+    const char* jog[] = { "G91", "G0 F100 X1.000", "G90" };
+    const size_t lens[] = { 3, 14, 3 };
+    TEST_ASSERT_FALSE(ring.push(jog, lens, 3));
+    TEST_ASSERT_EQUAL_UINT32(1, ring.getUnsentLines());
+    TEST_ASSERT_EQUAL_UINT32(5, ring.getUnsentBytes());
+    TEST_ASSERT_EQUAL_UINT32(8, ring.bytes());
+
+    char* msg;
+    ring.peekUnsent(msg);
+    ring.markSent(true);
+    TEST_ASSERT_TRUE(ring.push(jog, lens, 3));
+    TEST_ASSERT_EQUAL_UINT32(3, ring.getUnsentLines());
+    TEST_ASSERT_EQUAL_UINT32(3, ring.peekUnsent(msg));
+    TEST_ASSERT_EQUAL_STRING("G91", msg);
+}
+
+void test_counter_window() {
+    LineRing ring;
+    ring.begin(64);
+    SimpleCounter<16> sent;
+    sent.begin(4);
+    const char* l = "G1 X1";
+    for(int i=0; i<3; i++) TEST_ASSERT_TRUE(ring.push(l, 5));
+    char* msg = nullptr;
+    ring.peekUnsent(msg);
+    TEST_ASSERT_TRUE(sent.push(msg, 5, &ring));
+    ring.markSent();
+    ring.peekUnsent(msg);
+    TEST_ASSERT_TRUE(sent.push(msg, 5, &ring));
+    ring.markSent();
+    TEST_ASSERT_EQUAL_UINT32(12, sent.bytes());
+    TEST_ASSERT_FALSE(sent.canPush(5));       // 12+6 > 16
+
+    sent.setDrained(1);                       // left the RX buffer, it's not counted any more
+    TEST_ASSERT_EQUAL_UINT32(6, sent.bytes());
+    TEST_ASSERT_TRUE(sent.canPush(5));
+
+    sent.pop();                               // ack of the drained line
+    TEST_ASSERT_EQUAL_UINT32(0, sent.getDrained());
+    TEST_ASSERT_EQUAL_UINT32(6, sent.bytes());
+    TEST_ASSERT_EQUAL_UINT32(1, sent.size());
+    sent.pop();
+    TEST_ASSERT_EQUAL_UINT32(0, sent.bytes());
+    TEST_ASSERT_EQUAL_UINT32(1, ring.getUnsentLines());
+    TEST_ASSERT_EQUAL_UINT32(8, ring.bytes());  // released lines left the ring
+}
+
+
+void test_grbl_raster() {
+    Program p = laserRaster(20, 300, 6000);
+    SimGrbl fw;
+    GrblDevice dev(&fw);
+    Bench b = stream("grbl 328p, laser raster", dev, fw, p);
+    checkStreamed(b, fw, dev, p);
+    TEST_ASSERT_EQUAL_UINT32(128, dev.getRxBufferSize());
+}
+
+void test_grblhal_raster() {
+    Program p = laserRaster(20, 300, 6000);
+    SimFirmware::Config c;
+    c.baud = 250000;
+    c.rxBuffer = 1024;
+    c.plannerBlocks = 35;
+    c.okLatencyUs = 20;
+    c.maxBlockRate = 5000;
+    SimGrbl fw(c);
+    GrblDevice dev(&fw);
+    Bench b = stream("grblHAL, laser raster", dev, fw, p);
+    checkStreamed(b, fw, dev, p);
+    TEST_ASSERT_EQUAL_UINT32(1024, dev.getRxBufferSize()); // from [OPT:], the window follows it
+}
+
+void test_marlin_perimeters() {
+    Program p = printPerimeters(5);
+    SimMarlin fw;
+    MarlinDevice dev(&fw);
+    Bench b = stream("marlin, perimeters", dev, fw, p);
+    checkStreamed(b, fw, dev, p);
+}
+
+void test_marlin_advanced_ok_perimeters() {
+    Program p = printPerimeters(5);
+    SimMarlin fw(SimMarlin::defaults(), true);
+    MarlinDevice dev(&fw);
+    Bench b = stream("marlin ADVANCED_OK, perimeters", dev, fw, p);
+    checkStreamed(b, fw, dev, p);
+}
+
+/** Jog segments sent while a job streams are wrapped in G91/G90 with nothing between */
+void test_marlin_jog_keeps_absolute_mode() {
+    Program p = printPerimeters(1);
+    SimMarlin fw;
+    MarlinDevice dev(&fw);
+    int jogs = 0;
+    Bench b = stream("marlin, perimeters + jog", dev, fw, p, [&](uint32_t ms) {
+        if(ms>=500 && ms%100==0 && jogs<5 && dev.jog(0, 1.0f, 1000)) jogs++;
+    });
+    checkStreamed(b, fw, dev, p);
+    TEST_ASSERT_EQUAL_INT(5, jogs);
+    const std::vector<std::string> &log = fw.log();
+    int wrapped = 0;
+    for(size_t i=0; i<log.size(); i++) {
+        if(log[i]!="G91") continue;
+        TEST_ASSERT_TRUE(i+2<log.size());
+        TEST_ASSERT_EQUAL_STRING("G0 F1000 X1.000", log[i+1].c_str());
+        TEST_ASSERT_EQUAL_STRING("G90", log[i+2].c_str());
+        wrapped++;
+    }
+    TEST_ASSERT_EQUAL_INT(5, wrapped);
+}
+
+void test_detects_grbl() {
+    SimGrbl fw;
+    mock::clock().world = [&](uint32_t us) { fw.step(us); };
+    GCodeDevice* dev = DeviceDetector::detectPrinter(fw);
+    mock::clock().world = nullptr;
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQUAL_STRING("grbl", dev->getType().c_str());
+    TEST_ASSERT_EQUAL_UINT32(115200, DeviceDetector::serialBaud);
+    dev->~GCodeDevice();
+}
+
+void test_detects_marlin_baud() {
+    SimFirmware::Config c = SimMarlin::defaults();
+    c.baud = 250000;
+    SimMarlin fw(c);
+    mock::clock().world = [&](uint32_t us) { fw.step(us); };
+    GCodeDevice* dev = DeviceDetector::detectPrinter(fw);
+    mock::clock().world = nullptr;
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQUAL_STRING("marlin", dev->getType().c_str());
+    TEST_ASSERT_EQUAL_UINT32(250000, DeviceDetector::serialBaud);
+    dev->~GCodeDevice();
+}
+
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_line_ring_wraps);
+    RUN_TEST(test_line_ring_keeps_content);
+    RUN_TEST(test_line_ring_pushes_all_or_nothing);
+    RUN_TEST(test_counter_window);
+    RUN_TEST(test_grbl_raster);
+    RUN_TEST(test_grblhal_raster);
+    RUN_TEST(test_marlin_perimeters);
+    RUN_TEST(test_marlin_advanced_ok_perimeters);
+    RUN_TEST(test_marlin_jog_keeps_absolute_mode);
+    RUN_TEST(test_detects_grbl);
+    RUN_TEST(test_detects_marlin_baud);
+    return UNITY_END();
+}